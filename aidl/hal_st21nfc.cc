@@ -73,6 +73,8 @@ extern bool hal_wrapper_open(st21nfc_dev_t* dev, nfc_stack_callback_t* p_cback,
 
 extern int hal_wrapper_close(int call_cb, int nfc_mode);
 
+extern bool hal_wrapper_power_cycle();
+
 extern void hal_wrapper_send_config();
 extern void hal_wrapper_factoryReset();
 extern void hal_wrapper_set_observer_mode(uint8_t enable, bool per_tech_cmd);
@@ -585,10 +587,13 @@ int StNfc_hal_power_cycle() {
     (void)pthread_mutex_unlock(&hal_mtx);
     return ret;
   }
-  async_callback_post(HAL_NFC_OPEN_CPLT_EVT, HAL_NFC_STATUS_OK);
+  // HAL_NFC_OPEN_CPLT_EVT is reported once the CLF is back
+  if (!hal_wrapper_power_cycle()) {
+    ret = HAL_NFC_STATUS_FAILED;
+  }
 
   (void)pthread_mutex_unlock(&hal_mtx);
-  return HAL_NFC_STATUS_OK;
+  return ret;
 }
 
 void StNfc_hal_factoryReset() {
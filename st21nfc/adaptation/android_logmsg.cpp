@@ -46,17 +46,22 @@ pthread_mutex_t halLogMutex;
 **                  STNFC_TRACE_LEVEL_VERBOSE 4     * Verbose messages
 **
 *******************************************************************************/
-unsigned char InitializeSTLogLevel() {
-  unsigned long num = 0;
-  int ret;
+static void ApplyConfLogLevel() {
+  unsigned long num = 1;
 
-  num = 1;
   if (GetNumValue(NAME_STNFC_HAL_LOGLEVEL, &num, sizeof(num))) {
     hal_conf_trace_level = (unsigned char)num;
     if (hal_trace_level != STNFC_TRACE_LEVEL_VERBOSE) {
       hal_trace_level = hal_conf_trace_level;
     }
   }
+}
+
+unsigned char InitializeSTLogLevel() {
+  int ret;
+
+  ApplyConfLogLevel();
+  RegisterConfigListener(ApplyConfLogLevel);
 
   STLOG_HAL_D("%s: HAL log level=%u, hal_log_cnt (before reset): #%04X",
               __func__, hal_trace_level, hal_log_cnt);
@@ -79,6 +84,11 @@ void DispHal(const char* title, const void* data, size_t length) {
   bool privacy = false;
   uint16_t frame_nb;
 
+  // Nothing below DEBUG is printed, skip the hex formatting altogether.
+  if (!STLOG_HAL_ENABLED(STNFC_TRACE_LEVEL_DEBUG)) {
+    return;
+  }
+
   pthread_mutex_lock(&halLogMutex);
   frame_nb = hal_log_cnt;
 
@@ -23,15 +23,25 @@
 #include "config.h"
 
 #include <android-base/properties.h>
+#include <fcntl.h>
 #include <log/log.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
-#include <list>
+#include <algorithm>
+#include <atomic>
+#include <memory>
 #include <string>
 #include <vector>
 
 #include "android_logmsg.h"
+#include "hex_decode.h"
 const char alternative_config_path[] = "";
 const char* transport_config_paths[] = {"/odm/etc/", "/vendor/etc/", "/etc/"};
 
@@ -40,45 +50,113 @@ const int transport_config_path_size =
 #define config_name "libnfc-hal-st.conf"
 #define extra_config_base "libnfc-hal-st-"
 #define extra_config_ext ".conf"
+// parsed copies of the config files, see CNfcConfig::saveSnapshot()
+#define config_snapshot_path "/data/vendor/nfc/"
+#define config_snapshot_ext ".snapshot"
+#define CONFIG_SNAPSHOT_MAGIC 0x46435453 /* "STCF" */
+#define CONFIG_SNAPSHOT_VERSION 2
+// max number of subsystems notified of a config reload
+#define MAX_CONFIG_LISTENERS 8
+// file events closer than this are handled with a single reload
+#define CONFIG_RELOAD_SETTLE_MS 200
 #define IsStringValue 0x80000000
+// number of keys that can be resolved with GetConfigKey()
+#define MAX_CONFIG_KEYS 64
+// CNfcConfig::m_keys entry of a key not looked up yet, or of a missing setting
+#define CONFIG_KEY_UNRESOLVED -2
+#define CONFIG_KEY_ABSENT -1
 
 using namespace ::std;
 
-class CNfcParam : public string {
+// A snapshot file is this header, header.param_count ConfigSnapshotParam,
+// then header.pool_size bytes of string pool. It is only valid for the
+// config file it was made from, as long as that file is not modified: files
+// of the read-only partitions all have the same mtime, so the content hash
+// is part of the key.
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  char source[256];
+  uint64_t source_size;
+  int64_t source_mtime_sec;
+  int64_t source_mtime_nsec;
+  uint64_t source_hash;
+  uint32_t param_count;
+  uint32_t pool_size;
+} ConfigSnapshotHeader;
+
+typedef struct {
+  uint32_t name;   // offset of the name in the pool
+  uint32_t value;  // offset of the value in the pool
+  uint32_t len;    // 0 for a numerical setting
+  uint32_t reserved;
+  uint64_t num;
+} ConfigSnapshotParam;
+
+// A parameter only references its name and value, both stored in the string
+// pool of the file it was read from.
+class CNfcParam {
  public:
-  CNfcParam();
-  CNfcParam(const char* name, const string& value);
+  CNfcParam(const char* name, const char* value, size_t len);
   CNfcParam(const char* name, unsigned long value);
-  virtual ~CNfcParam();
+  const char* c_str() const { return m_name; }
   unsigned long numValue() const { return m_numValue; }
-  const char* str_value() const { return m_str_value.c_str(); }
-  size_t str_len() const { return m_str_value.length(); }
+  const char* str_value() const { return m_str_value; }
+  size_t str_len() const { return m_str_len; }
 
  private:
-  string m_str_value;
+  const char* m_name;
+  const char* m_str_value;
+  size_t m_str_len;
   unsigned long m_numValue;
 };
 
-class CNfcConfig : public vector<const CNfcParam*> {
+class CNfcConfig {
  public:
   virtual ~CNfcConfig();
-  static CNfcConfig& GetInstance();
+  static shared_ptr<CNfcConfig> GetInstance();
   friend void readOptionalConfig(const char* optional);
+  friend void resetConfig();
 
   bool getValue(const char* name, char* pValue, size_t& len) const;
+  static bool getValue(const CNfcParam* pParam, char* pValue, size_t& len);
   bool getValue(const char* name, unsigned long& rValue) const;
   bool getValue(const char* name, unsigned short& rValue) const;
   bool getValue(const char* name, char* pValue, long len, long* readlen) const;
   const CNfcParam* find(const char* p_name) const;
+  static int getKey(const char* p_name);
+  const CNfcParam* findByKey(int key) const;
+  static bool reload();
+  const vector<string>& files() const { return m_files; }
   void clean();
+  size_t size() const { return m_index.size(); }
+  bool empty() const { return m_index.empty(); }
 
  private:
   CNfcConfig();
   bool readConfig(const char* name, bool bResetContent);
-  void moveFromList();
-  void moveToList();
-  void add(const CNfcParam* pParam);
-  list<const CNfcParam*> m_list;
+  static shared_ptr<CNfcConfig> readFiles(const vector<string>& files);
+  size_t parse(const char* data, size_t length);
+  bool loadSnapshot(const char* name, const struct stat& file_stat,
+                    uint64_t file_hash);
+  void saveSnapshot(const char* name, const struct stat& file_stat,
+                    uint64_t file_hash,
+                    size_t first, size_t pool_size);
+  void buildIndex();
+  void resetKeys();
+  // parameters, in the order they were read
+  vector<CNfcParam> m_params;
+  // m_params positions sorted by name, latest definition of a name only
+  vector<uint32_t> m_index;
+  // one string pool per file read: parsed into memory or mapped snapshot
+  vector<shared_ptr<char>> m_pools;
+  // open addressing table of m_index entries, -1 for an empty slot
+  vector<int32_t> m_hash;
+  uint32_t m_hashMask;
+  // m_params position of each key, resolved on first use
+  mutable atomic<int32_t> m_keys[MAX_CONFIG_KEYS];
+  // config files read, base file first
+  vector<string> m_files;
   bool mValidFile;
 
   unsigned long state;
@@ -88,6 +166,23 @@ class CNfcConfig : public vector<const CNfcParam*> {
   inline void Reset(unsigned long f) { state &= ~f; }
 };
 
+// Config in use, only accessed with atomic_load() / atomic_store(). A live
+// reload reads the files into a new CNfcConfig and swaps it in; each lookup
+// holds a reference, the previous config is freed when the last one ends.
+static shared_ptr<CNfcConfig> sConfig;
+// serializes the changes of sConfig, the lookups do not take it
+static pthread_mutex_t sConfigMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// names of the keys handed out by GetConfigKey()
+static pthread_mutex_t sKeyMutex = PTHREAD_MUTEX_INITIALIZER;
+static const char* sKeyNames[MAX_CONFIG_KEYS];
+static atomic<int> sKeyCount(0);
+
+static pthread_mutex_t sListenerMutex = PTHREAD_MUTEX_INITIALIZER;
+static config_listener_t sListeners[MAX_CONFIG_LISTENERS];
+static int sListenerCount = 0;
+static bool sWatcherStarted = false;
+
 /*******************************************************************************
 **
 ** Function:    isPrintable()
@@ -139,6 +234,42 @@ inline int getDigitValue(char c, int base) {
   return 0;
 }
 
+/*******************************************************************************
+**
+** Function:    hashName()
+**
+** Description: FNV-1a hash of a setting name
+**
+** Returns:     32 bits hash
+**
+*******************************************************************************/
+inline uint32_t hashName(const char* name) {
+  uint32_t h = 2166136261u;
+  while (*name) {
+    h ^= (uint8_t)*name++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/*******************************************************************************
+**
+** Function:    hashContent()
+**
+** Description: FNV-1a hash of a config file
+**
+** Returns:     64 bits hash
+**
+*******************************************************************************/
+static uint64_t hashContent(const char* data, size_t size) {
+  uint64_t h = 14695981039346656037ull;
+  for (size_t i = 0; i < size; i++) {
+    h ^= (uint8_t)data[i];
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
 /*******************************************************************************
 **
 ** Function:    findConfigFile()
@@ -166,13 +297,83 @@ bool findConfigFile(const string& configName, string& filePath) {
 **
 ** Function:    CNfcConfig::readConfig()
 **
-** Description: read Config settings and parse them into a linked list
-**              move the element from linked list to a array at the end
+** Description: read Config settings from its snapshot when up to date,
+**              otherwise map the config file, parse it and save a snapshot
 **
 ** Returns:     1, if there are any config data, 0 otherwise
 **
 *******************************************************************************/
 bool CNfcConfig::readConfig(const char* name, bool bResetContent) {
+  int fd = -1;
+  struct stat file_stat;
+  const char* data = NULL;
+  const char* from = "snapshot";
+  size_t first;
+  struct timespec start, stop;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  /* open config file, map it */
+  if ((fd = open(name, O_RDONLY | O_CLOEXEC)) < 0 ||
+      fstat(fd, &file_stat) != 0) {
+    STLOG_HAL_W("%s Cannot open config file %s\n", __func__, name);
+    if (fd >= 0) close(fd);
+    if (bResetContent) {
+      STLOG_HAL_W("%s Using default value for all settings\n", __func__);
+      mValidFile = false;
+    }
+    return false;
+  }
+  if (file_stat.st_size > 0) {
+    data = (const char*)mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE,
+                             fd, 0);
+    if (data == MAP_FAILED) {
+      STLOG_HAL_E("%s Cannot map config file %s (%d)\n", __func__, name,
+                  errno);
+      close(fd);
+      return false;
+    }
+  }
+  close(fd);
+  STLOG_HAL_D("%s Opened %s config %s\n", __func__,
+              (bResetContent ? "base" : "optional"), name);
+
+  mValidFile = true;
+  if (bResetContent) clean();
+  m_files.push_back(name);
+
+  first = m_params.size();
+  if (data != NULL) madvise((void*)data, file_stat.st_size, MADV_SEQUENTIAL);
+  uint64_t file_hash = hashContent(data, file_stat.st_size);
+  if (!loadSnapshot(name, file_stat, file_hash)) {
+    from = "file";
+    size_t pool_size = parse(data, file_stat.st_size);
+    saveSnapshot(name, file_stat, file_hash, first, pool_size);
+  }
+
+  if (data != NULL) munmap((void*)data, file_stat.st_size);
+
+  buildIndex();
+
+  clock_gettime(CLOCK_MONOTONIC, &stop);
+  STLOG_HAL_D("%s Read %s from %s: %zu settings in %ld us\n", __func__, name,
+              from, m_params.size() - first,
+              (long)((stop.tv_sec - start.tv_sec) * 1000000 +
+                     (stop.tv_nsec - start.tv_nsec) / 1000));
+  return size() > 0;
+}
+
+/*******************************************************************************
+**
+** Function:    CNfcConfig::parse()
+**
+** Description: parse the settings of a config file in a single pass
+**              names and values are copied into a new string pool, the
+**              parameters appended to the m_params array
+**
+** Returns:     number of bytes used in the string pool
+**
+*******************************************************************************/
+size_t CNfcConfig::parse(const char* data, size_t length) {
   enum {
     BEGIN_LINE = 1,
     TOKEN,
@@ -183,55 +384,52 @@ bool CNfcConfig::readConfig(const char* name, bool bResetContent) {
     END_LINE
   };
 
-  FILE* fd = NULL;
-  string token;
-  string strValue;
+  const char* p;
+  const char* pEnd;
+  char* pool;
+  char* poolEnd;
+  char* cursor;     // next free byte of the pool
+  char* committed;  // end of the last parameter added
+  const char* token = NULL;
+  const char* strValue = NULL;
+  const char* arrayEnd;
+  ssize_t arrayLen;
   unsigned long numValue = 0;
-  CNfcParam* pParam = NULL;
   int i = 0;
   int base = 0;
   char c = 0;
   int bflag = 0;
   state = BEGIN_LINE;
-  /* open config file, read it into a buffer */
-  if ((fd = fopen(name, "rb")) == NULL) {
-    STLOG_HAL_W("%s Cannot open config file %s\n", __func__, name);
-    if (bResetContent) {
-      STLOG_HAL_W("%s Using default value for all settings\n", __func__);
-      mValidFile = false;
-    }
-    return false;
-  }
-  STLOG_HAL_D("%s Opened %s config %s\n", __func__,
-              (bResetContent ? "base" : "optional"), name);
 
-  mValidFile = true;
-  if (size() > 0) {
-    if (bResetContent)
-      clean();
-    else
-      moveToList();
-  }
+  // A name takes at most its characters plus the '=', a value at most the
+  // characters it is written with: the pool never outgrows the file.
+  m_pools.emplace_back(new char[length + 1], default_delete<char[]>());
+  pool = m_pools.back().get();
+  poolEnd = pool + length + 1;
+  cursor = committed = pool;
 
-  while (!feof(fd) && fread(&c, 1, 1, fd) == 1) {
+  for (p = data, pEnd = data + length; p < pEnd; ++p) {
+    c = *p;
     switch (state & 0xff) {
       case BEGIN_LINE:
         if (c == '#')
           state = END_LINE;
         else if (isPrintable(c)) {
           i = 0;
-          token.erase();
-          strValue.erase();
+          // drop whatever an abandoned line left in the pool
+          cursor = committed;
+          token = cursor;
           state = TOKEN;
-          token.push_back(c);
+          *cursor++ = c;
         }
         break;
       case TOKEN:
         if (c == '=') {
-          token.push_back('\0');
+          *cursor++ = '\0';
+          strValue = cursor;
           state = BEGIN_QUOTE;
         } else if (isPrintable(c))
-          token.push_back(c);
+          *cursor++ = c;
         else
           state = END_LINE;
         break;
@@ -252,6 +450,17 @@ bool CNfcConfig::readConfig(const char* name, bool bResetContent) {
           base = 16;
           i = 0;
           Set(IsStringValue);
+          // decode a well formed byte array at once, up to its closing brace
+          arrayEnd = (const char*)memchr(p + 1, '}', pEnd - p - 1);
+          if (arrayEnd != NULL &&
+              (arrayLen = HexDecode(p + 1, arrayEnd - p - 1, (uint8_t*)cursor,
+                                    HEX_DECODE_SEPARATORS |
+                                        HEX_DECODE_SKIP_SPACES |
+                                        HEX_DECODE_PAD_ODD)) >= 0) {
+            cursor += arrayLen;
+            bflag = 0;
+            p = arrayEnd;
+          }
         } else
           state = END_LINE;
         break;
@@ -289,9 +498,8 @@ bool CNfcConfig::readConfig(const char* name, bool bResetContent) {
           }
           if (i > 0) {
             int n = (i + 1) / 2;
-            while (n-- > 0) {
-              unsigned char c = (numValue >> (n * 8)) & 0xFF;
-              strValue.push_back(c);
+            while (n-- > 0 && cursor < poolEnd) {
+              *cursor++ = (numValue >> (n * 8)) & 0xFF;
             }
           }
           Set(IsStringValue);
@@ -309,25 +517,26 @@ bool CNfcConfig::readConfig(const char* name, bool bResetContent) {
           }
           if (Is(IsStringValue) && base == 16 && i > 0) {
             int n = (i + 1) / 2;
-            while (n-- > 0) strValue.push_back(((numValue >> (n * 8)) & 0xFF));
+            while (n-- > 0 && cursor < poolEnd)
+              *cursor++ = (numValue >> (n * 8)) & 0xFF;
           }
-          if (strValue.length() > 0)
-            pParam = new CNfcParam(token.c_str(), strValue);
+          if (cursor > strValue)
+            m_params.emplace_back(token, strValue, cursor - strValue);
           else
-            pParam = new CNfcParam(token.c_str(), numValue);
-          add(pParam);
-          strValue.erase();
+            m_params.emplace_back(token, numValue);
+          committed = cursor;
+          strValue = cursor;
           numValue = 0;
         }
         break;
       case STR_VALUE:
         if (c == '"') {
-          strValue.push_back('\0');
+          *cursor++ = '\0';
           state = END_LINE;
-          pParam = new CNfcParam(token.c_str(), strValue);
-          add(pParam);
+          m_params.emplace_back(token, strValue, cursor - strValue);
+          committed = cursor;
         } else if (isPrintable(c))
-          strValue.push_back(c);
+          *cursor++ = c;
         break;
       case END_LINE:
         if (c == '\n' || c == '\r') state = BEGIN_LINE;
@@ -337,10 +546,217 @@ bool CNfcConfig::readConfig(const char* name, bool bResetContent) {
     }
   }
 
-  fclose(fd);
+  return committed - pool;
+}
 
-  moveFromList();
-  return size() > 0;
+/*******************************************************************************
+**
+** Function:    snapshotPath()
+**
+** Description: get the snapshot file of a config file
+**
+** Returns:     true if the config file can have a snapshot
+**
+*******************************************************************************/
+static bool snapshotPath(const char* name, string& path) {
+  const char* base = strrchr(name, '/');
+
+  if (strlen(name) >= sizeof(((ConfigSnapshotHeader*)0)->source)) return false;
+  path.assign(config_snapshot_path);
+  path += (base != NULL) ? base + 1 : name;
+  path += config_snapshot_ext;
+  return true;
+}
+
+/*******************************************************************************
+**
+** Function:    CNfcConfig::loadSnapshot()
+**
+** Description: map the snapshot of a config file and add its settings,
+**              the mapping is kept as the string pool of these settings
+**
+** Returns:     true if an up to date snapshot was loaded
+**
+*******************************************************************************/
+bool CNfcConfig::loadSnapshot(const char* name, const struct stat& file_stat,
+                              uint64_t file_hash) {
+  string path;
+  struct stat snap_stat;
+  const ConfigSnapshotHeader* hdr;
+  const ConfigSnapshotParam* params;
+  const char* pool;
+  void* map;
+  int fd;
+
+  if (!snapshotPath(name, path)) return false;
+  if ((fd = open(path.c_str(), O_RDONLY | O_CLOEXEC)) < 0) return false;
+  if (fstat(fd, &snap_stat) != 0 ||
+      (size_t)snap_stat.st_size < sizeof(ConfigSnapshotHeader)) {
+    close(fd);
+    return false;
+  }
+  map = mmap(NULL, snap_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return false;
+
+  size_t map_size = snap_stat.st_size;
+  shared_ptr<char> mapping((char*)map,
+                           [map_size](char* m) { munmap(m, map_size); });
+  hdr = (const ConfigSnapshotHeader*)map;
+  if (hdr->magic != CONFIG_SNAPSHOT_MAGIC ||
+      hdr->version != CONFIG_SNAPSHOT_VERSION ||
+      strncmp(hdr->source, name, sizeof(hdr->source)) != 0 ||
+      hdr->source_size != (uint64_t)file_stat.st_size ||
+      hdr->source_mtime_sec != (int64_t)file_stat.st_mtim.tv_sec ||
+      hdr->source_mtime_nsec != (int64_t)file_stat.st_mtim.tv_nsec ||
+      hdr->source_hash != file_hash ||
+      hdr->param_count > (map_size - sizeof(*hdr)) / sizeof(*params) ||
+      map_size - sizeof(*hdr) - hdr->param_count * sizeof(*params) !=
+          hdr->pool_size) {
+    STLOG_HAL_D("%s %s is out of date\n", __func__, path.c_str());
+    return false;
+  }
+  params = (const ConfigSnapshotParam*)(hdr + 1);
+  pool = (const char*)(params + hdr->param_count);
+
+  // every name must be terminated within the pool
+  for (uint32_t i = 0; i < hdr->param_count; i++) {
+    if (params[i].name >= hdr->pool_size ||
+        memchr(pool + params[i].name, '\0',
+               hdr->pool_size - params[i].name) == NULL ||
+        params[i].value > hdr->pool_size ||
+        params[i].len > hdr->pool_size - params[i].value) {
+      STLOG_HAL_E("%s %s is corrupted\n", __func__, path.c_str());
+      return false;
+    }
+  }
+
+  m_params.reserve(m_params.size() + hdr->param_count);
+  for (uint32_t i = 0; i < hdr->param_count; i++) {
+    if (params[i].len > 0)
+      m_params.emplace_back(pool + params[i].name, pool + params[i].value,
+                            params[i].len);
+    else
+      m_params.emplace_back(pool + params[i].name,
+                            (unsigned long)params[i].num);
+  }
+  m_pools.push_back(mapping);
+  return true;
+}
+
+/*******************************************************************************
+**
+** Function:    CNfcConfig::saveSnapshot()
+**
+** Description: write the settings just parsed from a config file into its
+**              snapshot, replaced atomically so a reader never sees a
+**              partial file
+**
+** Returns:     none
+**
+*******************************************************************************/
+void CNfcConfig::saveSnapshot(const char* name, const struct stat& file_stat,
+                              uint64_t file_hash, size_t first,
+                              size_t pool_size) {
+  string path, tmpPath;
+  ConfigSnapshotHeader hdr;
+  vector<ConfigSnapshotParam> params(m_params.size() - first);
+  const char* pool = m_pools.back().get();
+  bool ok;
+  int fd;
+
+  if (!snapshotPath(name, path)) return;
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = CONFIG_SNAPSHOT_MAGIC;
+  hdr.version = CONFIG_SNAPSHOT_VERSION;
+  strncpy(hdr.source, name, sizeof(hdr.source) - 1);
+  hdr.source_size = file_stat.st_size;
+  hdr.source_mtime_sec = file_stat.st_mtim.tv_sec;
+  hdr.source_mtime_nsec = file_stat.st_mtim.tv_nsec;
+  hdr.source_hash = file_hash;
+  hdr.param_count = params.size();
+  hdr.pool_size = pool_size;
+  for (size_t i = 0; i < params.size(); i++) {
+    const CNfcParam& param = m_params[first + i];
+    params[i].name = param.c_str() - pool;
+    params[i].value = (param.str_len() > 0) ? param.str_value() - pool : 0;
+    params[i].len = param.str_len();
+    params[i].reserved = 0;
+    params[i].num = param.numValue();
+  }
+
+  tmpPath = path + ".tmp";
+  fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    STLOG_HAL_D("%s Cannot create %s (%d)\n", __func__, tmpPath.c_str(),
+                errno);
+    return;
+  }
+  ok = write(fd, &hdr, sizeof(hdr)) == (ssize_t)sizeof(hdr);
+  ok = ok && write(fd, params.data(), params.size() * sizeof(params[0])) ==
+                 (ssize_t)(params.size() * sizeof(params[0]));
+  ok = ok && write(fd, pool, pool_size) == (ssize_t)pool_size;
+  ok = (close(fd) == 0) && ok;
+  if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0) {
+    STLOG_HAL_W("%s Cannot write %s (%d)\n", __func__, path.c_str(), errno);
+    unlink(tmpPath.c_str());
+    return;
+  }
+  STLOG_HAL_D("%s Saved %s\n", __func__, path.c_str());
+}
+
+/*******************************************************************************
+**
+** Function:    CNfcConfig::buildIndex()
+**
+** Description: sort the settings by name, a setting defined several times
+**              (in the same file or in an optional file) keeps the value
+**              read last
+**
+** Returns:     none
+**
+*******************************************************************************/
+void CNfcConfig::buildIndex() {
+  m_index.resize(m_params.size());
+  // latest first, so that the stable sort keeps it in front of its duplicates
+  for (size_t i = 0; i < m_index.size(); i++)
+    m_index[i] = m_index.size() - 1 - i;
+  stable_sort(m_index.begin(), m_index.end(), [this](uint32_t a, uint32_t b) {
+    return strcmp(m_params[a].c_str(), m_params[b].c_str()) < 0;
+  });
+  m_index.erase(unique(m_index.begin(), m_index.end(),
+                       [this](uint32_t a, uint32_t b) {
+                         return strcmp(m_params[a].c_str(),
+                                       m_params[b].c_str()) == 0;
+                       }),
+                m_index.end());
+
+  // table at most half full
+  size_t slots = 8;
+  while (slots < m_index.size() * 2) slots <<= 1;
+  m_hash.assign(slots, -1);
+  m_hashMask = slots - 1;
+  for (size_t i = 0; i < m_index.size(); i++) {
+    uint32_t h = hashName(m_params[m_index[i]].c_str()) & m_hashMask;
+    while (m_hash[h] >= 0) h = (h + 1) & m_hashMask;
+    m_hash[h] = m_index[i];
+  }
+  resetKeys();
+
+  if (STLOG_HAL_ENABLED(STNFC_TRACE_LEVEL_DEBUG)) {
+    for (size_t i = 0; i < m_index.size(); i++) {
+      const CNfcParam& param = m_params[m_index[i]];
+      if (param.str_len() > 0) {
+        // values are not NUL terminated
+        STLOG_HAL_D("%s %s=%.*s\n", __func__, param.c_str(),
+                    (int)param.str_len(), param.str_value());
+      } else {
+        STLOG_HAL_D("%s %s=(0x%lX)\n", __func__, param.c_str(),
+                    param.numValue());
+      }
+    }
+  }
 }
 
 /*******************************************************************************
@@ -352,7 +768,7 @@ bool CNfcConfig::readConfig(const char* name, bool bResetContent) {
 ** Returns:     none
 **
 *******************************************************************************/
-CNfcConfig::CNfcConfig() : mValidFile(true) {}
+CNfcConfig::CNfcConfig() : m_hashMask(0), mValidFile(true) { resetKeys(); }
 
 /*******************************************************************************
 **
@@ -374,37 +790,46 @@ CNfcConfig::~CNfcConfig() {}
 ** Returns:     none
 **
 *******************************************************************************/
-CNfcConfig& CNfcConfig::GetInstance() {
-  static CNfcConfig theInstance;
+shared_ptr<CNfcConfig> CNfcConfig::GetInstance() {
+  shared_ptr<CNfcConfig> config = atomic_load(&sConfig);
+
+  if (config != NULL && (!config->empty() || !config->mValidFile)) {
+    return config;
+  }
 
-  if (theInstance.size() == 0 && theInstance.mValidFile) {
+  pthread_mutex_lock(&sConfigMutex);
+  config = atomic_load(&sConfig);
+  if (config == NULL || (config->empty() && config->mValidFile)) {
+    shared_ptr<CNfcConfig> fresh(new CNfcConfig());
     string strPath;
+
     if (alternative_config_path[0] != '\0') {
       strPath.assign(alternative_config_path);
       strPath += config_name;
-      theInstance.readConfig(strPath.c_str(), true);
-      if (!theInstance.empty()) {
-        return theInstance;
-      }
+      fresh->readConfig(strPath.c_str(), true);
     }
-
-    if (findConfigFile(android::base::GetProperty(
-                           "persist.vendor.nfc.config_file_name", ""),
-                       strPath)) {
-      STLOG_HAL_D("%s Get config file %s\n", __func__, strPath.c_str());
-    } else if (findConfigFile(extra_config_base +
-                                  android::base::GetProperty(
-                                      "ro.boot.product.hardware.sku", "") +
-                                  extra_config_ext,
-                              strPath)) {
-      STLOG_HAL_D("%s Get config file %s\n", __func__, strPath.c_str());
-    } else {
-      findConfigFile(config_name, strPath);
+    if (fresh->empty()) {
+      if (findConfigFile(android::base::GetProperty(
+                             "persist.vendor.nfc.config_file_name", ""),
+                         strPath)) {
+        STLOG_HAL_D("%s Get config file %s\n", __func__, strPath.c_str());
+      } else if (findConfigFile(extra_config_base +
+                                    android::base::GetProperty(
+                                        "ro.boot.product.hardware.sku", "") +
+                                    extra_config_ext,
+                                strPath)) {
+        STLOG_HAL_D("%s Get config file %s\n", __func__, strPath.c_str());
+      } else {
+        findConfigFile(config_name, strPath);
+      }
+      fresh->readConfig(strPath.c_str(), true);
     }
-    theInstance.readConfig(strPath.c_str(), true);
+    atomic_store(&sConfig, fresh);
+    config = fresh;
   }
+  pthread_mutex_unlock(&sConfigMutex);
 
-  return theInstance;
+  return config;
 }
 
 /*******************************************************************************
@@ -418,7 +843,20 @@ CNfcConfig& CNfcConfig::GetInstance() {
 **
 *******************************************************************************/
 bool CNfcConfig::getValue(const char* name, char* pValue, size_t& len) const {
-  const CNfcParam* pParam = find(name);
+  return getValue(find(name), pValue, len);
+}
+
+/*******************************************************************************
+**
+** Function:    CNfcConfig::getValue()
+**
+** Description: get the string value of a setting object
+**
+** Returns:     true if setting is a string
+**              false otherwise
+**
+*******************************************************************************/
+bool CNfcConfig::getValue(const CNfcParam* pParam, char* pValue, size_t& len) {
   if (pParam == NULL || pValue == NULL) return false;
 
   if (pParam->str_len() > 0) {
@@ -511,146 +949,205 @@ bool CNfcConfig::getValue(const char* name, unsigned short& rValue) const {
 **
 *******************************************************************************/
 const CNfcParam* CNfcConfig::find(const char* p_name) const {
-  if (size() == 0) return NULL;
-
-  for (const_iterator it = begin(), itEnd = end(); it != itEnd; ++it) {
-    if (**it < p_name)
-      continue;
-    else if (**it == p_name) {
-      if ((*it)->str_len() > 0) {
-        STLOG_HAL_D("%s found %s=%s\n", __func__, p_name, (*it)->str_value());
-      } else {
-        STLOG_HAL_D("%s found %s=(0x%lX)\n", __func__, p_name,
-                    (*it)->numValue());
-      }
-      return *it;
-    } else
-      break;
+  if (size() == 0 || p_name == NULL) return NULL;
+
+  for (uint32_t h = hashName(p_name) & m_hashMask; m_hash[h] >= 0;
+       h = (h + 1) & m_hashMask) {
+    const CNfcParam& param = m_params[m_hash[h]];
+    if (strcmp(param.c_str(), p_name) == 0) return &param;
   }
   return NULL;
 }
 
 /*******************************************************************************
 **
-** Function:    CNfcConfig::clean()
+** Function:    CNfcConfig::getKey()
 **
-** Description: reset the setting array
+** Description: get the key of a setting name, allocate it on first use
 **
-** Returns:     none
+** Returns:     key, -1 if no more keys are available
 **
 *******************************************************************************/
-void CNfcConfig::clean() {
-  if (size() == 0) return;
+int CNfcConfig::getKey(const char* p_name) {
+  int key;
 
-  for (iterator it = begin(), itEnd = end(); it != itEnd; ++it) delete *it;
-  clear();
+  if (p_name == NULL) return -1;
+  pthread_mutex_lock(&sKeyMutex);
+  for (key = 0; key < sKeyCount; key++) {
+    if (strcmp(sKeyNames[key], p_name) == 0) break;
+  }
+  if (key == sKeyCount) {
+    if (key < MAX_CONFIG_KEYS) {
+      sKeyNames[key] = strdup(p_name);
+      sKeyCount = key + 1;
+    } else {
+      STLOG_HAL_E("%s No more config keys for %s\n", __func__, p_name);
+      key = -1;
+    }
+  }
+  pthread_mutex_unlock(&sKeyMutex);
+  return key;
 }
 
 /*******************************************************************************
 **
-** Function:    CNfcConfig::Add()
+** Function:    CNfcConfig::resetKeys()
 **
-** Description: add a setting object to the list
+** Description: forget the settings the keys resolved to, after the settings
+**              changed
 **
 ** Returns:     none
 **
 *******************************************************************************/
-void CNfcConfig::add(const CNfcParam* pParam) {
-  if (m_list.size() == 0) {
-    m_list.push_back(pParam);
-    return;
-  }
-  for (list<const CNfcParam*>::iterator it = m_list.begin(),
-                                        itEnd = m_list.end();
-       it != itEnd; ++it) {
-    if (**it < pParam->c_str()) continue;
-    m_list.insert(it, pParam);
-    return;
-  }
-  m_list.push_back(pParam);
+void CNfcConfig::resetKeys() {
+  for (int key = 0; key < MAX_CONFIG_KEYS; key++)
+    m_keys[key].store(CONFIG_KEY_UNRESOLVED, memory_order_relaxed);
 }
 
 /*******************************************************************************
 **
-** Function:    CNfcConfig::moveFromList()
+** Function:    CNfcConfig::findByKey()
 **
-** Description: move the setting object from list to array
+** Description: get the setting of a key returned by getKey()
 **
-** Returns:     none
+** Returns:     pointer to the setting object
 **
 *******************************************************************************/
-void CNfcConfig::moveFromList() {
-  if (m_list.size() == 0) return;
+const CNfcParam* CNfcConfig::findByKey(int key) const {
+  if (key < 0 || key >= sKeyCount) return NULL;
 
-  for (list<const CNfcParam*>::iterator it = m_list.begin(),
-                                        itEnd = m_list.end();
-       it != itEnd; ++it)
-    push_back(*it);
-  m_list.clear();
+  int32_t pos = m_keys[key].load(memory_order_relaxed);
+  if (pos == CONFIG_KEY_UNRESOLVED) {
+    const CNfcParam* param = find(sKeyNames[key]);
+    pos = (param != NULL) ? param - m_params.data() : CONFIG_KEY_ABSENT;
+    m_keys[key].store(pos, memory_order_relaxed);
+  }
+  return (pos >= 0) ? &m_params[pos] : NULL;
 }
 
 /*******************************************************************************
 **
-** Function:    CNfcConfig::moveToList()
+** Function:    CNfcConfig::reload()
 **
-** Description: move the setting object from array to list
+** Description: read again the config files in use into a new config object
+**              and make it the current one
 **
-** Returns:     none
+** Returns:     true if the new config replaced the current one
 **
 *******************************************************************************/
-void CNfcConfig::moveToList() {
-  if (m_list.size() != 0) m_list.clear();
+bool CNfcConfig::reload() {
+  shared_ptr<CNfcConfig> fresh;
 
-  for (iterator it = begin(), itEnd = end(); it != itEnd; ++it)
-    m_list.push_back(*it);
-  clear();
+  GetInstance();
+  pthread_mutex_lock(&sConfigMutex);
+  vector<string> files = atomic_load(&sConfig)->files();
+  fresh = readFiles(files);
+  if (files.empty() || fresh->empty()) {
+    pthread_mutex_unlock(&sConfigMutex);
+    STLOG_HAL_W("%s No settings read, keep the current config\n", __func__);
+    return false;
+  }
+
+  atomic_store(&sConfig, fresh);
+  pthread_mutex_unlock(&sConfigMutex);
+  STLOG_HAL_D("%s %zu settings\n", __func__, fresh->size());
+  return true;
 }
 
 /*******************************************************************************
 **
-** Function:    CNfcParam::CNfcParam()
+** Function:    CNfcConfig::readFiles()
 **
-** Description: class constructor
+** Description: read config files into a new config object, base file first
 **
-** Returns:     none
+** Returns:     the new config
 **
 *******************************************************************************/
-CNfcParam::CNfcParam() : m_numValue(0) {}
+shared_ptr<CNfcConfig> CNfcConfig::readFiles(const vector<string>& files) {
+  shared_ptr<CNfcConfig> fresh(new CNfcConfig());
+
+  for (size_t i = 0; i < files.size(); i++)
+    fresh->readConfig(files[i].c_str(), i == 0);
+  return fresh;
+}
 
 /*******************************************************************************
 **
-** Function:    CNfcParam::~CNfcParam()
+** Function:    CNfcConfig::clean()
 **
-** Description: class destructor
+** Description: reset the setting array
 **
 ** Returns:     none
 **
 *******************************************************************************/
-CNfcParam::~CNfcParam() {}
+void CNfcConfig::clean() {
+  m_index.clear();
+  m_hash.clear();
+  m_params.clear();
+  m_pools.clear();
+  m_files.clear();
+  resetKeys();
+}
 
 /*******************************************************************************
 **
 ** Function:    CNfcParam::CNfcParam()
 **
-** Description: class copy constructor
+** Description: class constructor for a string or byte array setting
 **
 ** Returns:     none
 **
 *******************************************************************************/
-CNfcParam::CNfcParam(const char* name, const string& value)
-    : string(name), m_str_value(value), m_numValue(0) {}
+CNfcParam::CNfcParam(const char* name, const char* value, size_t len)
+    : m_name(name), m_str_value(value), m_str_len(len), m_numValue(0) {}
 
 /*******************************************************************************
 **
 ** Function:    CNfcParam::CNfcParam()
 **
-** Description: class copy constructor
+** Description: class constructor for a numerical setting
 **
 ** Returns:     none
 **
 *******************************************************************************/
 CNfcParam::CNfcParam(const char* name, unsigned long value)
-    : string(name), m_numValue(value) {}
+    : m_name(name), m_str_value(""), m_str_len(0), m_numValue(value) {}
+
+/*******************************************************************************
+**
+** Function:    getNumValue
+**
+** Description: convert a setting object to a numerical value of len bytes
+**
+** Returns:     True if converted, otherwise False.
+**
+*******************************************************************************/
+static int getNumValue(const CNfcParam* pParam, void* pValue,
+                       unsigned long len) {
+  if (pParam == NULL) return false;
+  unsigned long v = pParam->numValue();
+  if (v == 0 && pParam->str_len() > 0 && pParam->str_len() < 4) {
+    const unsigned char* p = (const unsigned char*)pParam->str_value();
+    for (size_t i = 0; i < pParam->str_len(); ++i) {
+      v *= 256;
+      v += *p++;
+    }
+  }
+  switch (len) {
+    case sizeof(unsigned long):
+      *(static_cast<unsigned long*>(pValue)) = (unsigned long)v;
+      break;
+    case sizeof(unsigned short):
+      *(static_cast<unsigned short*>(pValue)) = (unsigned short)v;
+      break;
+    case sizeof(unsigned char):
+      *(static_cast<unsigned char*>(pValue)) = (unsigned char)v;
+      break;
+    default:
+      return false;
+  }
+  return true;
+}
 
 /*******************************************************************************
 **
@@ -663,9 +1160,9 @@ CNfcParam::CNfcParam(const char* name, unsigned long value)
 *******************************************************************************/
 extern "C" int GetStrValue(const char* name, char* pValue, unsigned long l) {
   size_t len = l;
-  CNfcConfig& rConfig = CNfcConfig::GetInstance();
+  shared_ptr<CNfcConfig> config = CNfcConfig::GetInstance();
 
-  return rConfig.getValue(name, pValue, len);
+  return config->getValue(name, pValue, len);
 }
 
 /*******************************************************************************
@@ -687,8 +1184,8 @@ extern "C" int GetStrValue(const char* name, char* pValue, unsigned long l) {
 *******************************************************************************/
 extern "C" int GetByteArrayValue(const char* name, char* pValue, long bufflen,
                                  long* len) {
-  CNfcConfig& rConfig = CNfcConfig::GetInstance();
-  return rConfig.getValue(name, pValue, bufflen, len);
+  shared_ptr<CNfcConfig> config = CNfcConfig::GetInstance();
+  return config->getValue(name, pValue, bufflen, len);
 }
 
 /*******************************************************************************
@@ -703,54 +1200,79 @@ extern "C" int GetByteArrayValue(const char* name, char* pValue, long bufflen,
 extern "C" int GetNumValue(const char* name, void* pValue, unsigned long len) {
   if (!pValue) return false;
 
-  CNfcConfig& rConfig = CNfcConfig::GetInstance();
-  const CNfcParam* pParam = rConfig.find(name);
+  shared_ptr<CNfcConfig> config = CNfcConfig::GetInstance();
+  return getNumValue(config->find(name), pValue, len);
+}
 
-  if (pParam == NULL) return false;
-  unsigned long v = pParam->numValue();
-  if (v == 0 && pParam->str_len() > 0 && pParam->str_len() < 4) {
-    const unsigned char* p = (const unsigned char*)pParam->str_value();
-    for (size_t i = 0; i < pParam->str_len(); ++i) {
-      v *= 256;
-      v += *p++;
-    }
-  }
-  switch (len) {
-    case sizeof(unsigned long):
-      *(static_cast<unsigned long*>(pValue)) = (unsigned long)v;
-      break;
-    case sizeof(unsigned short):
-      *(static_cast<unsigned short*>(pValue)) = (unsigned short)v;
-      break;
-    case sizeof(unsigned char):
-      *(static_cast<unsigned char*>(pValue)) = (unsigned char)v;
-      break;
-    default:
-      return false;
-  }
-  return true;
+/*******************************************************************************
+**
+** Function:    GetConfigKey
+**
+** Description: API function for resolving a setting name once, the key is
+**              then used with GetNumValueByKey() / GetStrValueByKey() and
+**              stays valid when the settings are read again
+**
+** Returns:     key, -1 on error
+**
+*******************************************************************************/
+extern "C" int GetConfigKey(const char* name) {
+  return CNfcConfig::getKey(name);
+}
+
+/*******************************************************************************
+**
+** Function:    GetNumValueByKey
+**
+** Description: API function for getting a numerical value of a setting key
+**
+** Returns:     True if found, otherwise False.
+**
+*******************************************************************************/
+extern "C" int GetNumValueByKey(int key, void* pValue, unsigned long len) {
+  if (!pValue) return false;
+
+  shared_ptr<CNfcConfig> config = CNfcConfig::GetInstance();
+  return getNumValue(config->findByKey(key), pValue, len);
+}
+
+/*******************************************************************************
+**
+** Function:    GetStrValueByKey
+**
+** Description: API function for getting a string value of a setting key
+**
+** Returns:     True if found, otherwise False.
+**
+*******************************************************************************/
+extern "C" int GetStrValueByKey(int key, char* pValue, unsigned long l) {
+  size_t len = l;
+
+  shared_ptr<CNfcConfig> config = CNfcConfig::GetInstance();
+  return CNfcConfig::getValue(config->findByKey(key), pValue, len);
 }
 
 /*******************************************************************************
 **
 ** Function:    resetConfig
 **
-** Description: reset settings array
+** Description: reset settings array, the files are read again on next use
 **
 ** Returns:     none
 **
 *******************************************************************************/
 extern void resetConfig() {
-  CNfcConfig& rConfig = CNfcConfig::GetInstance();
-
-  rConfig.clean();
+  pthread_mutex_lock(&sConfigMutex);
+  atomic_store(&sConfig, shared_ptr<CNfcConfig>(new CNfcConfig()));
+  pthread_mutex_unlock(&sConfigMutex);
 }
 
 /*******************************************************************************
 **
 ** Function:    readOptionalConfig()
 **
-** Description: read Config settings from an optional conf file
+** Description: read Config settings from an optional conf file: the files
+**              in use and this one are read into a new config object, which
+**              then replaces the current one
 **
 ** Returns:     none
 **
@@ -768,5 +1290,164 @@ void readOptionalConfig(const char* extra) {
     findConfigFile(configName, strPath);
   }
 
-  CNfcConfig::GetInstance().readConfig(strPath.c_str(), false);
+  CNfcConfig::GetInstance();
+  pthread_mutex_lock(&sConfigMutex);
+  vector<string> files = atomic_load(&sConfig)->files();
+  shared_ptr<CNfcConfig> fresh = CNfcConfig::readFiles(files);
+  if (std::find(files.begin(), files.end(), strPath) == files.end()) {
+    fresh->readConfig(strPath.c_str(), false);
+  }
+  atomic_store(&sConfig, fresh);
+  pthread_mutex_unlock(&sConfigMutex);
+}
+
+/*******************************************************************************
+**
+** Function:    RegisterConfigListener()
+**
+** Description: register a function called after each live config reload,
+**              a function registered twice is only called once
+**
+** Returns:     none
+**
+*******************************************************************************/
+extern "C" void RegisterConfigListener(config_listener_t listener) {
+  pthread_mutex_lock(&sListenerMutex);
+  for (int i = 0; i < sListenerCount; i++) {
+    if (sListeners[i] == listener) {
+      pthread_mutex_unlock(&sListenerMutex);
+      return;
+    }
+  }
+  if (sListenerCount < MAX_CONFIG_LISTENERS) {
+    sListeners[sListenerCount++] = listener;
+  } else {
+    STLOG_HAL_E("%s Too many config listeners\n", __func__);
+  }
+  pthread_mutex_unlock(&sListenerMutex);
+}
+
+/*******************************************************************************
+**
+** Function:    isConfigEvent()
+**
+** Description: check if an inotify event concerns one of the config files
+**
+** Returns:     true if the file is in use
+**
+*******************************************************************************/
+static bool isConfigEvent(const struct inotify_event* event,
+                          const vector<string>& files) {
+  if (event->len == 0) return false;
+  for (size_t i = 0; i < files.size(); i++) {
+    const char* base = strrchr(files[i].c_str(), '/');
+    base = (base != NULL) ? base + 1 : files[i].c_str();
+    if (strcmp(base, event->name) == 0) return true;
+  }
+  return false;
+}
+
+/*******************************************************************************
+**
+** Function:    configWatcherThread()
+**
+** Description: wait for the config files to be rewritten, then read them
+**              again and notify the listeners
+**
+** Returns:     NULL
+**
+*******************************************************************************/
+static void* configWatcherThread(void* arg) {
+  int fd = (int)(intptr_t)arg;
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct pollfd pfd = {fd, POLLIN, 0};
+
+  for (;;) {
+    vector<string> files = CNfcConfig::GetInstance()->files();
+    bool changed = false;
+    ssize_t len = read(fd, buf, sizeof(buf));
+    if (len <= 0) {
+      if (len < 0 && errno == EINTR) continue;
+      STLOG_HAL_E("%s inotify read failed (%d)\n", __func__, errno);
+      break;
+    }
+    // editors write in several steps, wait for the file to settle
+    do {
+      for (char* p = buf; p < buf + len;) {
+        const struct inotify_event* event = (const struct inotify_event*)p;
+        changed = changed || isConfigEvent(event, files);
+        p += sizeof(struct inotify_event) + event->len;
+      }
+      len = 0;
+      if (poll(&pfd, 1, CONFIG_RELOAD_SETTLE_MS) > 0)
+        len = read(fd, buf, sizeof(buf));
+    } while (len > 0);
+
+    if (!changed || !CNfcConfig::reload()) continue;
+
+    pthread_mutex_lock(&sListenerMutex);
+    for (int i = 0; i < sListenerCount; i++) sListeners[i]();
+    pthread_mutex_unlock(&sListenerMutex);
+  }
+  close(fd);
+  return NULL;
+}
+
+/*******************************************************************************
+**
+** Function:    StartConfigWatcher()
+**
+** Description: start watching the config files when STNFC_CONFIG_LIVE_RELOAD
+**              is set, so that a modified setting is applied without
+**              restarting the HAL. Only the first call has an effect.
+**
+** Returns:     none
+**
+*******************************************************************************/
+extern "C" void StartConfigWatcher(void) {
+  unsigned long enabled = 0;
+  pthread_t thread;
+  pthread_attr_t attr;
+  vector<string> dirs;
+  int fd;
+
+  pthread_mutex_lock(&sListenerMutex);
+  if (sWatcherStarted) {
+    pthread_mutex_unlock(&sListenerMutex);
+    return;
+  }
+  sWatcherStarted = true;
+  pthread_mutex_unlock(&sListenerMutex);
+
+  if (!GetNumValue(NAME_STNFC_CONFIG_LIVE_RELOAD, &enabled, sizeof(enabled)) ||
+      !enabled) {
+    return;
+  }
+
+  fd = inotify_init1(IN_CLOEXEC);
+  if (fd < 0) {
+    STLOG_HAL_E("%s inotify_init1 failed (%d)\n", __func__, errno);
+    return;
+  }
+  // watch the directories: a file replaced by a rename keeps its name only
+  for (const string& file : CNfcConfig::GetInstance()->files()) {
+    string dir = file.substr(0, file.find_last_of('/') + 1);
+    if (dir.empty()) dir = ".";
+    if (std::find(dirs.begin(), dirs.end(), dir) != dirs.end()) continue;
+    dirs.push_back(dir);
+    if (inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+      STLOG_HAL_E("%s Cannot watch %s (%d)\n", __func__, dir.c_str(), errno);
+    } else {
+      STLOG_HAL_D("%s Watching %s\n", __func__, dir.c_str());
+    }
+  }
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&thread, &attr, configWatcherThread, (void*)(intptr_t)fd) !=
+      0) {
+    STLOG_HAL_E("%s pthread_create failed\n", __func__);
+    close(fd);
+  }
+  pthread_attr_destroy(&attr);
 }
@@ -0,0 +1,163 @@
+/** ----------------------------------------------------------------------
+ *
+ * Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ ----------------------------------------------------------------------*/
+#include "hal_thread.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "android_logmsg.h"
+
+static pthread_mutex_t sHalThreadMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t halThreadNowUs() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void HalThreadSetup(HalThread* t, const char* name, const char* prioName,
+                    const char* affinityName) {
+  unsigned long priority = HAL_THREAD_PRIO_DEFAULT;
+  unsigned long affinity = 0;
+
+  (void)pthread_mutex_lock(&sHalThreadMutex);
+  t->name = name;
+  t->tid = gettid();
+  t->priority = HAL_THREAD_PRIO_DEFAULT;
+  t->affinity = 0;
+  t->postedUs = 0;
+  t->wakeups = 0;
+  t->latencyTotalUs = 0;
+  t->latencyMaxUs = 0;
+  (void)pthread_mutex_unlock(&sHalThreadMutex);
+
+  if (prioName) GetNumValue(prioName, &priority, sizeof(priority));
+  if (affinityName) GetNumValue(affinityName, &affinity, sizeof(affinity));
+
+  if (priority > HAL_THREAD_PRIO_DEFAULT &&
+      priority <= HAL_THREAD_PRIO_FIFO_MAX) {
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+    if (sched_setscheduler(0, SCHED_FIFO, &param) != 0) {
+      STLOG_HAL_E("%s thread: SCHED_FIFO %lu failed (%s)\n", name, priority,
+                  strerror(errno));
+      priority = HAL_THREAD_PRIO_DEFAULT;
+    }
+  } else if (priority >= HAL_THREAD_PRIO_NICE_0 - 20 &&
+             priority < HAL_THREAD_PRIO_NICE_0 + 20) {
+    // on Linux, the nice level of a tid is the one of that thread only
+    if (setpriority(PRIO_PROCESS, 0,
+                    (int)priority - HAL_THREAD_PRIO_NICE_0) != 0) {
+      STLOG_HAL_E("%s thread: nice %d failed (%s)\n", name,
+                  (int)priority - HAL_THREAD_PRIO_NICE_0, strerror(errno));
+      priority = HAL_THREAD_PRIO_DEFAULT;
+    }
+  } else if (priority != HAL_THREAD_PRIO_DEFAULT) {
+    STLOG_HAL_E("%s thread: invalid %s=%lu\n", name, prioName, priority);
+    priority = HAL_THREAD_PRIO_DEFAULT;
+  }
+
+  if (affinity) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (unsigned int cpu = 0; cpu < sizeof(affinity) * 8; cpu++) {
+      if (affinity & (1UL << cpu)) CPU_SET(cpu, &cpus);
+    }
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+      STLOG_HAL_E("%s thread: affinity 0x%lx failed (%s)\n", name, affinity,
+                  strerror(errno));
+      affinity = 0;
+    }
+  }
+
+  STLOG_HAL_D("%s thread: tid %d, priority %lu, affinity 0x%lx\n", name,
+              (int)t->tid, priority, affinity);
+
+  (void)pthread_mutex_lock(&sHalThreadMutex);
+  t->priority = priority;
+  t->affinity = affinity;
+  (void)pthread_mutex_unlock(&sHalThreadMutex);
+}
+
+void HalThreadPost(HalThread* t) {
+  uint64_t idle = 0;
+
+  // only the first message counts, the next ones wait for it anyway
+  t->postedUs.compare_exchange_strong(idle, halThreadNowUs());
+}
+
+void HalThreadRun(HalThread* t) {
+  uint64_t postedUs = t->postedUs.exchange(0);
+  uint64_t latencyUs;
+
+  if (!postedUs) return;
+
+  latencyUs = halThreadNowUs() - postedUs;
+  (void)pthread_mutex_lock(&sHalThreadMutex);
+  t->wakeups++;
+  t->latencyTotalUs += latencyUs;
+  if (latencyUs > t->latencyMaxUs) t->latencyMaxUs = latencyUs;
+  (void)pthread_mutex_unlock(&sHalThreadMutex);
+}
+
+void HalThreadExit(HalThread* t) {
+  (void)pthread_mutex_lock(&sHalThreadMutex);
+  t->tid = 0;
+  (void)pthread_mutex_unlock(&sHalThreadMutex);
+}
+
+void HalThreadDump(HalThread* t, int fd) {
+  char path[64];
+  unsigned long long runNs = 0, waitNs = 0, slices = 0;
+  FILE* f;
+
+  (void)pthread_mutex_lock(&sHalThreadMutex);
+  if (!t->name) {
+    (void)pthread_mutex_unlock(&sHalThreadMutex);
+    return;
+  }
+  dprintf(fd,
+          "%s thread: tid %d, priority %d, affinity 0x%lx, wakeups %u, "
+          "latency avg %llu us, max %llu us",
+          t->name, (int)t->tid, t->priority, t->affinity, t->wakeups,
+          (unsigned long long)(t->wakeups ? t->latencyTotalUs / t->wakeups
+                                          : 0),
+          (unsigned long long)t->latencyMaxUs);
+
+  // time spent runnable but not running, from the scheduler
+  snprintf(path, sizeof(path), "/proc/self/task/%d/schedstat", (int)t->tid);
+  if (t->tid && (f = fopen(path, "r")) != NULL) {
+    if (fscanf(f, "%llu %llu %llu", &runNs, &waitNs, &slices) == 3 &&
+        slices) {
+      dprintf(fd, ", run queue wait avg %llu us over %llu slices",
+              waitNs / slices / 1000, slices);
+    }
+    fclose(f);
+  }
+  dprintf(fd, "\n");
+  (void)pthread_mutex_unlock(&sHalThreadMutex);
+}
@@ -0,0 +1,221 @@
+/** ----------------------------------------------------------------------
+ *
+ * Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ ----------------------------------------------------------------------*/
+#include "hex_decode.h"
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#define HEX_DECODE_SIMD 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define HEX_DECODE_SIMD 1
+#else
+#define HEX_DECODE_SIMD 0
+#endif
+
+/* character classes, values 0 to 15 are the hex digits */
+#define HEX_SEP 0x10    // ',', ':', '-'
+#define HEX_SPACE 0x20  // ' ', '\t', '\r', '\n'
+#define HEX_BAD 0xFF
+
+static const uint8_t sHexClass[256] = {
+    // clang-format off
+    HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+    HEX_BAD, HEX_SPACE, HEX_SPACE, HEX_BAD, HEX_BAD, HEX_SPACE, HEX_BAD,
+    HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+    HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+    HEX_BAD,
+    // ' ' to '/'
+    HEX_SPACE, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+    HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_SEP, HEX_SEP, HEX_BAD, HEX_BAD,
+    // '0' to '?'
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, HEX_SEP, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+    HEX_BAD,
+    // '@' to 'O'
+    HEX_BAD, 10, 11, 12, 13, 14, 15, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+    HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+    // 'P' to '_'
+    HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+    HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+    // '`' to 'o'
+    HEX_BAD, 10, 11, 12, 13, 14, 15, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+    HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+    // 'p' to 0x7F
+    HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+    HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+    // 0x80 to 0xFF
+    HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+    HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+    HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+    HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+    HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+    HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+    HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+    HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+    HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+    HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+    HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+    HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+    HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+    HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+    HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+    HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD, HEX_BAD,
+    // clang-format on
+};
+
+#if HEX_DECODE_SIMD
+/* "HHtHHtHHtHHtHHt": 5 groups of 2 digits, each ended by a terminator */
+#define HEX_BLOCK_DIGITS 0x36DB
+#define HEX_BLOCK_TERMS 0x4924
+#define HEX_BLOCK_CHARS 15
+#define HEX_BLOCK_BYTES 5
+
+/**
+ * Decode 5 groups of 2 digits, the layout of most byte arrays
+ * ("12:34:56:" or "12 34 56 "), from a 16 characters block.
+ * @param in at least 16 characters, starting a group
+ * @param out 5 decoded bytes
+ * @param flags HEX_DECODE_* flags
+ *
+ * @return false if the block does not have this layout
+ */
+static inline bool hexDecodeBlock(const char* in, uint8_t* out,
+                                  uint32_t flags) {
+  uint8_t values[16];
+  uint32_t digits, terms;
+
+#if defined(__aarch64__)
+  static const uint8_t kBits[16] = {1, 2, 4, 8, 16, 32, 64, 128,
+                                    1, 2, 4, 8, 16, 32, 64, 128};
+  const uint8x16_t bits = vld1q_u8(kBits);
+  uint8x16_t c = vld1q_u8((const uint8_t*)in);
+  uint8x16_t dec = vsubq_u8(c, vdupq_n_u8('0'));
+  uint8x16_t alpha = vsubq_u8(vorrq_u8(c, vdupq_n_u8(0x20)), vdupq_n_u8('a'));
+  uint8x16_t isDec = vcltq_u8(dec, vdupq_n_u8(10));
+  uint8x16_t isAlpha = vcltq_u8(alpha, vdupq_n_u8(6));
+  uint8x16_t isTerm = vdupq_n_u8(0);
+  if (flags & HEX_DECODE_SEPARATORS) {
+    isTerm = vorrq_u8(vceqq_u8(c, vdupq_n_u8(',')),
+                      vorrq_u8(vceqq_u8(c, vdupq_n_u8(':')),
+                               vceqq_u8(c, vdupq_n_u8('-'))));
+  }
+  if (!(flags & HEX_DECODE_SKIP_SPACES)) {
+    isTerm = vorrq_u8(isTerm, vceqq_u8(c, vdupq_n_u8(' ')));
+  }
+  uint8x16_t d = vandq_u8(vorrq_u8(isDec, isAlpha), bits);
+  uint8x16_t t = vandq_u8(isTerm, bits);
+  digits = vaddv_u8(vget_low_u8(d)) | (vaddv_u8(vget_high_u8(d)) << 8);
+  terms = vaddv_u8(vget_low_u8(t)) | (vaddv_u8(vget_high_u8(t)) << 8);
+  vst1q_u8(values, vbslq_u8(isDec, dec, vaddq_u8(alpha, vdupq_n_u8(10))));
+#else
+  const __m128i c = _mm_loadu_si128((const __m128i*)in);
+  // unsigned "x < n" as "min(x, n - 1) == x"
+  __m128i dec = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+  __m128i alpha =
+      _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+  __m128i isDec = _mm_cmpeq_epi8(_mm_min_epu8(dec, _mm_set1_epi8(9)), dec);
+  __m128i isAlpha =
+      _mm_cmpeq_epi8(_mm_min_epu8(alpha, _mm_set1_epi8(5)), alpha);
+  __m128i isTerm = _mm_setzero_si128();
+  if (flags & HEX_DECODE_SEPARATORS) {
+    isTerm = _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8(',')),
+                          _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8(':')),
+                                       _mm_cmpeq_epi8(c, _mm_set1_epi8('-'))));
+  }
+  if (!(flags & HEX_DECODE_SKIP_SPACES)) {
+    isTerm = _mm_or_si128(isTerm, _mm_cmpeq_epi8(c, _mm_set1_epi8(' ')));
+  }
+  digits = _mm_movemask_epi8(_mm_or_si128(isDec, isAlpha));
+  terms = _mm_movemask_epi8(isTerm);
+  _mm_storeu_si128(
+      (__m128i*)values,
+      _mm_or_si128(_mm_and_si128(isDec, dec),
+                   _mm_andnot_si128(isDec, _mm_add_epi8(alpha,
+                                                        _mm_set1_epi8(10)))));
+#endif
+
+  if ((digits & 0x7FFF) != HEX_BLOCK_DIGITS ||
+      (terms & 0x7FFF) != HEX_BLOCK_TERMS) {
+    return false;
+  }
+  for (int i = 0; i < HEX_BLOCK_BYTES; i++) {
+    out[i] = (values[3 * i] << 4) | values[3 * i + 1];
+  }
+  return true;
+}
+#endif
+
+ssize_t HexDecode(const char* in, size_t len, uint8_t* out, uint32_t flags) {
+  const uint8_t* p = (const uint8_t*)in;
+  size_t pos = 0;
+  size_t n = 0;
+
+  while (pos < len) {
+#if HEX_DECODE_SIMD
+    // at a group boundary: try the common layout first
+    while (len - pos >= 16 && hexDecodeBlock(in + pos, out + n, flags)) {
+      pos += HEX_BLOCK_CHARS;
+      n += HEX_BLOCK_BYTES;
+    }
+    if (pos >= len) break;
+#endif
+    uint8_t cls = sHexClass[p[pos]];
+    if (cls == HEX_SPACE) {
+      pos++;
+      continue;
+    }
+    if (cls == HEX_SEP && (flags & HEX_DECODE_SEPARATORS)) {
+      pos++;
+      continue;
+    }
+    if (cls > 0x0F) return HEX_DECODE_INVALID;
+
+    // find the end of the group and its number of digits
+    size_t end = pos;
+    size_t digits = 0;
+    for (; end < len; end++) {
+      cls = sHexClass[p[end]];
+      if (cls <= 0x0F) {
+        digits++;
+      } else if (cls == HEX_SPACE) {
+        if (!(flags & HEX_DECODE_SKIP_SPACES)) break;
+      } else if (cls == HEX_SEP && (flags & HEX_DECODE_SEPARATORS)) {
+        break;
+      } else {
+        return HEX_DECODE_INVALID;
+      }
+    }
+    if ((digits & 1) && !(flags & HEX_DECODE_PAD_ODD)) return HEX_DECODE_ODD;
+
+    // odd group: the first digit is the low nibble of the first byte
+    uint8_t byte = 0;
+    bool low = (digits & 1) != 0;
+    for (; pos < end; pos++) {
+      cls = sHexClass[p[pos]];
+      if (cls > 0x0F) continue;
+      if (low) {
+        out[n++] = byte | cls;
+      } else {
+        byte = cls << 4;
+      }
+      low = !low;
+    }
+  }
+
+  return n;
+}
@@ -29,12 +29,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <atomic>
+
 #include "android_logmsg.h"
 #include "hal_config.h"
 #include "halcore.h"
+#include "hal_thread.h"
 #include "halcore_private.h"
+#include "nci_framer.h"
 
 #define ST21NFC_MAGIC 0xEA
 
@@ -56,12 +61,59 @@ static int cmdPipe[2] = {0, 0};
 static int notifyResetRequest = 0;
 static bool recovery_mode = false;
 
-static struct pollfd event_table[3];
+static struct pollfd event_table[4];
+static HalThread sI2cThread;
 static pthread_t threadHandle = (pthread_t)NULL;
+/* HAL_FLAG_SINGLE_LOOP: the HAL core runs on the I2C thread, its frames are
+ * written from there unless older ones wait in cmdPipe */
+static thread_local bool sOnI2cThread = false;
+static std::atomic_int sQueuedFrames(0);
 pthread_mutex_t i2ctransport_mtx = PTHREAD_MUTEX_INITIALIZER;
 
-unsigned long hal_ctrl_clk = 0;
-unsigned long hal_activerw_timer = 0;
+// written by i2cReadConfig(), also from the config watcher thread
+static std::atomic_ulong hal_ctrl_clk(0);
+static std::atomic_ulong hal_activerw_timer(0);
+
+/* A write the NFCC refused is retried from I2cWorkerThread's poll() timeout,
+ * 4 ms after the failure then doubling up to 500 ms, for at most 5 s. The
+ * next frames wait in cmdPipe meanwhile, reads keep being serviced. */
+#define I2C_WRITE_RETRY_FIRST_MS 4
+#define I2C_WRITE_RETRY_MAX_MS 500
+#define I2C_WRITE_GIVE_UP_MS 5000
+
+static struct {
+  uint8_t buffer[MAX_BUFFER_SIZE];
+  size_t length;
+  uint32_t delayMs;
+  struct timespec first;  // first attempt
+  struct timespec next;   // next attempt
+} sWriteRetry;
+static bool sWriteRetryPending = false;
+
+static pthread_mutex_t sI2cStatsMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+  uint32_t writes;        // frames written
+  uint32_t writeErrors;   // failed write() calls
+  uint32_t retriedWrites; // frames written after at least one retry
+  uint32_t droppedWrites; // frames given up after I2C_WRITE_GIVE_UP_MS
+  uint64_t writeMaxUs;    // longest write() call
+  uint64_t retryMaxUs;    // longest time from first attempt to success
+  uint32_t clkIoctls;     // ST21NFC_CLK_* calls
+  uint32_t clkSkipped;    // CORE_SET_POWER_SUB_STATE with no clock change
+  uint64_t screenOnLastUs;  // screen on command, clock update to written
+  uint64_t screenOnMaxUs;
+  uint32_t rxFrames;      // copied from sRxFramer after each wake-up
+  uint32_t rxIdle;
+  uint32_t rxJunk;
+  uint32_t rxResyncs;
+} sI2cStats;
+
+// reads to complete a started frame before it is dropped
+#define I2C_RX_MAX_READS 4
+static NciFramer sRxFramer;
+
+// NFCC clock state as last set or read: 0 disabled, 1 enabled, -1 unknown
+static std::atomic_int sClkState(-1);
 
 /**************************************************************************************************
  *
@@ -75,6 +127,11 @@ static int SetToRecoveryMode(int fid);
 static int i2cRead(int fid, uint8_t* pvBuffer, int length);
 static int i2cGetGPIOState(int fid);
 static int i2cWrite(int fd, const uint8_t* pvBuffer, int length);
+static int i2cWriteAttempt(int fid, const uint8_t* pvBuffer, int length);
+static void i2cWriteFrame(int fid, const uint8_t* buffer, size_t length);
+static void i2cSetClock(int fid, bool screenOff);
+static void i2cWriteRetry(int fid);
+static int i2cWriteRetryTimeout();
 
 /**************************************************************************************************
  *
@@ -91,26 +148,43 @@ static void* I2cWorkerThread(void* arg) {
   bool closeThread = false;
   HALHANDLE hHAL = (HALHANDLE)arg;
   STLOG_HAL_D("echo thread started...\n");
-  bool readOk = false;
-  int eventNum = (notifyResetRequest <= 0) ? 2 : 3;
   bool resetting= false;
 
+  sOnI2cThread = true;
+  HalThreadSetup(&sI2cThread, "I2C", NAME_STNFC_I2C_THREAD_PRIORITY,
+                 NAME_STNFC_I2C_THREAD_AFFINITY);
+
   do {
     event_table[0].fd = fidI2c;
     event_table[0].events = POLLIN;
     event_table[0].revents = 0;
 
+    // the next frames stay in the pipe until a refused write went through
     event_table[1].fd = cmdPipe[0];
-    event_table[1].events = POLLIN;
+    event_table[1].events = sWriteRetryPending ? 0 : POLLIN;
     event_table[1].revents = 0;
 
-    event_table[2].fd = notifyResetRequest;
+    // poll() skips the negative fds
+    event_table[2].fd = (notifyResetRequest > 0) ? notifyResetRequest : -1;
     event_table[2].events = POLLPRI;
     event_table[2].revents = 0;
 
+    // HAL_FLAG_SINGLE_LOOP: messages for the HAL core
+    event_table[3].fd = HalGetEventFd(hHAL);
+    event_table[3].events = POLLIN;
+    event_table[3].revents = 0;
+
+    int timeout = i2cWriteRetryTimeout();
+    if (event_table[3].fd >= 0) {
+      int halTimeout = HalGetTimeout(hHAL);
+      if ((timeout < 0) || ((halTimeout >= 0) && (halTimeout < timeout))) {
+        timeout = halTimeout;
+      }
+    }
+
     STLOG_HAL_V("echo thread go to sleep...\n");
 
-    int poll_status = poll(event_table, eventNum, -1);
+    int poll_status = poll(event_table, 4, timeout);
 
     if (-1 == poll_status) {
       poll_status = errno;
@@ -122,73 +196,62 @@ static void* I2cWorkerThread(void* arg) {
       break;
     }
 
+    if (sWriteRetryPending && (i2cWriteRetryTimeout() == 0)) {
+      i2cWriteRetry(fidI2c);
+    }
+
     if (event_table[0].revents & POLLIN) {
       STLOG_HAL_V("echo thread wakeup from chip...\n");
-      uint8_t buffer[300];
+      uint8_t buffer[NCI_FRAMER_MAX_FRAME];
       int count = 0;
+      int reads = 0;
 
       do {
         if (recovery_mode) {
           break;
         }
-        // load first four bytes:
-        int bytesRead = i2cRead(fidI2c, buffer, 3);
-
-        if (bytesRead == 3) {
-          if ((buffer[0] != 0x7E) && (buffer[1] != 0x7E)) {
-            readOk = true;
-          } else {
-            if (buffer[1] != 0x7E) {
-              STLOG_HAL_W(
-                  "Idle data: 2nd byte is 0x%02x\n, reading next 2 bytes",
-                  buffer[1]);
-              buffer[0] = buffer[1];
-              buffer[1] = buffer[2];
-              bytesRead = i2cRead(fidI2c, buffer + 2, 1);
-              if (bytesRead == 1) {
-                readOk = true;
-              }
-            } else if (buffer[2] != 0x7E) {
-              STLOG_HAL_W("Idle data: 3rd byte is 0x%02x\n, reading next  byte",
-                          buffer[2]);
-              buffer[0] = buffer[2];
-              bytesRead = i2cRead(fidI2c, buffer + 1, 2);
-              if (bytesRead == 2) {
-                readOk = true;
-              }
-            } else {
-              STLOG_HAL_W("received idle data\n");
-            }
-          }
-
-          if (readOk == true) {
-            int remaining = buffer[2];
-            bytesRead = 0;
-            if (remaining != 0) {
-              // read and pass to HALCore
-              bytesRead = i2cRead(fidI2c, buffer + 3, remaining);
-            }
-            if (bytesRead == remaining) {
-              DispHal("RX DATA", buffer, 3 + bytesRead);
-              HalSendUpstream(hHAL, buffer, 3 + bytesRead);
-            } else {
-              readOk = false;
-              STLOG_HAL_E("! didn't read expected bytes from i2c\n");
-            }
-          }
-
+        // read what the current frame misses: the header, then the payload
+        size_t needed = NciFramerNeeded(&sRxFramer);
+        int bytesRead = i2cRead(fidI2c, buffer, needed);
+        bool complete = false;
+
+        if (bytesRead != (int)needed) {
+          STLOG_HAL_E("! didn't read %zu requested bytes from i2c\n", needed);
+          NciFramerReset(&sRxFramer, true);
         } else {
-          STLOG_HAL_E("! didn't read 3 requested bytes from i2c\n");
+          NciFramerPush(&sRxFramer, buffer, bytesRead, &complete);
         }
 
-        readOk = false;
-        memset(buffer, 0xca, sizeof(buffer));
-        /* read while we have data available, up to 2 times then allow writes */
-      } while ((i2cGetGPIOState(fidI2c) == 1) && (count++ < 2));
+        if (complete) {
+          DispHal("RX DATA", sRxFramer.frame, sRxFramer.len);
+          HalSendUpstream(hHAL, sRxFramer.frame, sRxFramer.len);
+          NciFramerReset(&sRxFramer, false);
+          reads = 0;
+        } else if (sRxFramer.len > 0) {
+          reads++;
+        } else {
+          STLOG_HAL_V("received idle data\n");
+        }
+        /* complete a started frame, then read while we have data available,
+         * up to 2 times then allow writes */
+      } while ((sRxFramer.len > 0 && reads < I2C_RX_MAX_READS) ||
+               ((i2cGetGPIOState(fidI2c) == 1) && (count++ < 2)));
+
+      if (sRxFramer.len > 0) {
+        STLOG_HAL_E("! incomplete frame from i2c, dropped\n");
+        NciFramerReset(&sRxFramer, true);
+      }
+      (void)pthread_mutex_lock(&sI2cStatsMutex);
+      sI2cStats.rxFrames = sRxFramer.frames;
+      sI2cStats.rxIdle = sRxFramer.idle;
+      sI2cStats.rxJunk = sRxFramer.junk;
+      sI2cStats.rxResyncs = sRxFramer.resyncs;
+      (void)pthread_mutex_unlock(&sI2cStatsMutex);
     }
 
     if (event_table[1].revents & POLLIN) {
       STLOG_HAL_V("thread received command.. \n");
+      HalThreadRun(&sI2cThread);
 
       char cmd = 0;
       read(cmdPipe[0], &cmd, 1);
@@ -204,9 +267,10 @@ static void* I2cWorkerThread(void* arg) {
           uint8_t buffer[MAX_BUFFER_SIZE];
           STLOG_HAL_V("received write command\n");
           read(cmdPipe[0], &length, sizeof(length));
+          sQueuedFrames--;
           if (length <= MAX_BUFFER_SIZE) {
             read(cmdPipe[0], buffer, length);
-            i2cWrite(fidI2c, buffer, length);
+            i2cWriteFrame(fidI2c, buffer, length);
           } else {
             STLOG_HAL_E(
                 "! received bigger data than expected!! Data not transmitted "
@@ -222,7 +286,7 @@ static void* I2cWorkerThread(void* arg) {
       }
     }
 
-    if (event_table[2].revents & POLLPRI && eventNum > 2) {
+    if (event_table[2].revents & POLLPRI) {
       STLOG_HAL_W("thread received reset request command.. \n");
       char reset[10];
       int byte;
@@ -236,8 +300,14 @@ static void* I2cWorkerThread(void* arg) {
         STLOG_HAL_E("trigger NFCC reset.. \n");
         resetting= true;
         i2cResetPulse(fidI2c);
+        sClkState = -1;
       }
     }
+
+    // HAL_FLAG_SINGLE_LOOP: queued messages and expired timer
+    if ((event_table[3].fd >= 0) && !closeThread) {
+      HalProcessEvents(hHAL);
+    }
   } while (!closeThread);
 
   // Stop here if we got a serious error above.
@@ -251,19 +321,60 @@ static void* I2cWorkerThread(void* arg) {
   }
 
   HalDestroy(hHAL);
+  HalThreadExit(&sI2cThread);
   STLOG_HAL_D("thread exit\n");
   return 0;
 }
 
+/**
+ * Read the settings used on each write, again after a live config reload.
+ */
+static void i2cReadConfig() {
+  unsigned long value = 0;
+
+  GetNumValue(NAME_STNFC_CONTROL_CLK, &value, sizeof(value));
+  hal_ctrl_clk = value;
+  value = 0;
+  GetNumValue(NAME_STNFC_ACTIVERW_TIMER, &value, sizeof(value));
+  hal_activerw_timer = value;
+}
+
 /**
  * Put command into queue for worker thread to process it.
- * @param x Command 'X' to close I2C layer or 'W' to write data down to I2C
- * layer followed by data frame
- * @param len Size of command or data
- * @return
+ * @param cmd Command 'X' to close I2C layer or 'W' to write data down to I2C
+ * layer
+ * @param data Data frame of a 'W' command
+ * @param len Size of the data frame
+ * @return number of bytes queued or written, -1 on error
  */
-int I2cWriteCmd(const uint8_t* x, size_t len) {
-  return write(cmdPipe[1], x, len);
+int I2cWriteCmd(char cmd, const uint8_t* data, size_t len) {
+  uint8_t msg[1 + sizeof(size_t) + MAX_BUFFER_SIZE];
+  size_t size = 1;
+  int ret;
+
+  msg[0] = cmd;
+  if (cmd == 'W') {
+    if (len > MAX_BUFFER_SIZE) {
+      STLOG_HAL_E("! frame of %zu bytes not transmitted to NFCC\n", len);
+      return -1;
+    }
+    if (sOnI2cThread && !sWriteRetryPending && sQueuedFrames == 0) {
+      // HAL_FLAG_SINGLE_LOOP: no need to go through cmdPipe
+      i2cWriteFrame(fidI2c, data, len);
+      return len;
+    }
+    sQueuedFrames++;
+    memcpy(msg + size, &len, sizeof(len));
+    size += sizeof(len);
+    memcpy(msg + size, data, len);
+    size += len;
+  }
+
+  // one write, below PIPE_BUF: the commands of two threads do not interleave
+  HalThreadPost(&sI2cThread);
+  ret = write(cmdPipe[1], msg, size);
+  if (ret < 0 && cmd == 'W') sQueuedFrames--;
+  return ret;
 }
 
 /**
@@ -274,6 +385,7 @@ int I2cWriteCmd(const uint8_t* x, size_t len) {
  */
 bool I2cOpenLayer(void* dev, HAL_CALLBACK callb, HALHANDLE* pHandle) {
   uint32_t NoDbgFlag = HAL_FLAG_DEBUG;
+  unsigned long singleLoop = 0;
   char nfc_dev_node[64];
   char nfc_reset_req_node[128];
 
@@ -303,19 +415,22 @@ bool I2cOpenLayer(void* dev, HAL_CALLBACK callb, HALHANDLE* pHandle) {
     return false;
   }
 
-  GetNumValue(NAME_STNFC_CONTROL_CLK, &hal_ctrl_clk, sizeof(hal_ctrl_clk));
-  GetNumValue(NAME_STNFC_ACTIVERW_TIMER, &hal_activerw_timer,
-              sizeof(hal_activerw_timer));
+  i2cReadConfig();
+  RegisterConfigListener(i2cReadConfig);
 
+  sClkState = -1;
   if (hal_ctrl_clk) {
     if (ioctl(fidI2c, ST21NFC_CLK_DISABLE, NULL) < 0) {
       char msg[LINUX_DBGBUFFER_SIZE];
       strerror_r(errno, msg, LINUX_DBGBUFFER_SIZE);
       STLOG_HAL_E("ST21NFC_CLK_DISABLE failed errno %d(%s)", errno, msg);
+    } else {
+      sClkState = 0;
     }
   }
   i2cSetPolarity(fidI2c, false, false);
   i2cResetPulse(fidI2c);
+  NciFramerReset(&sRxFramer, false);
 
   if ((pipe(cmdPipe) == -1)) {
     STLOG_HAL_W("unable to open cmdpipe\n");
@@ -323,6 +438,13 @@ bool I2cOpenLayer(void* dev, HAL_CALLBACK callb, HALHANDLE* pHandle) {
     return false;
   }
 
+  if (GetNumValue(NAME_STNFC_HAL_SINGLE_LOOP, &singleLoop,
+                  sizeof(singleLoop)) &&
+      singleLoop) {
+    STLOG_HAL_D("HAL core runs in the I2C thread\n");
+    NoDbgFlag |= HAL_FLAG_SINGLE_LOOP;
+  }
+
   *pHandle = HalCreate(dev, callb, NoDbgFlag);
 
   if (!*pHandle) {
@@ -340,7 +462,6 @@ bool I2cOpenLayer(void* dev, HAL_CALLBACK callb, HALHANDLE* pHandle) {
  * Terminates the I2C layer.
  */
 void I2cCloseLayer() {
-  uint8_t cmd = 'X';
   int ret;
   ALOGD("%s: enter\n", __func__);
 
@@ -351,7 +472,7 @@ void I2cCloseLayer() {
     return;
   }
 
-  I2cWriteCmd(&cmd, sizeof(cmd));
+  I2cWriteCmd('X', NULL, 0);
   /* wait for terminate */
   ret = pthread_join(threadHandle, (void**)NULL);
   if (ret != 0) {
@@ -370,14 +491,42 @@ void I2cResetPulse() {
   (void)pthread_mutex_lock(&i2ctransport_mtx);
 
   i2cResetPulse(fidI2c);
+  sClkState = -1;
   (void)pthread_mutex_unlock(&i2ctransport_mtx);
 }
+/**
+ * Dump the I2C write counters.
+ * @param fd File descriptor to write to
+ */
+void I2cDump(int fd) {
+  (void)pthread_mutex_lock(&sI2cStatsMutex);
+  dprintf(fd,
+          "I2C writes: %u, errors %u, retried %u, dropped %u, max write %llu "
+          "us, max retry %llu us\n",
+          sI2cStats.writes, sI2cStats.writeErrors, sI2cStats.retriedWrites,
+          sI2cStats.droppedWrites, (unsigned long long)sI2cStats.writeMaxUs,
+          (unsigned long long)sI2cStats.retryMaxUs);
+  dprintf(fd,
+          "I2C reads: frames %u, idle bytes %u, junk bytes %u, resyncs %u\n",
+          sI2cStats.rxFrames, sI2cStats.rxIdle, sI2cStats.rxJunk,
+          sI2cStats.rxResyncs);
+  dprintf(fd,
+          "NFCC clock: state %d, ioctls %u, skipped %u, screen on to written "
+          "last %llu us, max %llu us\n",
+          (int)sClkState, sI2cStats.clkIoctls, sI2cStats.clkSkipped,
+          (unsigned long long)sI2cStats.screenOnLastUs,
+          (unsigned long long)sI2cStats.screenOnMaxUs);
+  (void)pthread_mutex_unlock(&sI2cStatsMutex);
+  HalThreadDump(&sI2cThread, fd);
+}
+
 void I2cRecovery() {
   ALOGD("%s: enter\n", __func__);
 
   (void)pthread_mutex_lock(&i2ctransport_mtx);
   recovery_mode = true;
   SetToRecoveryMode(fidI2c);
+  sClkState = -1;
   recovery_mode = false;
   (void)pthread_mutex_unlock(&i2ctransport_mtx);
 }
@@ -450,89 +599,231 @@ static int SetToRecoveryMode(int fid) {
 } /* SetToRecoveryMode*/
 
 /**
- * Write data to st21nfc, on failure do max 3 retries.
+ * Write data to st21nfc, once. On failure the caller parks the frame for
+ * i2cWriteRetry().
  * @param fid File descriptor for NFC device
  * @param pvBuffer Data to write
  * @param length Data size
  * @return 0 if bytes written, -1 if error
  */
 static int i2cWrite(int fid, const uint8_t* pvBuffer, int length) {
-  int retries = 0;
-  int result = 0;
-  int halfsecs = 0;
-  int clk_state = -1;
-  char msg[LINUX_DBGBUFFER_SIZE];
+  struct timespec start = {0, 0}, stop;
+  bool screenOn = false;
+  unsigned long ctrlClk = hal_ctrl_clk;
+  unsigned long activeRwTimer = hal_activerw_timer;
+  uint64_t us;
+  int result;
 
-  if ((hal_ctrl_clk || hal_activerw_timer) && length >= 4 &&
-      pvBuffer[0] == 0x20 && pvBuffer[1] == 0x09) {
-    if (hal_activerw_timer && (pvBuffer[3] == 0x01 || pvBuffer[3] == 0x03)) {
+  if ((ctrlClk || activeRwTimer) && length >= 4 && pvBuffer[0] == 0x20 &&
+      pvBuffer[1] == 0x09) {
+    if (activeRwTimer && (pvBuffer[3] == 0x01 || pvBuffer[3] == 0x03)) {
       // screen off cases
       hal_wrapper_set_state(HAL_WRAPPER_STATE_SET_ACTIVERW_TIMER);
     }
-    if (hal_ctrl_clk && 0 > (clk_state = ioctl(fid, ST21NFC_CLK_STATE, NULL))) {
+    if (ctrlClk && (pvBuffer[3] == 0x01 || pvBuffer[3] == 0x03)) {
+      i2cSetClock(fid, true);
+    } else if (ctrlClk && (pvBuffer[3] == 0x02 || pvBuffer[3] == 0x00)) {
+      screenOn = true;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      i2cSetClock(fid, false);
+    }
+  }
+
+  result = i2cWriteAttempt(fid, pvBuffer, length);
+  if (screenOn && (result == 0)) {
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    us = (stop.tv_sec - start.tv_sec) * 1000000ULL +
+         (stop.tv_nsec - start.tv_nsec) / 1000;
+    (void)pthread_mutex_lock(&sI2cStatsMutex);
+    sI2cStats.screenOnLastUs = us;
+    if (us > sI2cStats.screenOnMaxUs) sI2cStats.screenOnMaxUs = us;
+    (void)pthread_mutex_unlock(&sI2cStatsMutex);
+  }
+  return result;
+} /* i2cWrite */
+
+/**
+ * Follow the screen state with the NFCC clock: disable it on screen off,
+ * enable it on screen on. The clock state is cached in sClkState, the
+ * driver is only asked for it when unknown, after open or a reset. A reset
+ * on another thread meanwhile wins: the state learned here is only cached
+ * if sClkState did not change.
+ * @param fid File descriptor for NFC device
+ * @param screenOff true for screen off sub-states
+ */
+static void i2cSetClock(int fid, bool screenOff) {
+  char msg[LINUX_DBGBUFFER_SIZE];
+  int cached = sClkState;
+  int clk_state = cached;
+
+  if (clk_state < 0) {
+    if (0 > (clk_state = ioctl(fid, ST21NFC_CLK_STATE, NULL))) {
       strerror_r(errno, msg, LINUX_DBGBUFFER_SIZE);
       STLOG_HAL_E("ST21NFC_CLK_STATE failed errno %d(%s)", errno, msg);
       clk_state = -1;
     }
     STLOG_HAL_D("ST21NFC_CLK_STATE = %d", clk_state);
-    if (clk_state == 1 && (pvBuffer[3] == 0x01 || pvBuffer[3] == 0x03)) {
-      // screen off cases
-      if (ioctl(fid, ST21NFC_CLK_DISABLE, NULL) < 0) {
-        strerror_r(errno, msg, LINUX_DBGBUFFER_SIZE);
-        STLOG_HAL_E("ST21NFC_CLK_DISABLE failed errno %d(%s)", errno, msg);
-      } else if (0 > (clk_state = ioctl(fid, ST21NFC_CLK_STATE, NULL))) {
-        strerror_r(errno, msg, LINUX_DBGBUFFER_SIZE);
-        STLOG_HAL_E("ST21NFC_CLK_STATE failed errno %d(%s)", errno, msg);
-        clk_state = -1;
-      }
-      if (clk_state != 0) {
-        STLOG_HAL_E("CLK_DISABLE STATE ERROR clk_state = %d", clk_state);
-      }
-    } else if (clk_state == 0 && (pvBuffer[3] == 0x02 || pvBuffer[3] == 0x00)) {
-      // screen on cases
-      if (ioctl(fid, ST21NFC_CLK_ENABLE, NULL) < 0) {
-        strerror_r(errno, msg, LINUX_DBGBUFFER_SIZE);
-        STLOG_HAL_E("ST21NFC_CLK_ENABLE failed errno %d(%s)", errno, msg);
-      } else if (0 > (clk_state = ioctl(fid, ST21NFC_CLK_STATE, NULL))) {
-        strerror_r(errno, msg, LINUX_DBGBUFFER_SIZE);
-        STLOG_HAL_E("ST21NFC_CLK_STATE failed errno %d(%s)", errno, msg);
-        clk_state = -1;
-      }
-      if (clk_state != 1) {
-        STLOG_HAL_E("CLK_ENABLE STATE ERROR clk_state = %d", clk_state);
-      }
-    }
+    (void)pthread_mutex_lock(&sI2cStatsMutex);
+    sI2cStats.clkIoctls++;
+    (void)pthread_mutex_unlock(&sI2cStatsMutex);
   }
 
-redo:
-  while (retries < 3) {
-    result = write(fid, pvBuffer, length);
-
-    if (result < 0) {
+  if (clk_state == 1 && screenOff) {
+    if (ioctl(fid, ST21NFC_CLK_DISABLE, NULL) < 0) {
       strerror_r(errno, msg, LINUX_DBGBUFFER_SIZE);
-      STLOG_HAL_W("! i2cWrite!!, errno is '%s'", msg);
-      usleep(4000);
-      retries++;
-    } else if (result > 0) {
-      result = 0;
-      return result;
+      STLOG_HAL_E("ST21NFC_CLK_DISABLE failed errno %d(%s)", errno, msg);
+      clk_state = -1;
     } else {
-      STLOG_HAL_W("write on i2c failed, retrying\n");
-      usleep(4000);
-      retries++;
+      clk_state = 0;
+    }
+  } else if (clk_state == 0 && !screenOff) {
+    if (ioctl(fid, ST21NFC_CLK_ENABLE, NULL) < 0) {
+      strerror_r(errno, msg, LINUX_DBGBUFFER_SIZE);
+      STLOG_HAL_E("ST21NFC_CLK_ENABLE failed errno %d(%s)", errno, msg);
+      clk_state = -1;
+    } else {
+      clk_state = 1;
     }
+  } else {
+    (void)pthread_mutex_lock(&sI2cStatsMutex);
+    sI2cStats.clkSkipped++;
+    (void)pthread_mutex_unlock(&sI2cStatsMutex);
+    sClkState.compare_exchange_strong(cached, clk_state);
+    return;
   }
-  /* If we're here, we failed to write to NFCC. Retry after 500ms because some
-  CPUs have shown such long unavailability sometimes */
-  if (halfsecs < 10) {
-    usleep(500000);
-    retries = 0;
-    halfsecs++;
-    goto redo;
+  (void)pthread_mutex_lock(&sI2cStatsMutex);
+  sI2cStats.clkIoctls++;
+  (void)pthread_mutex_unlock(&sI2cStatsMutex);
+  sClkState.compare_exchange_strong(cached, clk_state);
+} /* i2cSetClock */
+
+
+/**
+ * Write a frame from the HAL core, or park it to be retried from the poll()
+ * timeout if the NFCC refused it.
+ * @param fid File descriptor for NFC device
+ * @param buffer Data to write
+ * @param length Data size
+ */
+static void i2cWriteFrame(int fid, const uint8_t* buffer, size_t length) {
+  if (i2cWrite(fid, buffer, length) < 0) {
+    memcpy(sWriteRetry.buffer, buffer, length);
+    sWriteRetry.length = length;
+    sWriteRetry.delayMs = I2C_WRITE_RETRY_FIRST_MS;
+    clock_gettime(CLOCK_MONOTONIC, &sWriteRetry.first);
+    sWriteRetry.next = sWriteRetry.first;
+    sWriteRetry.next.tv_nsec += I2C_WRITE_RETRY_FIRST_MS * 1000000;
+    if (sWriteRetry.next.tv_nsec >= 1000000000) {
+      sWriteRetry.next.tv_sec++;
+      sWriteRetry.next.tv_nsec -= 1000000000;
+    }
+    sWriteRetryPending = true;
   }
-  /* The CLF did not recover, give up */
-  return -1;
-} /* i2cWrite */
+}
+
+/**
+ * One write() to st21nfc, accounted in sI2cStats.
+ * @param fid File descriptor for NFC device
+ * @param pvBuffer Data to write
+ * @param length Data size
+ * @return 0 if bytes written, -1 if error
+ */
+static int i2cWriteAttempt(int fid, const uint8_t* pvBuffer, int length) {
+  struct timespec start, stop;
+  char msg[LINUX_DBGBUFFER_SIZE];
+  uint64_t us;
+  int result;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  result = write(fid, pvBuffer, length);
+  clock_gettime(CLOCK_MONOTONIC, &stop);
+  us = (stop.tv_sec - start.tv_sec) * 1000000ULL +
+       (stop.tv_nsec - start.tv_nsec) / 1000;
+
+  if (result < 0) {
+    strerror_r(errno, msg, LINUX_DBGBUFFER_SIZE);
+    STLOG_HAL_W("! i2cWrite!!, errno is '%s'", msg);
+  } else if (result == 0) {
+    STLOG_HAL_W("write on i2c failed, retrying\n");
+  }
+
+  (void)pthread_mutex_lock(&sI2cStatsMutex);
+  if (us > sI2cStats.writeMaxUs) sI2cStats.writeMaxUs = us;
+  if (result > 0) {
+    sI2cStats.writes++;
+  } else {
+    sI2cStats.writeErrors++;
+  }
+  (void)pthread_mutex_unlock(&sI2cStatsMutex);
+
+  return (result > 0) ? 0 : -1;
+} /* i2cWriteAttempt */
+
+/**
+ * Time until the next attempt of the parked write, as a poll() timeout.
+ * @return -1 if no write is parked, else delay in ms (0 if due)
+ */
+static int i2cWriteRetryTimeout() {
+  struct timespec now;
+  long long ms;
+
+  if (!sWriteRetryPending) return -1;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  ms = (sWriteRetry.next.tv_sec - now.tv_sec) * 1000LL +
+       (sWriteRetry.next.tv_nsec - now.tv_nsec + 999999) / 1000000;
+  return (ms > 0) ? (int)ms : 0;
+}
+
+/**
+ * Retry the parked write. On failure, schedule the next attempt with twice
+ * the delay, or drop the frame after I2C_WRITE_GIVE_UP_MS.
+ * @param fid File descriptor for NFC device
+ */
+static void i2cWriteRetry(int fid) {
+  struct timespec now;
+  uint64_t elapsedUs;
+
+  if (i2cWriteAttempt(fid, sWriteRetry.buffer, sWriteRetry.length) == 0) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsedUs = (now.tv_sec - sWriteRetry.first.tv_sec) * 1000000ULL +
+                (now.tv_nsec - sWriteRetry.first.tv_nsec) / 1000;
+    STLOG_HAL_D("i2cWrite went through after %llu us",
+                (unsigned long long)elapsedUs);
+    (void)pthread_mutex_lock(&sI2cStatsMutex);
+    sI2cStats.retriedWrites++;
+    if (elapsedUs > sI2cStats.retryMaxUs) sI2cStats.retryMaxUs = elapsedUs;
+    (void)pthread_mutex_unlock(&sI2cStatsMutex);
+    sWriteRetryPending = false;
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  elapsedUs = (now.tv_sec - sWriteRetry.first.tv_sec) * 1000000ULL +
+              (now.tv_nsec - sWriteRetry.first.tv_nsec) / 1000;
+  if (elapsedUs >= I2C_WRITE_GIVE_UP_MS * 1000ULL) {
+    /* The CLF did not recover, give up */
+    STLOG_HAL_E("! i2cWrite failed for %llu ms, frame dropped",
+                (unsigned long long)(elapsedUs / 1000));
+    (void)pthread_mutex_lock(&sI2cStatsMutex);
+    sI2cStats.droppedWrites++;
+    (void)pthread_mutex_unlock(&sI2cStatsMutex);
+    sWriteRetryPending = false;
+    return;
+  }
+
+  sWriteRetry.delayMs *= 2;
+  if (sWriteRetry.delayMs > I2C_WRITE_RETRY_MAX_MS) {
+    sWriteRetry.delayMs = I2C_WRITE_RETRY_MAX_MS;
+  }
+  sWriteRetry.next = now;
+  sWriteRetry.next.tv_sec += sWriteRetry.delayMs / 1000;
+  sWriteRetry.next.tv_nsec += (sWriteRetry.delayMs % 1000) * 1000000;
+  if (sWriteRetry.next.tv_nsec >= 1000000000) {
+    sWriteRetry.next.tv_sec++;
+    sWriteRetry.next.tv_nsec -= 1000000000;
+  }
+} /* i2cWriteRetry */
 
 /**
  * Read data from st21nfc, on failure do max 3 retries.
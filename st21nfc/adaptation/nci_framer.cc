@@ -0,0 +1,79 @@
+/** ----------------------------------------------------------------------
+ *
+ * Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ ----------------------------------------------------------------------*/
+#include "nci_framer.h"
+
+#include <string.h>
+
+void NciFramerReset(NciFramer* f, bool junk) {
+  if (junk && f->len) {
+    f->junk += f->len;
+    f->resyncs++;
+  }
+  f->len = 0;
+}
+
+size_t NciFramerNeeded(const NciFramer* f) {
+  if (f->len < NCI_FRAMER_HEADER_SIZE) return NCI_FRAMER_HEADER_SIZE - f->len;
+  return NCI_FRAMER_HEADER_SIZE + f->frame[2] - f->len;
+}
+
+size_t NciFramerPush(NciFramer* f, const uint8_t* data, size_t len,
+                     bool* complete) {
+  size_t i = 0;
+
+  *complete = false;
+  while (i < len) {
+    if (f->len == 0) {
+      // first byte: skip idle bytes, a message type above 3 is not NCI
+      if (data[i] == NCI_FRAMER_IDLE) {
+        f->idle++;
+        i++;
+        continue;
+      }
+      if ((data[i] >> 5) > 3) {
+        f->junk++;
+        f->resyncs++;
+        i++;
+        continue;
+      }
+      f->frame[f->len++] = data[i++];
+    } else if (f->len == 1) {
+      // an idle byte here means the first one was junk, restart on it
+      if (data[i] == NCI_FRAMER_IDLE) {
+        NciFramerReset(f, true);
+        continue;
+      }
+      f->frame[f->len++] = data[i++];
+    } else {
+      size_t n = NciFramerNeeded(f);
+      if (n > len - i) n = len - i;
+      memcpy(f->frame + f->len, data + i, n);
+      f->len += n;
+      i += n;
+    }
+
+    if ((f->len >= NCI_FRAMER_HEADER_SIZE) &&
+        (f->len == NCI_FRAMER_HEADER_SIZE + (size_t)f->frame[2])) {
+      f->frames++;
+      *complete = true;
+      break;
+    }
+  }
+  return i;
+}
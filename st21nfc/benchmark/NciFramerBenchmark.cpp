@@ -0,0 +1,106 @@
+/** ----------------------------------------------------------------------
+ *
+ * Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ ----------------------------------------------------------------------*/
+#include <benchmark/benchmark.h>
+#include <string.h>
+
+#include <random>
+#include <vector>
+
+#include "nci_framer.h"
+
+#define STREAM_FRAMES 10000
+
+// What the CLF sends: frames of any payload size, up to 2 idle bytes
+// before each of them.
+static const std::vector<uint8_t>& stream() {
+  static std::vector<uint8_t> bytes;
+  static const uint8_t kFirst[] = {0x00, 0x01, 0x40, 0x41, 0x60, 0x61, 0x6F};
+
+  if (!bytes.empty()) return bytes;
+  std::mt19937 rng(42);
+  for (int i = 0; i < STREAM_FRAMES; i++) {
+    size_t payload = rng() % 256;
+
+    for (size_t idle = rng() % 3; idle > 0; idle--) {
+      bytes.push_back(NCI_FRAMER_IDLE);
+    }
+    bytes.push_back(kFirst[rng() % sizeof(kFirst)]);
+    bytes.push_back(rng() % 0x40);
+    bytes.push_back(payload);
+    for (size_t j = 0; j < payload; j++) bytes.push_back(rng());
+  }
+  return bytes;
+}
+
+// The reads of I2cWorkerThread(): the header, then the whole payload.
+static void BM_NciFramerI2cReads(benchmark::State& state) {
+  const std::vector<uint8_t>& bytes = stream();
+  uint8_t buffer[NCI_FRAMER_MAX_FRAME];
+  NciFramer f;
+
+  memset(&f, 0, sizeof(f));
+  for (auto _ : state) {
+    size_t pos = 0;
+
+    while (pos < bytes.size()) {
+      size_t needed = NciFramerNeeded(&f);
+      bool complete;
+
+      if (needed > bytes.size() - pos) needed = bytes.size() - pos;
+      memcpy(buffer, bytes.data() + pos, needed);
+      pos += needed;
+      NciFramerPush(&f, buffer, needed, &complete);
+      if (complete) {
+        benchmark::DoNotOptimize(f.frame);
+        NciFramerReset(&f, false);
+      }
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * bytes.size());
+}
+BENCHMARK(BM_NciFramerI2cReads);
+
+// The same bytes in chunks of a fixed size, frames split anywhere.
+static void BM_NciFramerChunks(benchmark::State& state) {
+  const std::vector<uint8_t>& bytes = stream();
+  size_t chunk = state.range(0);
+  NciFramer f;
+
+  memset(&f, 0, sizeof(f));
+  for (auto _ : state) {
+    for (size_t pos = 0; pos < bytes.size(); pos += chunk) {
+      size_t len = (chunk < bytes.size() - pos) ? chunk : bytes.size() - pos;
+      size_t i = 0;
+
+      while (i < len) {
+        bool complete;
+
+        i += NciFramerPush(&f, bytes.data() + pos + i, len - i, &complete);
+        if (complete) {
+          benchmark::DoNotOptimize(f.frame);
+          NciFramerReset(&f, false);
+        }
+      }
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * bytes.size());
+}
+BENCHMARK(BM_NciFramerChunks)->Arg(1)->Arg(3)->Arg(32)->Arg(258);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,70 @@
+/** ----------------------------------------------------------------------
+ *
+ * Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ ----------------------------------------------------------------------*/
+#include <fuzzer/FuzzedDataProvider.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include "nci_framer.h"
+
+// Bytes from the CLF, given to the framer in chunks of any size, with read
+// errors in between. Every byte must end up in a frame, or be counted as
+// idle or junk.
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+  FuzzedDataProvider fdp(data, size);
+  NciFramer f;
+  size_t pushed = 0, framed = 0;
+
+  memset(&f, 0, sizeof(f));
+  while (fdp.remaining_bytes() > 0) {
+    if (fdp.ConsumeProbability<float>() < 0.05) {
+      // read error, the partial frame is dropped
+      NciFramerReset(&f, true);
+      continue;
+    }
+    size_t chunk =
+        fdp.ConsumeIntegralInRange<size_t>(1, 2 * NCI_FRAMER_MAX_FRAME);
+    std::vector<uint8_t> bytes = fdp.ConsumeBytes<uint8_t>(chunk);
+    size_t i = 0;
+
+    pushed += bytes.size();
+    while (i < bytes.size()) {
+      bool complete;
+      size_t needed = NciFramerNeeded(&f);
+
+      if (needed == 0 || f.len + needed > NCI_FRAMER_MAX_FRAME) abort();
+      i += NciFramerPush(&f, bytes.data() + i, bytes.size() - i, &complete);
+      if (i > bytes.size()) abort();
+      if (complete) {
+        if (f.len < NCI_FRAMER_HEADER_SIZE ||
+            f.len != NCI_FRAMER_HEADER_SIZE + (size_t)f.frame[2] ||
+            f.frame[0] == NCI_FRAMER_IDLE || (f.frame[0] >> 5) > 3 ||
+            f.frame[1] == NCI_FRAMER_IDLE) {
+          abort();
+        }
+        framed += f.len;
+        NciFramerReset(&f, false);
+      }
+    }
+  }
+
+  if (framed + f.len + f.idle + f.junk != pushed) abort();
+  return 0;
+}
@@ -0,0 +1,513 @@
+/** ----------------------------------------------------------------------
+ *
+ * Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ ----------------------------------------------------------------------*/
+#define LOG_TAG "NfcHalConfigCache"
+
+#include "hal_config_cache.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "android_logmsg.h"
+#include "halcore_private.h"
+
+typedef struct {
+  bool valid;
+  uint8_t length;
+  uint8_t value[HAL_CONFIG_CACHE_VALUE_MAX];
+} ConfigParam;
+
+typedef struct {
+  size_t cmdLength;  // 0 if the slot is free
+  uint8_t cmd[16];
+  size_t rspLength;
+  uint8_t rsp[MAX_BUFFER_SIZE];
+} ConfigPropAnswer;
+
+typedef struct {
+  uint32_t coreHits;  // CORE_GET_CONFIG answered, or that could have been
+  uint32_t coreMisses;
+  uint32_t propHits;  // proprietary GET_CONFIG
+  uint32_t propMisses;
+  uint32_t wrong;    // NFCC answer not the one of the cache
+  uint32_t cleared;  // CORE_RESET
+  uint32_t tables;     // routing tables pushed by the stack
+  uint32_t identical;  // the same as the previous one
+  uint32_t skipped;    // answered by the HAL
+  uint32_t saved;      // routing messages answered by the HAL
+  uint32_t replayed;   // answered, then sent as a later one differed
+  uint32_t writes;     // routing tables sent to the NFCC
+  uint64_t writeTotalUs;
+  uint64_t writeMaxUs;
+} ConfigCacheStats;
+
+typedef struct {
+  size_t length;
+  uint8_t data[MAX_BUFFER_SIZE];
+} RoutingMessage;
+
+static pthread_mutex_t sConfigCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long sAnswer;  // STNFC_CONFIG_CACHE
+static ConfigParam sParams[256];
+static ConfigPropAnswer sProp[HAL_CONFIG_CACHE_PROP];
+static int sPropNext;
+// command waiting for its response
+static uint8_t sPending[MAX_BUFFER_SIZE];
+static size_t sPendingLength;
+static bool sCmdSegmented;
+static bool sRspSegmented;
+// not answered but a hit, checked against the NFCC answer
+static uint8_t sPredicted[MAX_BUFFER_SIZE];
+static size_t sPredictedLength;
+static ConfigCacheStats sStats;
+// last routing table the NFCC accepted, and the one pushed
+static unsigned long sRoutingAnswer;  // STNFC_ROUTING_CACHE
+static RoutingMessage sRouting[HAL_CONFIG_CACHE_ROUTING];
+static int sRoutingCount;  // 0 if unknown
+static RoutingMessage sPush[HAL_CONFIG_CACHE_ROUTING];
+static int sPushCount;
+static bool sPushDone;      // its last message was seen
+static bool sPushOk;        // accepted so far and cacheable
+static int sPushSkipped;    // first messages answered, not sent yet
+static int sReplayNext;     // next one of these to send
+static bool sReplayHeld;    // the message that differs waits for them
+static bool sReplaying;     // waiting for the response of one of them
+static bool sPushWriting;   // a message went to the NFCC
+static struct timespec sPushStart;
+
+/**
+ * Size of the next parameter of a TLV list.
+ * @param p parameter
+ * @param left bytes left in the list
+ * @return size of the parameter, 0 if it does not fit
+ */
+static size_t configTlvSize(const uint8_t* p, size_t left) {
+  // NCI 2.0 extended parameter ID
+  size_t idSize = (p[0] == 0xFF) ? 2 : 1;
+
+  if (left < idSize + 1 || left < idSize + 1 + p[idSize]) return 0;
+  return idSize + 1 + p[idSize];
+}
+
+static void configRoutingAbort() {
+  sPushCount = 0;
+  sPushDone = false;
+  sPushOk = false;
+  sPushSkipped = 0;
+  sReplayNext = 0;
+  sReplayHeld = false;
+  sReplaying = false;
+  sPushWriting = false;
+}
+
+static void configForgetAll() {
+  memset(sParams, 0, sizeof(sParams));
+  memset(sProp, 0, sizeof(sProp));
+  sPropNext = 0;
+  sRoutingCount = 0;
+  configRoutingAbort();
+}
+
+/**
+ * The routing table pushed is complete, keep it if the NFCC accepted it.
+ */
+static void configRoutingDone() {
+  bool identical = sPushOk && sPushCount == sRoutingCount;
+
+  for (int i = 0; identical && i < sPushCount; i++) {
+    identical = sPush[i].length == sRouting[i].length &&
+                !memcmp(sPush[i].data, sRouting[i].data, sPush[i].length);
+  }
+  sStats.tables++;
+  if (identical) sStats.identical++;
+
+  if (sPushWriting) {
+    struct timespec now;
+    uint64_t us;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    us = (now.tv_sec - sPushStart.tv_sec) * 1000000LL +
+         (now.tv_nsec - sPushStart.tv_nsec) / 1000;
+    sStats.writes++;
+    sStats.writeTotalUs += us;
+    if (us > sStats.writeMaxUs) sStats.writeMaxUs = us;
+  } else {
+    sStats.skipped++;
+  }
+
+  if (sPushOk) {
+    memcpy(sRouting, sPush, sPushCount * sizeof(sPush[0]));
+    sRoutingCount = sPushCount;
+  } else {
+    sRoutingCount = 0;
+  }
+  sPushDone = true;
+}
+
+/**
+ * Answer a message of the routing table pushed if it is the one of the
+ * previous table, or get the messages answered before it replayed.
+ * @return true if answered
+ */
+static bool configRoutingAnswer(const uint8_t* cmd, size_t length,
+                                uint8_t* rsp, size_t* rspLength) {
+  int idx;
+
+  if (sReplayHeld) {
+    // the message that differs, back after the replay
+    if (sReplayNext == sPushSkipped) {
+      sReplayHeld = false;
+      sPushSkipped = 0;
+    }
+    return false;
+  }
+  if (sPushDone || !sPushCount) {
+    configRoutingAbort();
+    sPushOk = true;
+  }
+
+  idx = sPushCount;
+  if (idx >= HAL_CONFIG_CACHE_ROUTING || (cmd[0] & 0x10)) {
+    // too large to cache
+    sPushOk = false;
+  } else {
+    memcpy(sPush[idx].data, cmd, length);
+    sPush[idx].length = length;
+    sPushCount++;
+  }
+
+  if (sRoutingAnswer && sPushOk && sPushSkipped == idx &&
+      idx < sRoutingCount && sRouting[idx].length == length &&
+      !memcmp(sRouting[idx].data, cmd, length)) {
+    sPushSkipped++;
+    sStats.saved++;
+    rsp[0] = 0x41;
+    rsp[1] = 0x01;
+    rsp[2] = 0x01;
+    rsp[3] = 0x00;  // STATUS_OK
+    *rspLength = 4;
+    if (cmd[3] == 0x00) {
+      // last message
+      configRoutingDone();
+    }
+    return true;
+  }
+
+  if (sPushSkipped) {
+    // the NFCC did not see the first messages of this table yet
+    sReplayNext = 0;
+    sReplayHeld = true;
+  }
+  if (length >= 4 && cmd[3] == 0x00) sPushDone = true;
+  return false;
+}
+
+/**
+ * Learn or forget the parameters of a TLV list.
+ * @param p first parameter
+ * @param left size of the list
+ * @param learn false to forget them
+ */
+static void configStoreTlvs(const uint8_t* p, size_t left, bool learn) {
+  size_t size;
+
+  while (left && (size = configTlvSize(p, left)) != 0) {
+    if (p[0] != 0xFF) {
+      ConfigParam* param = &sParams[p[0]];
+      param->valid = learn && p[1] <= HAL_CONFIG_CACHE_VALUE_MAX;
+      if (param->valid) {
+        param->length = p[1];
+        memcpy(param->value, p + 2, p[1]);
+      }
+    }
+    p += size;
+    left -= size;
+  }
+}
+
+/**
+ * CORE_GET_CONFIG_RSP from the cache.
+ * @return true if all the parameters are known
+ */
+static bool configCoreAnswer(const uint8_t* cmd, size_t length, uint8_t* rsp,
+                             size_t* rspLength) {
+  size_t off = 5;
+
+  if (length < 4 || length != (size_t)cmd[2] + 3 ||
+      cmd[3] != length - 4) {
+    // extended parameter IDs or malformed
+    return false;
+  }
+
+  for (size_t i = 4; i < length; i++) {
+    ConfigParam* param = &sParams[cmd[i]];
+    if (!param->valid || off + 2 + param->length > MAX_BUFFER_SIZE) {
+      return false;
+    }
+    rsp[off++] = cmd[i];
+    rsp[off++] = param->length;
+    memcpy(rsp + off, param->value, param->length);
+    off += param->length;
+  }
+  rsp[0] = 0x40;
+  rsp[1] = 0x03;
+  rsp[2] = (uint8_t)(off - 3);
+  rsp[3] = 0x00;  // STATUS_OK
+  rsp[4] = cmd[3];
+  *rspLength = off;
+  return true;
+}
+
+/**
+ * Proprietary GET_CONFIG response from the cache.
+ * @return true if the same command was answered before
+ */
+static bool configPropAnswer(const uint8_t* cmd, size_t length, uint8_t* rsp,
+                             size_t* rspLength) {
+  for (int i = 0; i < HAL_CONFIG_CACHE_PROP; i++) {
+    if (sProp[i].cmdLength == length && !memcmp(sProp[i].cmd, cmd, length)) {
+      memcpy(rsp, sProp[i].rsp, sProp[i].rspLength);
+      *rspLength = sProp[i].rspLength;
+      return true;
+    }
+  }
+  return false;
+}
+
+void HalConfigCacheSetup() {
+  unsigned long answer = 0;
+
+  unsigned long routingAnswer = 0;
+
+  GetNumValue(NAME_STNFC_CONFIG_CACHE, &answer, sizeof(answer));
+  GetNumValue(NAME_STNFC_ROUTING_CACHE, &routingAnswer,
+              sizeof(routingAnswer));
+
+  (void)pthread_mutex_lock(&sConfigCacheMutex);
+  sAnswer = answer;
+  sRoutingAnswer = routingAnswer;
+  configForgetAll();
+  sPendingLength = 0;
+  sPredictedLength = 0;
+  sCmdSegmented = false;
+  sRspSegmented = false;
+  memset(&sStats, 0, sizeof(sStats));
+  (void)pthread_mutex_unlock(&sConfigCacheMutex);
+}
+
+bool HalConfigCacheLookup(const uint8_t* cmd, size_t length, uint8_t* rsp,
+                          size_t* rspLength) {
+  bool hit;
+
+  if (length < 4) return false;
+
+  (void)pthread_mutex_lock(&sConfigCacheMutex);
+  sPredictedLength = 0;
+  if ((cmd[0] & 0xEF) == 0x21 && cmd[1] == 0x01) {
+    hit = configRoutingAnswer(cmd, length, rsp, rspLength);
+    (void)pthread_mutex_unlock(&sConfigCacheMutex);
+    return hit;
+  } else if (cmd[0] == 0x20 && cmd[1] == 0x03) {
+    hit = configCoreAnswer(cmd, length, rsp, rspLength);
+    hit ? sStats.coreHits++ : sStats.coreMisses++;
+  } else if (cmd[0] == 0x2F && cmd[1] == 0x02 && cmd[3] == 0x03) {
+    hit = configPropAnswer(cmd, length, rsp, rspLength);
+    hit ? sStats.propHits++ : sStats.propMisses++;
+  } else {
+    (void)pthread_mutex_unlock(&sConfigCacheMutex);
+    return false;
+  }
+
+  if (hit && !sAnswer) {
+    memcpy(sPredicted, rsp, *rspLength);
+    sPredictedLength = *rspLength;
+    hit = false;
+  }
+  (void)pthread_mutex_unlock(&sConfigCacheMutex);
+
+  if (hit) {
+    STLOG_HAL_D("%02x %02x answered from the config cache\n", cmd[0], cmd[1]);
+  }
+  return hit;
+}
+
+bool HalConfigCacheReplay(uint8_t* cmd, size_t* length) {
+  RoutingMessage* m;
+
+  (void)pthread_mutex_lock(&sConfigCacheMutex);
+  if (!sReplayHeld || sReplayNext >= sPushSkipped) {
+    (void)pthread_mutex_unlock(&sConfigCacheMutex);
+    return false;
+  }
+  m = &sPush[sReplayNext++];
+  memcpy(cmd, m->data, m->length);
+  *length = m->length;
+  memcpy(sPending, m->data, m->length);
+  sPendingLength = m->length;
+  sCmdSegmented = false;
+  sReplaying = true;
+  if (!sPushWriting) {
+    sPushWriting = true;
+    clock_gettime(CLOCK_MONOTONIC, &sPushStart);
+  }
+  sStats.replayed++;
+  sStats.saved--;
+  (void)pthread_mutex_unlock(&sConfigCacheMutex);
+  return true;
+}
+
+void HalConfigCacheSent(const uint8_t* cmd, size_t length) {
+  bool segmented;
+
+  if (length < 3 || (cmd[0] & 0xE0) != 0x20) return;
+
+  (void)pthread_mutex_lock(&sConfigCacheMutex);
+  // a segment, or the last one of a command in segments
+  segmented = sCmdSegmented || (cmd[0] & 0x10);
+  sCmdSegmented = (cmd[0] & 0x10) != 0;
+  sPendingLength = 0;
+
+  if ((cmd[0] & 0xEF) == 0x20 && cmd[1] == 0x02) {
+    // CORE_SET_CONFIG_CMD: unknown until the NFCC accepts it
+    if (segmented) {
+      memset(sParams, 0, sizeof(sParams));
+    } else if (length >= 4) {
+      configStoreTlvs(cmd + 4, length - 4, false);
+    }
+  } else if ((cmd[0] & 0xEF) == 0x2F && cmd[1] == 0x02 &&
+             (segmented || length < 4 || cmd[3] != 0x03)) {
+    // any other proprietary configuration command
+    memset(sProp, 0, sizeof(sProp));
+  } else if ((cmd[0] & 0xEF) == 0x21 && cmd[1] == 0x01 && !sPushWriting) {
+    sPushWriting = true;
+    clock_gettime(CLOCK_MONOTONIC, &sPushStart);
+  } else if ((cmd[0] & 0xEF) == 0x22 && cmd[1] == 0x01) {
+    // NFCEE_MODE_SET_CMD, the NFCC may drop the routes to it
+    sRoutingCount = 0;
+  }
+
+  if (!segmented) {
+    memcpy(sPending, cmd, length);
+    sPendingLength = length;
+  }
+  (void)pthread_mutex_unlock(&sConfigCacheMutex);
+}
+
+bool HalConfigCacheReceived(const uint8_t* data, size_t length) {
+  bool segmented, replayed = false;
+
+  if (length < 4) return false;
+
+  (void)pthread_mutex_lock(&sConfigCacheMutex);
+  if (((data[0] & 0xEF) == 0x40 || (data[0] & 0xEF) == 0x60) &&
+      data[1] == 0x00) {
+    // CORE_RESET_RSP / NTF: the NFCC is back to its defaults
+    configForgetAll();
+    sPendingLength = 0;
+    sPredictedLength = 0;
+    sStats.cleared++;
+  }
+
+  if ((data[0] & 0xE0) != 0x40) {
+    (void)pthread_mutex_unlock(&sConfigCacheMutex);
+    return false;
+  }
+  segmented = sRspSegmented || (data[0] & 0x10);
+  sRspSegmented = (data[0] & 0x10) != 0;
+  if (sRspSegmented || !sPendingLength ||
+      (data[0] & 0x0F) != (sPending[0] & 0x0F) ||
+      (data[1] & 0x3F) != (sPending[1] & 0x3F)) {
+    (void)pthread_mutex_unlock(&sConfigCacheMutex);
+    return false;
+  }
+
+  if (sPredictedLength &&
+      (sPredictedLength != length || memcmp(sPredicted, data, length))) {
+    sStats.wrong++;
+    STLOG_HAL_W("config cache out of date for %02x %02x\n", sPending[0],
+                sPending[1]);
+  }
+
+  if (segmented) {
+    // too large to cache
+  } else if (data[0] == 0x40 && data[1] == 0x02 && data[3] == 0x00 &&
+             sPendingLength >= 4) {
+    // CORE_SET_CONFIG_RSP, accepted
+    configStoreTlvs(sPending + 4, sPendingLength - 4, true);
+  } else if (data[0] == 0x40 && data[1] == 0x03 && length >= 5 &&
+             data[3] == 0x00) {
+    // CORE_GET_CONFIG_RSP
+    configStoreTlvs(data + 5, length - 5, true);
+  } else if (data[0] == 0x4F && data[1] == 0x02 && data[3] == 0x00 &&
+             sPendingLength >= 4 && sPending[3] == 0x03 &&
+             sPendingLength <= sizeof(sProp[0].cmd)) {
+    // proprietary GET_CONFIG response, replaces the one of the same command
+    int slot = sPropNext;
+    for (int i = 0; i < HAL_CONFIG_CACHE_PROP; i++) {
+      if (sProp[i].cmdLength == sPendingLength &&
+          !memcmp(sProp[i].cmd, sPending, sPendingLength)) {
+        slot = i;
+        break;
+      }
+    }
+    if (slot == sPropNext) sPropNext = (sPropNext + 1) % HAL_CONFIG_CACHE_PROP;
+    memcpy(sProp[slot].cmd, sPending, sPendingLength);
+    sProp[slot].cmdLength = sPendingLength;
+    memcpy(sProp[slot].rsp, data, length);
+    sProp[slot].rspLength = length;
+  } else if (data[0] == 0x41 && data[1] == 0x01 && sPushCount) {
+    // RF_SET_LISTEN_MODE_ROUTING_RSP
+    replayed = sReplaying;
+    sReplaying = false;
+    if (data[3] != 0x00) {
+      STLOG_HAL_E("routing message %s refused (0x%02x)\n",
+                  replayed ? "replayed" : "", data[3]);
+      sPushOk = false;
+      // the stack was told the replayed ones went through, stop there
+      if (replayed) sReplayNext = sPushSkipped;
+    }
+    if (!replayed && sPushDone) configRoutingDone();
+  }
+  sPendingLength = 0;
+  sPredictedLength = 0;
+  (void)pthread_mutex_unlock(&sConfigCacheMutex);
+  return replayed;
+}
+
+void HalConfigCacheDump(int fd) {
+  (void)pthread_mutex_lock(&sConfigCacheMutex);
+  dprintf(fd,
+          "Config cache (%s): CORE_GET_CONFIG hits %u, misses %u, proprietary "
+          "GET_CONFIG hits %u, misses %u, out of date %u, cleared %u\n",
+          sAnswer ? "answering" : "not answering", sStats.coreHits,
+          sStats.coreMisses, sStats.propHits, sStats.propMisses, sStats.wrong,
+          sStats.cleared);
+  dprintf(fd,
+          "Routing cache (%s): tables %u, identical %u, skipped %u (%u "
+          "messages), replayed %u messages, written %u, write avg %llu us, "
+          "max %llu us\n",
+          sRoutingAnswer ? "answering" : "not answering", sStats.tables,
+          sStats.identical, sStats.skipped, sStats.saved, sStats.replayed,
+          sStats.writes,
+          (unsigned long long)(sStats.writes
+                                   ? sStats.writeTotalUs / sStats.writes
+                                   : 0),
+          (unsigned long long)sStats.writeMaxUs);
+  (void)pthread_mutex_unlock(&sConfigCacheMutex);
+}
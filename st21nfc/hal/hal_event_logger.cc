@@ -36,6 +36,7 @@ HalEventLogger& HalEventLogger::getInstance() {
   return nfc_event_eventLogger;
 }
 HalEventLogger& HalEventLogger::log() {
+  if (!logging_enabled) return getInstance();
   struct timespec tv;
   clock_gettime(CLOCK_REALTIME, &tv);
   time_t rawtime = tv.tv_sec;
@@ -22,22 +22,80 @@
 #include <android-base/properties.h>
 #include <dlfcn.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <hardware/nfc.h>
+#include <limits.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "android_logmsg.h"
 #include "hal_event_logger.h"
 #include "halcore.h"
+#include "hex_decode.h"
 /* Initialize fw info structure pointer used to access fw info structure */
 FWInfo* mFWInfo = NULL;
 
 FWCap* mFWCap = NULL;
 
-FILE* mFwFileBin;
+/* FW patch file, mapped once, and the raw APDUs it contains */
+const uint8_t* mFwImage = NULL;
+size_t mFwImageSize = 0;
+FWApdu* mFwApdus = NULL;
+size_t mFwApduCount = 0;
+size_t mFwApduNext = 0;  // next APDU to send
+size_t mFwApduLast = 0;  // last APDU sent, sent again on retry
+
+/* FW download statistics, reported once the last APDU is acknowledged */
+typedef struct FWDownloadStats {
+  struct timespec start;  // erase command sent
+  struct timespec sent;   // last raw APDU sent
+  bool pending;           // a raw APDU is waiting for its response
+  uint32_t apdus;    // acknowledged, retries not included
+  uint32_t retries;
+  uint64_t bytes;    // of the acknowledged APDUs
+  uint64_t rttSumUs;
+  uint32_t rttMinUs;
+  uint32_t rttMaxUs;
+} FWDownloadStats;
+static FWDownloadStats sFwDlStats;
+
+/* FW download checkpoint, to resume an interrupted update of the same patch */
+#define FW_CHECKPOINT_PATH "/data/vendor/nfc/st_fw_dl.checkpoint"
+#define FW_CHECKPOINT_MAGIC 0x50435746  // "FWCP"
+#define FW_CHECKPOINT_INTERVAL 32       // acked APDUs between two checkpoints
+typedef struct FWCheckpoint {
+  uint32_t magic;
+  uint32_t fwVersion;  // version of the FW patch being downloaded
+  uint32_t imageSize;
+  uint32_t imageDigest;
+  uint32_t apduCount;
+  uint32_t apduAcked;  // APDUs acknowledged by the loader
+} FWCheckpoint;
+static bool sFwResumeEnabled = false;
+static bool sFwResumed = false;  // current download resumed from a checkpoint
+static uint32_t sFwImageDigest = 0;
+static int sFwCheckpointFd = -1;
+
+/* Compiled form of a text FW custom parameters script, see
+ * hal_fd_convert_custom_file_path() */
+#define FW_CUSTOM_CACHE_PATH "/data/vendor/nfc/"
+#define FW_CUSTOM_CACHE_MAGIC 0x43435746  // "FWCC"
+typedef struct FWCustomCacheHeader {
+  uint32_t magic;
+  uint32_t crc;  // "REM Script CRC is" value
+  uint64_t sourceSize;
+  int64_t sourceMtimeSec;
+  int64_t sourceMtimeNsec;
+  uint32_t binDigest;
+  uint32_t reserved;
+  uint64_t binSize;  // compiled script follows
+} FWCustomCacheHeader;
+
 FILE* mCustomFileBin;
 char* mCustomFileBuffer;
-fpos_t mPos;
-fpos_t mPosInit;
 uint8_t mBinData[260];
 bool mRetry = true;
 bool mCustomParamFailed = false;
@@ -179,38 +237,17 @@ void hal_fd_parse_custom_file_txt_line(size_t* fileBinSize, char* line) {
   mCustomFileBuffer[newFileBinSize++] = 0x02;
   size_t lenOffset = newFileBinSize++;
 
-  size_t payloadLen = 0;
-  char n[3] = {0};
-  int nidx = 0;
-
-  for (char* p = line; *p; ++p) {
-    if (isspace(*p)) {
-      if (nidx != 0) {
-        STLOG_HAL_E("FW config hex pair incomplete: %s\n", line);
-        return;
-      }
-
-      continue;
-    }
-
-    if (!isxdigit(*p)) {
-      STLOG_HAL_D("Skip FW config line: %s\n", line);
-      return;
-    }
-
-    n[nidx++] = *p;
-    if (nidx == 2) {
-      int value = (int)strtol(n, NULL, 16);
-      mCustomFileBuffer[newFileBinSize++] = value;
-      nidx = 0;
-      payloadLen++;
-    }
-  }
-
-  if (nidx != 0) {
-    STLOG_HAL_E("FW config line incomplete: %s\n", line);
+  ssize_t payloadLen =
+      HexDecode(line, strlen(line),
+                (uint8_t*)mCustomFileBuffer + newFileBinSize, 0);
+  if (payloadLen == HEX_DECODE_ODD) {
+    STLOG_HAL_E("FW config hex pair incomplete: %s\n", line);
+    return;
+  } else if (payloadLen < 0) {
+    STLOG_HAL_D("Skip FW config line: %s\n", line);
     return;
   }
+  newFileBinSize += payloadLen;
 
   if (payloadLen > 0xff) {
     STLOG_HAL_E("FW config line too long: %s\n", line);
@@ -222,31 +259,41 @@ void hal_fd_parse_custom_file_txt_line(size_t* fileBinSize, char* line) {
   *fileBinSize = newFileBinSize;
 }
 
-void hal_fd_convert_custom_file_txt(FILE* customFileTxt) {
-  size_t fileBinSize = 0;
-  char buffer[1024];
-  char* line;
+/**
+ * FNV-1a digest, identifies the FW patch a checkpoint belongs to and checks
+ * the compiled FW custom parameters read from their cache.
+ */
+static uint32_t hal_fd_digest(const uint8_t* data, size_t len) {
+  uint32_t h = 2166136261u;
 
-  line = fgets(buffer, sizeof(buffer), customFileTxt);
-  if (!line) {
-    STLOG_HAL_E("%s - FW config text file too short\n", __func__);
-    return;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ data[i]) * 16777619u;
   }
+  return h;
+}
 
-  unsigned int crc;
-  if (sscanf(line, "REM Script CRC is %4x", &crc) != 1) {
-    STLOG_HAL_E("%s - FW config CRC invalid\n", __func__);
-    return;
-  }
+/**
+ * Compile the text FW custom parameters script into mCustomFileBuffer.
+ * @param customFileTxt script, positioned after its "REM Script CRC" line
+ * @param crc script CRC, from its first line
+ *
+ * @return size of the compiled script, 0 on error
+ */
+static size_t hal_fd_convert_custom_file_txt(FILE* customFileTxt,
+                                             unsigned int crc) {
+  size_t fileBinSize = 0;
+  char buffer[1024];
+  char* line;
 
+  long start = ftell(customFileTxt);
   fseek(customFileTxt, 0, SEEK_END);
   size_t fileBinMaxSize = ftell(customFileTxt);
-  fseek(customFileTxt, 0, SEEK_SET);
+  fseek(customFileTxt, start, SEEK_SET);
 
   mCustomFileBuffer = (char*)calloc(fileBinMaxSize, sizeof(*mCustomFileBuffer));
   if (!mCustomFileBuffer) {
     STLOG_HAL_E("%s - Failed to allocate FW config binary\n", __func__);
-    return;
+    return 0;
   }
 
   mCustomFileBuffer[fileBinSize++] = (crc >> 8) & 0xff;
@@ -256,18 +303,401 @@ void hal_fd_convert_custom_file_txt(FILE* customFileTxt) {
     hal_fd_parse_custom_file_txt_line(&fileBinSize, line);
   }
 
-  mCustomFileBin = fmemopen(mCustomFileBuffer, fileBinSize, "r");
+  return fileBinSize;
+}
+
+/**
+ * Name of the file caching the compiled form of a FW custom parameters
+ * script. The script itself lives in a read-only partition.
+ * @param ConfPath script
+ * @param cachePath returns the cache file name
+ * @param len size of cachePath
+ *
+ * @return false if the name does not fit in cachePath
+ */
+static bool hal_fd_custom_cache_path(const char* ConfPath, char* cachePath,
+                                     size_t len) {
+  const char* name = strrchr(ConfPath, '/');
+
+  name = (name != NULL) ? name + 1 : ConfPath;
+  return (size_t)snprintf(cachePath, len, "%s%s.cache", FW_CUSTOM_CACHE_PATH,
+                          name) < len;
+}
+
+/**
+ * Load the compiled form of a FW custom parameters script, if the cache
+ * was built from the same version of the script.
+ * @param cachePath cache file
+ * @param key identifies the script version
+ *
+ * @return size of the compiled script loaded in mCustomFileBuffer, 0 if
+ * the cache is missing or out of date
+ */
+static size_t hal_fd_load_custom_cache(const char* cachePath,
+                                       const FWCustomCacheHeader* key) {
+  FWCustomCacheHeader hdr;
+  struct stat cache_stat;
+  char* buffer;
+  int fd;
+
+  if ((fd = open(cachePath, O_RDONLY | O_CLOEXEC)) < 0) return 0;
+  if ((fstat(fd, &cache_stat) != 0) ||
+      (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) ||
+      (hdr.magic != key->magic) || (hdr.crc != key->crc) ||
+      (hdr.sourceSize != key->sourceSize) ||
+      (hdr.sourceMtimeSec != key->sourceMtimeSec) ||
+      (hdr.sourceMtimeNsec != key->sourceMtimeNsec) || (hdr.binSize < 2) ||
+      ((uint64_t)cache_stat.st_size != sizeof(hdr) + hdr.binSize) ||
+      ((buffer = (char*)malloc(hdr.binSize)) == NULL)) {
+    close(fd);
+    return 0;
+  }
+  if ((read(fd, buffer, hdr.binSize) != (ssize_t)hdr.binSize) ||
+      (hal_fd_digest((uint8_t*)buffer, hdr.binSize) != hdr.binDigest)) {
+    STLOG_HAL_W("%s - %s is corrupted", __func__, cachePath);
+    close(fd);
+    free(buffer);
+    return 0;
+  }
+  close(fd);
+  mCustomFileBuffer = buffer;
+  return hdr.binSize;
+}
+
+/**
+ * Store the compiled form of a FW custom parameters script, replaced
+ * atomically so a reader never sees a partial file.
+ * @param cachePath cache file
+ * @param key identifies the script version
+ * @param binSize size of the compiled script in mCustomFileBuffer
+ */
+static void hal_fd_save_custom_cache(const char* cachePath,
+                                     const FWCustomCacheHeader* key,
+                                     size_t binSize) {
+  FWCustomCacheHeader hdr = *key;
+  char tmpPath[PATH_MAX];
+  bool ok;
+  int fd;
+
+  hdr.binSize = binSize;
+  hdr.binDigest = hal_fd_digest((uint8_t*)mCustomFileBuffer, binSize);
+  if ((size_t)snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", cachePath) >=
+      sizeof(tmpPath)) {
+    return;
+  }
+  fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    STLOG_HAL_D("%s - cannot create %s (%d)", __func__, tmpPath, errno);
+    return;
+  }
+  ok = write(fd, &hdr, sizeof(hdr)) == (ssize_t)sizeof(hdr);
+  ok = ok && write(fd, mCustomFileBuffer, binSize) == (ssize_t)binSize;
+  ok = (close(fd) == 0) && ok;
+  if (!ok || rename(tmpPath, cachePath) != 0) {
+    STLOG_HAL_W("%s - cannot write %s (%d)", __func__, cachePath, errno);
+    unlink(tmpPath);
+  }
 }
 
+/**
+ * Compile the FW custom parameters script, if ConfPath is a text script,
+ * into mCustomFileBin. The compiled form is cached and the script is only
+ * parsed again when it changes.
+ * @param ConfPath FW custom parameters file
+ */
 void hal_fd_convert_custom_file_path(char* ConfPath) {
+  FWCustomCacheHeader key;
+  struct stat file_stat;
+  char cachePath[PATH_MAX];
+  char buffer[1024];
+  unsigned int crc;
+  size_t fileBinSize;
+  bool cached;
+
   FILE* customFileTxt = fopen((char*)ConfPath, "r");
   if (!customFileTxt) {
     return;
   }
 
-  hal_fd_convert_custom_file_txt(customFileTxt);
+  if (!fgets(buffer, sizeof(buffer), customFileTxt)) {
+    STLOG_HAL_E("%s - FW config text file too short\n", __func__);
+    fclose(customFileTxt);
+    return;
+  }
+  if (sscanf(buffer, "REM Script CRC is %4x", &crc) != 1) {
+    STLOG_HAL_E("%s - FW config CRC invalid\n", __func__);
+    fclose(customFileTxt);
+    return;
+  }
 
+  memset(&key, 0, sizeof(key));
+  key.magic = FW_CUSTOM_CACHE_MAGIC;
+  key.crc = crc;
+  if (fstat(fileno(customFileTxt), &file_stat) == 0) {
+    key.sourceSize = file_stat.st_size;
+    key.sourceMtimeSec = file_stat.st_mtim.tv_sec;
+    key.sourceMtimeNsec = file_stat.st_mtim.tv_nsec;
+  }
+  cached = hal_fd_custom_cache_path(ConfPath, cachePath, sizeof(cachePath));
+
+  if (cached && (fileBinSize = hal_fd_load_custom_cache(cachePath, &key))) {
+    STLOG_HAL_D("%s - compiled FW config loaded from %s", __func__,
+                cachePath);
+  } else if ((fileBinSize = hal_fd_convert_custom_file_txt(customFileTxt,
+                                                           crc)) != 0) {
+    if (cached) hal_fd_save_custom_cache(cachePath, &key, fileBinSize);
+  }
   fclose(customFileTxt);
+
+  if (fileBinSize != 0) {
+    mCustomFileBin = fmemopen(mCustomFileBuffer, fileBinSize, "r");
+  }
+}
+
+/**
+ * Map the FW patch file.
+ * @param path FW patch file
+ *
+ * @return true if the file is mapped in mFwImage
+ */
+static bool hal_fd_map_fw_image(const char* path) {
+  struct stat file_stat;
+  void* image;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) return false;
+  if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+    close(fd);
+    return false;
+  }
+  image = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED) {
+    STLOG_HAL_E("%s - cannot map %s (%d)", __func__, path, errno);
+    return false;
+  }
+  mFwImage = (const uint8_t*)image;
+  mFwImageSize = file_stat.st_size;
+  return true;
+}
+
+/**
+ * Release the FW patch file and its APDU index.
+ */
+static void hal_fd_unmap_fw_image() {
+  if (mFwImage != NULL) {
+    munmap((void*)mFwImage, mFwImageSize);
+    mFwImage = NULL;
+    mFwImageSize = 0;
+  }
+  free(mFwApdus);
+  mFwApdus = NULL;
+  mFwApduCount = 0;
+}
+
+/**
+ * Index the raw APDUs of the FW patch: each is a 3 bytes NCI header followed
+ * by the payload length given in the header.
+ * @param start offset of the first raw APDU in the FW patch file
+ *
+ * @return number of raw APDUs found
+ */
+static size_t hal_fd_index_fw_image(size_t start) {
+  size_t count = 0;
+  size_t offset;
+
+  for (offset = start; offset + 3 <= mFwImageSize;
+       offset += 3 + mFwImage[offset + 2]) {
+    if (offset + 3 + mFwImage[offset + 2] > mFwImageSize) break;
+    count++;
+  }
+  if (offset != mFwImageSize) {
+    STLOG_HAL_E("%s - FW patch truncated at offset %zu, %zu APDUs kept",
+                __func__, offset, count);
+  }
+  if (count == 0) return 0;
+
+  mFwApdus = (FWApdu*)malloc(count * sizeof(FWApdu));
+  if (mFwApdus == NULL) return 0;
+  offset = start;
+  for (size_t i = 0; i < count; i++) {
+    mFwApdus[i].offset = offset;
+    mFwApdus[i].length = 3 + mFwImage[offset + 2];
+    offset += mFwApdus[i].length;
+  }
+  mFwApduCount = count;
+  return count;
+}
+
+/**
+ * Time elapsed since a CLOCK_MONOTONIC timestamp, in microseconds.
+ */
+static uint64_t hal_fd_elapsed_us(const struct timespec* from) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)(now.tv_sec - from->tv_sec) * 1000000 +
+         (now.tv_nsec - from->tv_nsec) / 1000;
+}
+
+/**
+ * Reset the FW download statistics, called when the erase command preceding
+ * the raw APDUs is sent.
+ */
+static void hal_fd_dl_stats_start() {
+  memset(&sFwDlStats, 0, sizeof(sFwDlStats));
+  sFwDlStats.rttMinUs = UINT32_MAX;
+  clock_gettime(CLOCK_MONOTONIC, &sFwDlStats.start);
+}
+
+/**
+ * Drop the FW download checkpoint, next download starts with an erase.
+ */
+static void hal_fd_checkpoint_clear() {
+  if (sFwCheckpointFd >= 0) {
+    close(sFwCheckpointFd);
+    sFwCheckpointFd = -1;
+  }
+  if (unlink(FW_CHECKPOINT_PATH) != 0 && errno != ENOENT) {
+    STLOG_HAL_E("%s - cannot remove checkpoint (%d)", __func__, errno);
+  }
+  sFwResumed = false;
+}
+
+/**
+ * Look for a checkpoint left by an interrupted download of the same FW patch.
+ *
+ * @return index of the raw APDU to resume from, 0 to download the whole patch
+ */
+static size_t hal_fd_checkpoint_load() {
+  FWCheckpoint cp;
+  ssize_t ret;
+  int fd;
+
+  sFwResumed = false;
+  if (!sFwResumeEnabled) return 0;
+  if ((fd = open(FW_CHECKPOINT_PATH, O_RDONLY | O_CLOEXEC)) < 0) return 0;
+  ret = read(fd, &cp, sizeof(cp));
+  close(fd);
+
+  if ((ret != sizeof(cp)) || (cp.magic != FW_CHECKPOINT_MAGIC) ||
+      (cp.fwVersion != mFWInfo->fileFwVersion) ||
+      (cp.imageSize != mFwImageSize) || (cp.apduCount != mFwApduCount) ||
+      (cp.apduAcked == 0) || (cp.apduAcked >= mFwApduCount) ||
+      (cp.imageDigest != sFwImageDigest)) {
+    STLOG_HAL_D("%s - no checkpoint for this FW patch", __func__);
+    hal_fd_checkpoint_clear();
+    return 0;
+  }
+  STLOG_HAL_D("%s - resume FW download at APDU %u/%u", __func__, cp.apduAcked,
+              cp.apduCount);
+  HAL_EVENT_LOG() << __func__ << " resume FW download at APDU "
+                  << cp.apduAcked << "/" << cp.apduCount << std::endl;
+  sFwResumed = true;
+  return cp.apduAcked;
+}
+
+/**
+ * Record the number of raw APDUs acknowledged so far, every
+ * FW_CHECKPOINT_INTERVAL APDUs.
+ * @param acked number of raw APDUs acknowledged by the loader
+ */
+static void hal_fd_checkpoint_save(size_t acked) {
+  FWCheckpoint cp;
+
+  if (!sFwResumeEnabled || (acked % FW_CHECKPOINT_INTERVAL) != 0 ||
+      acked >= mFwApduCount) {
+    return;
+  }
+  if (sFwCheckpointFd < 0) {
+    sFwCheckpointFd = open(FW_CHECKPOINT_PATH,
+                           O_WRONLY | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (sFwCheckpointFd < 0) {
+      STLOG_HAL_E("%s - cannot create checkpoint (%d)", __func__, errno);
+      sFwResumeEnabled = false;
+      return;
+    }
+  }
+  cp.magic = FW_CHECKPOINT_MAGIC;
+  cp.fwVersion = mFWInfo->fileFwVersion;
+  cp.imageSize = mFwImageSize;
+  cp.imageDigest = sFwImageDigest;
+  cp.apduCount = mFwApduCount;
+  cp.apduAcked = acked;
+  if ((pwrite(sFwCheckpointFd, &cp, sizeof(cp), 0) != sizeof(cp)) ||
+      (fdatasync(sFwCheckpointFd) != 0)) {
+    STLOG_HAL_E("%s - cannot write checkpoint (%d)", __func__, errno);
+  }
+}
+
+/**
+ * Account for the response to the raw APDU in flight, if any.
+ * @param acked true if the loader acknowledged the APDU, false if it is
+ * about to be sent again
+ */
+static void hal_fd_fw_apdu_rsp(bool acked) {
+  uint32_t rtt;
+
+  if (!sFwDlStats.pending) return;  // response to the erase command
+  sFwDlStats.pending = false;
+  rtt = (uint32_t)hal_fd_elapsed_us(&sFwDlStats.sent);
+  sFwDlStats.rttSumUs += rtt;
+  if (rtt < sFwDlStats.rttMinUs) sFwDlStats.rttMinUs = rtt;
+  if (rtt > sFwDlStats.rttMaxUs) sFwDlStats.rttMaxUs = rtt;
+  if (acked) {
+    sFwDlStats.apdus++;
+    sFwDlStats.bytes += mFwApdus[mFwApduLast].length;
+    hal_fd_checkpoint_save(mFwApduNext);
+  } else {
+    sFwDlStats.retries++;
+  }
+}
+
+/**
+ * Report total flash time, throughput and APDU round trip times.
+ */
+static void hal_fd_dl_stats_report() {
+  uint64_t total = hal_fd_elapsed_us(&sFwDlStats.start);
+  // round trips of the retried APDUs count too
+  uint32_t rtts = sFwDlStats.apdus + sFwDlStats.retries;
+  uint32_t n = rtts ? rtts : 1;
+  uint32_t kbps = total ? (uint32_t)(sFwDlStats.bytes * 1000 / total) : 0;
+
+  STLOG_HAL_D(
+      "%s - %u APDUs (%llu bytes) in %llu ms, %u kB/s, RTT avg %llu us "
+      "min %u us max %u us, %u retries",
+      __func__, sFwDlStats.apdus, (unsigned long long)sFwDlStats.bytes,
+      (unsigned long long)(total / 1000), kbps,
+      (unsigned long long)(sFwDlStats.rttSumUs / n),
+      rtts ? sFwDlStats.rttMinUs : 0, sFwDlStats.rttMaxUs,
+      sFwDlStats.retries);
+  HAL_EVENT_LOG() << __func__ << " FW download: " << sFwDlStats.apdus
+                  << " APDUs, " << sFwDlStats.bytes << " bytes, "
+                  << total / 1000 << " ms, " << kbps << " kB/s, RTT avg "
+                  << sFwDlStats.rttSumUs / n << " us max "
+                  << sFwDlStats.rttMaxUs << " us, " << sFwDlStats.retries
+                  << " retries" << std::endl;
+}
+
+/**
+ * Send a raw APDU of the FW patch.
+ * @param mHalHandle HAL handle
+ * @param index position of the raw APDU in the FW patch
+ *
+ * @return false if there is no such APDU, i.e. end of FW patch
+ */
+static bool hal_fd_send_fw_apdu(HALHANDLE mHalHandle, size_t index) {
+  if (index >= mFwApduCount) return false;
+
+  mFwApduLast = index;
+  mFwApduNext = index + 1;
+  sFwDlStats.pending = true;
+  clock_gettime(CLOCK_MONOTONIC, &sFwDlStats.sent);
+  if (!HalSendDownstreamTimer(mHalHandle, mFwImage + mFwApdus[index].offset,
+                              mFwApdus[index].length, FW_TIMER_DURATION)) {
+    STLOG_HAL_E("%s - SendDownstream failed", __func__);
+  }
+  return true;
 }
 
 /**
@@ -290,7 +720,7 @@ int hal_fd_init() {
   char ConfPath[256];
   char fwBinName[256];
   char fwConfName[256];
-  int ret;
+  unsigned long num = 0;
 
   STLOG_HAL_D("  %s - enter", __func__);
 
@@ -381,65 +811,70 @@ int hal_fd_init() {
 
   memset(mFWCap, 0, sizeof(FWCap));
 
-  mFwFileBin = NULL;
+  mFwImage = NULL;
+  mFwApdus = NULL;
+  mFwApduCount = 0;
+  mFwApduNext = mFwApduLast = 0;
+  sFwResumeEnabled =
+      GetNumValue(NAME_STNFC_FW_RESUME, &num, sizeof(num)) && (num == 1);
   mCustomFileBin = NULL;
   mCustomFileBuffer = NULL;
 
   // Check if FW patch binary file is present
   // If not, get recovery FW patch file
-  if ((mFwFileBin = fopen((char*)FwPath, "r")) == NULL) {
+  if (!hal_fd_map_fw_image(FwPath)) {
     STLOG_HAL_D("%s - %s not detected", __func__, fwBinName);
   } else {
     STLOG_HAL_D("%s - %s file detected\n", __func__, fwBinName);
     result |= FW_PATCH_AVAILABLE;
+    size_t apduStart = 4;
 
-    ret = fread(mBinData, sizeof(uint8_t), 4, mFwFileBin);
-    if (ret != 4) {
-      STLOG_HAL_E("%s did not read 4 bytes \n", __func__);
-    }
-    mFWInfo->fileFwVersion =
-        mBinData[0] << 24 | mBinData[1] << 16 | mBinData[2] << 8 | mBinData[3];
-
-    fgetpos(mFwFileBin, &mPosInit);
-    ret = fread(mBinData, sizeof(uint8_t), 5, mFwFileBin);
-    if (ret != 5) {
-      STLOG_HAL_E("%s did not read 5 bytes \n", __func__);
-    }
-    fsetpos(mFwFileBin, &mPosInit);  // reset pos in stream
-
-    if (mBinData[4] == 0x35) {
-      mFWInfo->fileHwVersion = HW_ST54L;
+    if (mFwImageSize < 4 + 5) {
+      STLOG_HAL_E("%s did not read 9 bytes \n", __func__);
     } else {
-      ret = fread(mApduAuthent, sizeof(uint8_t), 24, mFwFileBin);
-      if (ret != 24) {
-        STLOG_HAL_E("%s Wrong read nb \n", __func__);
-      }
+      mFWInfo->fileFwVersion = mFwImage[0] << 24 | mFwImage[1] << 16 |
+                               mFwImage[2] << 8 | mFwImage[3];
 
-      // We use the last byte of the auth command to discriminate at the moment.
-      // it can be extended in case of conflict later.
-      switch (mApduAuthent[23]) {
-        case 0x43:
-        case 0xC7:
-          mFWInfo->fileHwVersion = HW_NFCD;
-          break;
-
-        case 0xE9:
-          mFWInfo->fileHwVersion = HW_ST54J;
-          break;
+      if (mFwImage[4 + 4] == 0x35) {
+        mFWInfo->fileHwVersion = HW_ST54L;
+      } else if (mFwImageSize < 4 + sizeof(mApduAuthent)) {
+        STLOG_HAL_E("%s Wrong read nb \n", __func__);
+      } else {
+        memcpy(mApduAuthent, mFwImage + 4, sizeof(mApduAuthent));
+        apduStart += sizeof(mApduAuthent);
+
+        // We use the last byte of the auth command to discriminate at the
+        // moment. it can be extended in case of conflict later.
+        switch (mApduAuthent[23]) {
+          case 0x43:
+          case 0xC7:
+            mFWInfo->fileHwVersion = HW_NFCD;
+            break;
+
+          case 0xE9:
+            mFWInfo->fileHwVersion = HW_ST54J;
+            break;
+        }
       }
     }
 
     if (mFWInfo->fileHwVersion == 0) {
       STLOG_HAL_E("%s --> %s integrates unknown patch NFC FW -- rejected\n",
                   __func__, FwPath);
-      fclose(mFwFileBin);
-      mFwFileBin = NULL;
+      hal_fd_unmap_fw_image();
+    } else if (hal_fd_index_fw_image(apduStart) == 0) {
+      STLOG_HAL_E("%s --> %s contains no APDU -- rejected\n", __func__,
+                  FwPath);
+      hal_fd_unmap_fw_image();
     } else {
-      fgetpos(mFwFileBin, &mPosInit);
-
-      STLOG_HAL_D("%s --> %s integrates patch NFC FW version 0x%08X (r:%d)\n",
-                  __func__, FwPath, mFWInfo->fileFwVersion,
-                  mFWInfo->fileHwVersion);
+      STLOG_HAL_D(
+          "%s --> %s integrates patch NFC FW version 0x%08X (r:%d), %zu "
+          "APDUs\n",
+          __func__, FwPath, mFWInfo->fileFwVersion, mFWInfo->fileHwVersion,
+          mFwApduCount);
+      if (sFwResumeEnabled) {
+        sFwImageDigest = hal_fd_digest(mFwImage, mFwImageSize);
+      }
     }
   }
 
@@ -471,9 +906,10 @@ void hal_fd_close() {
     free(mFWInfo);
     mFWInfo = NULL;
   }
-  if (mFwFileBin != NULL) {
-    fclose(mFwFileBin);
-    mFwFileBin = NULL;
+  hal_fd_unmap_fw_image();
+  if (sFwCheckpointFd >= 0) {
+    close(sFwCheckpointFd);  // kept, to resume the download on next open
+    sFwCheckpointFd = -1;
   }
   if (mCustomFileBin != NULL) {
     fclose(mCustomFileBin);
@@ -485,6 +921,20 @@ void hal_fd_close() {
   }
 }
 
+/**
+ * Prepare for a warm reset of the CLF: the FW image and custom parameters
+ * loaded by hal_fd_init() are kept, only the update state is reset and the
+ * custom parameters rewound after their version.
+ */
+void hal_fd_power_cycle() {
+  STLOG_HAL_D("  %s -enter", __func__);
+  mCustomParamFailed = false;
+  resetHandlerState();
+  if (mCustomFileBin != NULL) {
+    fseek(mCustomFileBin, 2, SEEK_SET);
+  }
+}
+
 FWInfo* hal_fd_getFwInfo() {
   STLOG_HAL_D("  %s -enter", __func__);
   return mFWInfo;
@@ -593,7 +1043,7 @@ uint8_t ft_cmd_HwReset(uint8_t* pdata, uint8_t* clf_mode) {
 
   if ((mFWInfo->chipHwVersion == HW_ST54J) ||
       (mFWInfo->chipHwVersion == HW_ST54L)) {
-    if ((mFwFileBin != NULL) &&
+    if ((mFwApduCount != 0) &&
         (mFWInfo->fileFwVersion != mFWInfo->chipFwVersion)) {
       STLOG_HAL_D("---> Firmware update needed from 0x%08X to 0x%08X\n",
                   mFWInfo->chipFwVersion, mFWInfo->fileFwVersion);
@@ -601,6 +1051,7 @@ uint8_t ft_cmd_HwReset(uint8_t* pdata, uint8_t* clf_mode) {
       result |= FW_UPDATE_NEEDED;
     } else {
       STLOG_HAL_D("---> No Firmware update needed\n");
+      if (sFwResumeEnabled) hal_fd_checkpoint_clear();  // stale, if any
     }
 
     if ((mFWInfo->fileCustVersion != 0) &&
@@ -667,7 +1118,7 @@ void ExitHibernateHandler(HALHANDLE mHalHandle, uint16_t data_len,
             "%s - send NCI_PROP_NFC_FW_UPDATE_CMD and use 100 ms timer for "
             "each cmd from here",
             __func__);
-        HalEventLogger::getInstance().log()
+        HAL_EVENT_LOG()
             << __func__
             << " send NCI_PROP_NFC_FW_UPDATE_CMD and use 100 ms timer for "
                "each cmd from here "
@@ -792,7 +1243,7 @@ void UpdateHandler(HALHANDLE mHalHandle, uint16_t data_len, uint8_t* p_data) {
 
       if ((p_data[data_len - 2] == 0x90) && (p_data[data_len - 1] == 0x00)) {
         STLOG_HAL_D("%s - send APDU_AUTHENTICATION_CMD", __func__);
-        HalEventLogger::getInstance().log()
+        HAL_EVENT_LOG()
             << __func__ << " send APDU_AUTHENTICATION_CMD " << std::endl;
         if (!HalSendDownstreamTimer(mHalHandle, (uint8_t*)mApduAuthent,
                                     sizeof(mApduAuthent), FW_TIMER_DURATION)) {
@@ -810,20 +1261,28 @@ void UpdateHandler(HALHANDLE mHalHandle, uint16_t data_len, uint8_t* p_data) {
 
       if ((p_data[0] == 0x4f) && (p_data[1] == 0x04)) {
         if ((p_data[data_len - 2] == 0x90) && (p_data[data_len - 1] == 0x00)) {
-          STLOG_HAL_D(
-              " %s - send APDU_ERASE_FLASH_CMD (keep appli and NDEF areas)",
-              __func__);
-          HalEventLogger::getInstance().log()
-              << __func__
-              << " send APDU_ERASE_FLASH_CMD (keep appli and NDEF areas "
-              << std::endl;
-          if (!HalSendDownstreamTimer(mHalHandle, ApduEraseNfcKeepAppliAndNdef,
-                                      sizeof(ApduEraseNfcKeepAppliAndNdef),
-                                      FW_TIMER_DURATION)) {
-            STLOG_HAL_E("%s - SendDownstream failed", __func__);
-          }
+          size_t first = hal_fd_checkpoint_load();
 
-          fsetpos(mFwFileBin, &mPosInit);  // reset pos in stream
+          hal_fd_dl_stats_start();
+          if (first != 0) {
+            // Flash not erased, continue where the interrupted download was
+            hal_fd_send_fw_apdu(mHalHandle, first);
+          } else {
+            STLOG_HAL_D(
+                " %s - send APDU_ERASE_FLASH_CMD (keep appli and NDEF areas)",
+                __func__);
+            HAL_EVENT_LOG()
+                << __func__
+                << " send APDU_ERASE_FLASH_CMD (keep appli and NDEF areas "
+                << std::endl;
+            if (!HalSendDownstreamTimer(
+                    mHalHandle, ApduEraseNfcKeepAppliAndNdef,
+                    sizeof(ApduEraseNfcKeepAppliAndNdef), FW_TIMER_DURATION)) {
+              STLOG_HAL_E("%s - SendDownstream failed", __func__);
+            }
+
+            mFwApduNext = mFwApduLast = 0;  // restart from the first APDU
+          }
 
           mHalFDState = HAL_FD_STATE_SEND_RAW_APDU;
 
@@ -839,41 +1298,34 @@ void UpdateHandler(HALHANDLE mHalHandle, uint16_t data_len, uint8_t* p_data) {
       if ((p_data[0] == 0x4f) && (p_data[1] == 0x04)) {
         if ((p_data[data_len - 2] == 0x90) && (p_data[data_len - 1] == 0x00)) {
           mRetry = true;
+          hal_fd_fw_apdu_rsp(true);
 
-          fgetpos(mFwFileBin, &mPos);  // save current position in stream
-          if ((fread(mBinData, sizeof(uint8_t), 3, mFwFileBin) == 3) &&
-              (fread(mBinData + 3, sizeof(uint8_t), mBinData[2], mFwFileBin) ==
-               mBinData[2])) {
-            HalEventLogger::getInstance().log()
+          if (hal_fd_send_fw_apdu(mHalHandle, mFwApduNext)) {
+            HAL_EVENT_LOG()
                 << __func__ << "  LINE: " << __LINE__ << std::endl;
-            if (!HalSendDownstreamTimer(mHalHandle, mBinData, mBinData[2] + 3,
-                                        FW_TIMER_DURATION)) {
-              STLOG_HAL_E("%s - SendDownstream failed", __func__);
-            }
           } else {
             STLOG_HAL_D("%s - EOF of FW binary", __func__);
+            hal_fd_dl_stats_report();
+            hal_fd_checkpoint_clear();
             SendExitLoadMode(mHalHandle);
           }
         } else if (mRetry == true) {
           STLOG_HAL_D("%s - Last Tx was NOK. Retry", __func__);
           mRetry = false;
-          fsetpos(mFwFileBin, &mPos);
-          if ((fread(mBinData, sizeof(uint8_t), 3, mFwFileBin) == 3) &&
-              (fread(mBinData + 3, sizeof(uint8_t), mBinData[2], mFwFileBin) ==
-               mBinData[2])) {
-            HalEventLogger::getInstance().log()
+          hal_fd_fw_apdu_rsp(false);
+          if (hal_fd_send_fw_apdu(mHalHandle, mFwApduLast)) {
+            HAL_EVENT_LOG()
                 << __func__ << " Last Tx was NOK. Retry " << std::endl;
-            if (!HalSendDownstreamTimer(mHalHandle, mBinData, mBinData[2] + 3,
-                                        FW_TIMER_DURATION)) {
-              STLOG_HAL_E("%s - SendDownstream failed", __func__);
-            }
-            fgetpos(mFwFileBin, &mPos);  // save current position in stream
           } else {
             STLOG_HAL_D("%s - EOF of FW binary", __func__);
             SendExitLoadMode(mHalHandle);
           }
         } else {
           STLOG_HAL_D("%s - FW flash not succeeded.", __func__);
+          if (sFwResumed) {
+            // the loader refused to continue, erase on the next attempt
+            hal_fd_checkpoint_clear();
+          }
           I2cResetPulse();
           SendExitLoadMode(mHalHandle);
         }
@@ -920,7 +1372,7 @@ static void UpdateHandlerST54L(HALHANDLE mHalHandle, uint16_t data_len,
 
   switch (mHalFD54LState) {
     case HAL_FD_ST54L_STATE_PUY_KEYUSER:
-      HalEventLogger::getInstance().log()
+      HAL_EVENT_LOG()
           << __func__ << " mHalFD54LState: " << HAL_FD_ST54L_STATE_PUY_KEYUSER
           << std::endl;
       if (!HalSendDownstreamTimer(
@@ -934,7 +1386,7 @@ static void UpdateHandlerST54L(HALHANDLE mHalHandle, uint16_t data_len,
 
     case HAL_FD_ST54L_STATE_ERASE_UPGRADE_START:
       if ((p_data[data_len - 2] == 0x90) && (p_data[data_len - 1] == 0x00)) {
-        HalEventLogger::getInstance().log()
+        HAL_EVENT_LOG()
             << __func__
             << " mHalFD54LState: " << HAL_FD_ST54L_STATE_ERASE_UPGRADE_START
             << std::endl;
@@ -952,7 +1404,19 @@ static void UpdateHandlerST54L(HALHANDLE mHalHandle, uint16_t data_len,
 
     case HAL_FD_ST54L_STATE_ERASE_NFC_AREA:
       if ((p_data[data_len - 2] == 0x90) && (p_data[data_len - 1] == 0x00)) {
-        HalEventLogger::getInstance().log()
+        mFwApduNext = mFwApduLast = hal_fd_checkpoint_load();
+        if (mFwApduNext != 0) {
+          // Flash not erased, continue where the interrupted download was
+          if (!HalSendDownstreamTimer(
+                  mHalHandle, (uint8_t*)ApduEraseUpgradeStop,
+                  sizeof(ApduEraseUpgradeStop), FW_TIMER_DURATION)) {
+            STLOG_HAL_E("%s - SendDownstream failed", __func__);
+          }
+          hal_fd_dl_stats_start();
+          mHalFD54LState = HAL_FD_ST54L_STATE_SEND_RAW_APDU;
+          break;
+        }
+        HAL_EVENT_LOG()
             << __func__
             << " mHalFD54LState: " << HAL_FD_ST54L_STATE_ERASE_NFC_AREA
             << std::endl;
@@ -970,7 +1434,7 @@ static void UpdateHandlerST54L(HALHANDLE mHalHandle, uint16_t data_len,
 
     case HAL_FD_ST54L_STATE_ERASE_UPGRADE_STOP:
       if ((p_data[data_len - 2] == 0x90) && (p_data[data_len - 1] == 0x00)) {
-        HalEventLogger::getInstance().log()
+        HAL_EVENT_LOG()
             << __func__
             << " mHalFD54LState: " << HAL_FD_ST54L_STATE_ERASE_UPGRADE_STOP
             << std::endl;
@@ -979,6 +1443,8 @@ static void UpdateHandlerST54L(HALHANDLE mHalHandle, uint16_t data_len,
                                     FW_TIMER_DURATION)) {
           STLOG_HAL_E("%s - SendDownstream failed", __func__);
         }
+        mFwApduNext = mFwApduLast = 0;  // restart from the first APDU
+        hal_fd_dl_stats_start();
         mHalFD54LState = HAL_FD_ST54L_STATE_SEND_RAW_APDU;
       } else {
         STLOG_HAL_D("%s - FW flash not succeeded", __func__);
@@ -992,21 +1458,17 @@ static void UpdateHandlerST54L(HALHANDLE mHalHandle, uint16_t data_len,
       if ((p_data[0] == 0x4f) && (p_data[1] == 0x04)) {
         if ((p_data[data_len - 2] == 0x90) && (p_data[data_len - 1] == 0x00)) {
           mRetry = true;
+          hal_fd_fw_apdu_rsp(true);
 
-          fgetpos(mFwFileBin, &mPos);  // save current position in stream
-          if ((fread(mBinData, sizeof(uint8_t), 3, mFwFileBin) == 3) &&
-              (fread(mBinData + 3, sizeof(uint8_t), mBinData[2], mFwFileBin) ==
-               mBinData[2])) {
-            HalEventLogger::getInstance().log()
+          if (hal_fd_send_fw_apdu(mHalHandle, mFwApduNext)) {
+            HAL_EVENT_LOG()
                 << __func__ << "  LINE: " << __LINE__ << std::endl;
-            if (!HalSendDownstreamTimer(mHalHandle, mBinData, mBinData[2] + 3,
-                                        FW_TIMER_DURATION)) {
-              STLOG_HAL_E("%s - SendDownstream failed", __func__);
-            }
           } else {
             STLOG_HAL_D("%s - EOF of FW binary", __func__);
-            HalEventLogger::getInstance().log()
+            HAL_EVENT_LOG()
                 << __func__ << "  EOF of FW binary " << std::endl;
+            hal_fd_dl_stats_report();
+            hal_fd_checkpoint_clear();
             if (!HalSendDownstreamTimer(
                     mHalHandle, (uint8_t*)ApduSetVariousConfig,
                     sizeof(ApduSetVariousConfig), FW_TIMER_DURATION)) {
@@ -1017,20 +1479,13 @@ static void UpdateHandlerST54L(HALHANDLE mHalHandle, uint16_t data_len,
         } else if (mRetry == true) {
           STLOG_HAL_D("%s - Last Tx was NOK. Retry", __func__);
           mRetry = false;
-          fsetpos(mFwFileBin, &mPos);
-          if ((fread(mBinData, sizeof(uint8_t), 3, mFwFileBin) == 3) &&
-              (fread(mBinData + 3, sizeof(uint8_t), mBinData[2], mFwFileBin) ==
-               mBinData[2])) {
-            HalEventLogger::getInstance().log()
+          hal_fd_fw_apdu_rsp(false);
+          if (hal_fd_send_fw_apdu(mHalHandle, mFwApduLast)) {
+            HAL_EVENT_LOG()
                 << __func__ << "  Last Tx was NOK. Retry " << std::endl;
-            if (!HalSendDownstreamTimer(mHalHandle, mBinData, mBinData[2] + 3,
-                                        FW_TIMER_DURATION)) {
-              STLOG_HAL_E("%s - SendDownstream failed", __func__);
-            }
-            fgetpos(mFwFileBin, &mPos);  // save current position in stream
           } else {
             STLOG_HAL_D("%s - EOF of FW binary", __func__);
-            HalEventLogger::getInstance().log()
+            HAL_EVENT_LOG()
                 << __func__ << "  LINE: " << __LINE__ << std::endl;
             if (!HalSendDownstreamTimer(
                     mHalHandle, (uint8_t*)ApduSetVariousConfig,
@@ -1041,6 +1496,10 @@ static void UpdateHandlerST54L(HALHANDLE mHalHandle, uint16_t data_len,
           }
         } else {
           STLOG_HAL_D("%s - FW flash not succeeded.", __func__);
+          if (sFwResumed) {
+            // the loader refused to continue, erase on the next attempt
+            hal_fd_checkpoint_clear();
+          }
           I2cResetPulse();
           SendSwitchToUserMode(mHalHandle);
         }
@@ -1297,7 +1756,7 @@ void ApplyUwbParamHandler(HALHANDLE mHalHandle, uint16_t data_len,
 
 void SendExitLoadMode(HALHANDLE mmHalHandle) {
   STLOG_HAL_D("%s - Send APDU_EXIT_LOAD_MODE_CMD", __func__);
-  HalEventLogger::getInstance().log() << __func__ << std::endl;
+  HAL_EVENT_LOG() << __func__ << std::endl;
   if (!HalSendDownstreamTimer(mmHalHandle, ApduExitLoadMode,
                               sizeof(ApduExitLoadMode), FW_TIMER_DURATION)) {
     STLOG_HAL_E("%s - SendDownstream failed", __func__);
@@ -1307,7 +1766,7 @@ void SendExitLoadMode(HALHANDLE mmHalHandle) {
 
 void SendSwitchToUserMode(HALHANDLE mmHalHandle) {
   STLOG_HAL_D("%s: enter", __func__);
-  HalEventLogger::getInstance().log() << __func__ << std::endl;
+  HAL_EVENT_LOG() << __func__ << std::endl;
   if (!HalSendDownstreamTimer(mmHalHandle, ApduSwitchToUser,
                               sizeof(ApduSwitchToUser), FW_TIMER_DURATION)) {
     STLOG_HAL_E("%s - SendDownstream failed", __func__);
@@ -24,14 +24,17 @@
 #include <semaphore.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 
 #include "android_logmsg.h"
+#include "hal_config_cache.h"
 #include "hal_fd.h"
+#include "hal_thread.h"
 #include "halcore_private.h"
 #include "st21nfc_dev.h"
 
-extern int I2cWriteCmd(const uint8_t* x, size_t len);
+extern int I2cWriteCmd(char cmd, const uint8_t* data, size_t len);
 extern void DispHal(const char* title, const void* data, size_t length);
 
 extern uint32_t ScrProtocolTraceFlag;  // = SCR_PROTO_TRACE_ALL;
@@ -39,6 +42,67 @@ extern uint32_t ScrProtocolTraceFlag;  // = SCR_PROTO_TRACE_ALL;
 // HAL WRAPPER
 static void HalStopTimer(HalInstance* inst);
 static bool rf_deactivate_delay;
+static HalThread sHalThread;
+// The HAL thread, or the loop thread with HAL_FLAG_SINGLE_LOOP: the one
+// freeing the buffers, see HalSemTake()
+static thread_local bool sOnHalThread = false;
+
+/* TX scheduler stats, for dumpsys */
+typedef struct {
+  bool tracked;
+  uint8_t credits;
+  uint32_t sent;         // data packets sent
+  uint32_t held;         // data packets that waited for a credit
+  uint32_t dropped;      // queued when the connection closed
+  uint32_t returned;     // credits returned by CORE_CONN_CREDITS_NTF
+  uint32_t maxHeld;      // most packets queued at once
+  uint64_t maxWaitUs;    // longest time in the queue
+  uint8_t maxPayload;    // of the data packets, 0 if not negotiated
+} HalConnStats;
+
+typedef struct {
+  uint32_t sent;       // control messages sent
+  uint32_t urgent;     // RF_DEACTIVATE_CMD and presence checks
+  uint32_t waited;     // queued while a response was outstanding
+  uint32_t timeouts;   // responses given up after HAL_CMD_RSP_TIMEOUT
+  uint32_t unmatched;  // responses to no command or to another one
+  uint32_t flushed;    // dropped by HalFlushDownstream()
+  uint32_t noBuffer;   // not sent by the HAL thread, no buffer or slot left
+  uint64_t maxWaitUs;  // longest time in the queue
+} HalCmdStats;
+
+typedef struct {
+  uint32_t txMessages;  // data messages sent in more than one packet
+  uint32_t txPackets;   // packets of these messages
+  uint32_t rxMessages;  // messages reassembled
+  uint32_t rxPackets;   // segments of these messages
+  uint32_t rxDropped;   // messages too large or out of memory
+} HalSegStats;
+
+static pthread_mutex_t sTxStatsMutex = PTHREAD_MUTEX_INITIALIZER;
+static HalConnStats sConnStats[NCI_MAX_CONN];
+static HalCmdStats sCmdStats;
+static HalSegStats sSegStats;
+
+/* Histogram of durations, see HalRttBucket() */
+typedef struct {
+  uint32_t count;
+  uint64_t maxUs;
+  uint32_t buckets[HAL_RTT_BUCKETS];
+} HalRttHist;
+
+/* Response times of a command, and how long the wrapper waits after it,
+ * kept across HalCreate() to learn them */
+typedef struct {
+  uint32_t key;       // HalRttKey(), 0 if the slot is free
+  HalRttHist rsp;     // command sent to response
+  HalRttHist wait;    // wrapper timer started to HalSendDownstreamStopTimer()
+  uint32_t late;      // timer stopped after the timeout it would derive
+  uint32_t timeouts;  // wrapper timer expired
+} HalRttStats;
+
+static HalRttStats sRttStats[HAL_RTT_OPCODES];
+static uint32_t sBufferOverflows;  // CORE_GENERIC_ERROR_NTF 0xE1
 struct timespec start_tx_data;
 uint8_t NCI_ANDROID_GET_CAPS[] = {0x2f, 0x0c, 0x01, 0x0};
 uint8_t NCI_ANDROID_GET_CAPS_RSP[] = {
@@ -60,7 +124,9 @@ uint8_t NCI_ANDROID_GET_CAPS_RSP[] = {
  **************************************************************************************************/
 
 static void* HalWorkerThread(void* arg);
+static void HalHandleMessage(HalInstance* inst, ThreadMessage* msg);
 static inline int sem_wait_nointr(sem_t* sem);
+static bool HalSemTake(sem_t* sem);
 
 static void HalOnNewUpstreamFrame(HalInstance* inst, const uint8_t* data,
                                   size_t length);
@@ -69,7 +135,25 @@ static bool HalEnqueueThreadMessage(HalInstance* inst, ThreadMessage* msg);
 static bool HalDequeueThreadMessage(HalInstance* inst, ThreadMessage* msg);
 static HalBuffer* HalAllocBuffer(HalInstance* inst);
 static HalBuffer* HalFreeBuffer(HalInstance* inst, HalBuffer* b);
+static void HalTxEnqueue(HalInstance* inst, HalBuffer* b);
+static void HalTxRx(HalInstance* inst, const uint8_t* data, size_t length);
+static bool HalSendDataMessage(HalInstance* inst, const uint8_t* data,
+                               size_t size);
+static bool HalRxReassemble(HalInstance* inst, const uint8_t* data,
+                            size_t length);
+static void HalRxDiscard(HalRxMessage* m);
+static void HalTxTimeout(HalInstance* inst);
+static uint32_t HalRttKey(const uint8_t* data, size_t length);
+static uint32_t HalRttTimeout(HalInstance* inst, uint32_t key,
+                              uint32_t ceilingMs);
+static void HalRttTimerStopped(HalInstance* inst);
+static void HalRttResponse(HalInstance* inst, const uint8_t* data);
+static void HalRttTimerExpired(HalInstance* inst);
+static uint64_t HalRttPercentile(const HalRttHist* h, uint32_t permille);
+static bool HalTimerDue(HalInstance* inst, struct timespec* now);
 static uint32_t HalSemWait(sem_t* pSemaphore, uint32_t timeout);
+static uint32_t HalCalcSemWaitingTime(HalInstance* inst, struct timespec* now);
+static void Hal_event_handler(HalInstance* inst, HalEvent e);
 struct timespec HalGetTimestamp(void);
 int HalTimeDiffInMs(struct timespec start, struct timespec end);
 
@@ -93,7 +177,6 @@ int HalTimeDiffInMs(struct timespec start, struct timespec end);
 void HalCoreCallback(void* context, uint32_t event, const void* d,
                      size_t length) {
   const uint8_t* data = (const uint8_t*)d;
-  uint8_t cmd = 'W';
   int delta_time_ms;
 
   st21nfc_dev_t* dev = (st21nfc_dev_t*)context;
@@ -115,6 +198,7 @@ void HalCoreCallback(void* context, uint32_t event, const void* d,
         rf_deactivate_delay = false;
       }
       STLOG_HAL_V("!! got event HAL_EVENT_DSWRITE for %zu bytes\n", length);
+      hal_wrapper_frame_sent();
 
       DispHal("TX DATA", (data), length);
       if (length == 4 &&
@@ -137,17 +221,16 @@ void HalCoreCallback(void* context, uint32_t event, const void* d,
                           NCI_ANDROID_GET_CAPS_RSP);
       } else {
         // Send write command to IO thread
-        cmd = 'W';
-        I2cWriteCmd(&cmd, sizeof(cmd));
-        I2cWriteCmd((const uint8_t*)&length, sizeof(length));
-        I2cWriteCmd(data, length);
+        I2cWriteCmd('W', data, length);
       }
       break;
 
     case HAL_EVENT_DATAIND:
       STLOG_HAL_V("!! got event HAL_EVENT_DATAIND for %zu bytes\n", length);
 
-      if ((length >= 3) && (data[2] != (length - 3))) {
+      // a reassembled message may not fit the length byte
+      if ((length >= 3) && (length <= MAX_BUFFER_SIZE) &&
+          (data[2] != (length - 3))) {
         STLOG_HAL_W(
             "length is illogical. Header length is %d, packet length %zu\n",
             data[2], length);
@@ -170,8 +253,7 @@ void HalCoreCallback(void* context, uint32_t event, const void* d,
       dev->p_cback(HAL_NFC_ERROR_EVT, HAL_NFC_STATUS_ERR_CMD_TIMEOUT);
 
       // Write terminate command
-      cmd = 'X';
-      I2cWriteCmd(&cmd, sizeof(cmd));
+      I2cWriteCmd('X', NULL, 0);
       break;
 
     case HAL_EVENT_TIMER_TIMEOUT:
@@ -220,11 +302,32 @@ HALHANDLE HalCreate(void* context, HAL_CALLBACK callback, uint32_t flags) {
     return NULL;
   }
 
+  // Data packets waiting for a credit must not take all the buffers
+  if (0 != sem_init(&inst->dataBufferSem, 0, HAL_CREDIT_HOLD_MAX)) {
+    STLOG_HAL_E("!sem_init failed\n");
+    sem_destroy(&inst->semaphore);
+    sem_destroy(&inst->bufferResourceSem);
+    free(inst);
+    return NULL;
+  }
+
+  // Nor the segments of a data message all the ring slots
+  if (0 != sem_init(&inst->dataRingSem, 0, HAL_QUEUE_DATA_MAX)) {
+    STLOG_HAL_E("!sem_init failed\n");
+    sem_destroy(&inst->semaphore);
+    sem_destroy(&inst->bufferResourceSem);
+    sem_destroy(&inst->dataBufferSem);
+    free(inst);
+    return NULL;
+  }
+
   // We need a semaphore to block upstream data indications
   if (0 != sem_init(&inst->upstreamBlock, 0, 0)) {
     STLOG_HAL_E("!sem_init failed\n");
     sem_destroy(&inst->semaphore);
     sem_destroy(&inst->bufferResourceSem);
+    sem_destroy(&inst->dataBufferSem);
+    sem_destroy(&inst->dataRingSem);
     free(inst);
     return NULL;
   }
@@ -234,8 +337,13 @@ HALHANDLE HalCreate(void* context, HAL_CALLBACK callback, uint32_t flags) {
   inst->callback = callback;
   inst->flags = flags;
   inst->freeBufferList = 0;
-  inst->pendingNciList = 0;
   inst->nciBuffer = 0;
+  inst->rttFactor = 0;
+  GetNumValue(NAME_STNFC_ADAPTIVE_TIMEOUT, &inst->rttFactor,
+              sizeof(inst->rttFactor));
+  inst->rxReassembly = 0;
+  GetNumValue(NAME_STNFC_NCI_REASSEMBLY, &inst->rxReassembly,
+              sizeof(inst->rxReassembly));
   inst->ringReadPos = 0;
   inst->ringWritePos = 0;
   inst->timeout = HAL_SLEEP_TIMER_DURATION;
@@ -245,6 +353,8 @@ HALHANDLE HalCreate(void* context, HAL_CALLBACK callback, uint32_t flags) {
     STLOG_HAL_E("!failed to allocate memory\n");
     sem_destroy(&inst->semaphore);
     sem_destroy(&inst->bufferResourceSem);
+    sem_destroy(&inst->dataBufferSem);
+    sem_destroy(&inst->dataRingSem);
     sem_destroy(&inst->upstreamBlock);
     free(inst);
     return NULL;
@@ -262,17 +372,50 @@ HALHANDLE HalCreate(void* context, HAL_CALLBACK callback, uint32_t flags) {
     STLOG_HAL_E("!failed to initialize Mutex \n");
     sem_destroy(&inst->semaphore);
     sem_destroy(&inst->bufferResourceSem);
+    sem_destroy(&inst->dataBufferSem);
+    sem_destroy(&inst->dataRingSem);
     sem_destroy(&inst->upstreamBlock);
     free(inst->bufferData);
     free(inst);
     return NULL;
   }
 
+  (void)pthread_mutex_lock(&sTxStatsMutex);
+  memset(sConnStats, 0, sizeof(sConnStats));
+  memset(&sCmdStats, 0, sizeof(sCmdStats));
+  memset(&sSegStats, 0, sizeof(sSegStats));
+  sBufferOverflows = 0;
+  (void)pthread_mutex_unlock(&sTxStatsMutex);
+  HalConfigCacheSetup();
+
+  // Single loop: the caller runs HalProcessEvents() when eventFd is set
+  inst->singleLoop = (flags & HAL_FLAG_SINGLE_LOOP) != 0;
+  inst->eventFd = -1;
+  if (inst->singleLoop) {
+    inst->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (inst->eventFd < 0) {
+      STLOG_HAL_E("!failed to create eventfd \n");
+      sem_destroy(&inst->semaphore);
+      sem_destroy(&inst->bufferResourceSem);
+      sem_destroy(&inst->dataBufferSem);
+      sem_destroy(&inst->dataRingSem);
+      sem_destroy(&inst->upstreamBlock);
+      pthread_mutex_destroy(&inst->hMutex);
+      free(inst->bufferData);
+      free(inst);
+      return NULL;
+    }
+    STLOG_HAL_V("HalCreate exit, single loop\n");
+    return (HALHANDLE)inst;
+  }
+
   // Spawn the thread
   if (0 != pthread_create(&inst->thread, NULL, HalWorkerThread, inst)) {
     STLOG_HAL_E("!failed to spawn workerthread \n");
     sem_destroy(&inst->semaphore);
     sem_destroy(&inst->bufferResourceSem);
+    sem_destroy(&inst->dataBufferSem);
+    sem_destroy(&inst->dataRingSem);
     sem_destroy(&inst->upstreamBlock);
     pthread_mutex_destroy(&inst->hMutex);
     free(inst->bufferData);
@@ -292,24 +435,36 @@ HALHANDLE HalCreate(void* context, HAL_CALLBACK callback, uint32_t flags) {
  */
 void HalDestroy(HALHANDLE hHAL) {
   HalInstance* inst = (HalInstance*)hHAL;
-  // Tell the thread that we want to finish
-  ThreadMessage msg;
-  msg.command = MSG_EXIT_REQUEST;
-  msg.payload = 0;
-  msg.length = 0;
 
-  HalEnqueueThreadMessage(inst, &msg);
+  if (inst->singleLoop) {
+    // Called from the loop itself, nothing runs any more
+    close(inst->eventFd);
+    HalThreadExit(&sHalThread);
+  } else {
+    // Tell the thread that we want to finish
+    ThreadMessage msg;
+    msg.command = MSG_EXIT_REQUEST;
+    msg.payload = 0;
+    msg.length = 0;
+
+    HalEnqueueThreadMessage(inst, &msg);
 
-  // Wait for thread to finish
-  pthread_join(inst->thread, NULL);
+    // Wait for thread to finish
+    pthread_join(inst->thread, NULL);
+  }
 
   // Cleanup and exit
   sem_destroy(&inst->semaphore);
   sem_destroy(&inst->upstreamBlock);
   sem_destroy(&inst->bufferResourceSem);
+  sem_destroy(&inst->dataBufferSem);
+  sem_destroy(&inst->dataRingSem);
   pthread_mutex_destroy(&inst->hMutex);
 
   // Free resources
+  for (int i = 0; i < NCI_MAX_CONN; i++) {
+    HalRxDiscard(&inst->conn[i].rx);
+  }
   free(inst->bufferData);
   free(inst);
 
@@ -319,7 +474,7 @@ void HalDestroy(HALHANDLE hHAL) {
 /**
  * Send an NCI message downstream to HAL protocol layer (DH->NFCC transfer).
  * Block if more than NUM_BUFFERS (10) transfers are outstanding, otherwise will
- * return immediately.
+ * return immediately. On the HAL thread, fail instead of blocking.
  * @param hHAL HAL handle
  * @param data Data message
  * @param size Message size
@@ -332,7 +487,10 @@ bool HalSendDownstream(HALHANDLE hHAL, const uint8_t* data, size_t size) {
     return false;
   }
 
-  if ((size <= MAX_BUFFER_SIZE) && (size > 0)) {
+  if ((size >= MAX_HEADER_SIZE) && ((data[0] & 0xE0) == 0x00)) {
+    // Data message, in segments if needed
+    return HalSendDataMessage(inst, data, size);
+  } else if ((size <= MAX_BUFFER_SIZE) && (size > 0)) {
     ThreadMessage msg;
     HalBuffer* b = HalAllocBuffer(inst);
 
@@ -349,7 +507,11 @@ bool HalSendDownstream(HALHANDLE hHAL, const uint8_t* data, size_t size) {
     msg.length = 0;
     msg.buffer = b;
 
-    return HalEnqueueThreadMessage(inst, &msg);
+    if (!HalEnqueueThreadMessage(inst, &msg)) {
+      HalFreeBuffer(inst, b);
+      return false;
+    }
+    return true;
 
   } else {
     STLOG_HAL_E("HalSendDownstream size to large %zu instead of %d\n", size,
@@ -362,7 +524,7 @@ bool HalSendDownstream(HALHANDLE hHAL, const uint8_t* data, size_t size) {
 /**
  * Send an NCI message downstream to HAL protocol layer (DH->NFCC transfer).
  * Block if more than NUM_BUFFERS (10) transfers are outstanding, otherwise will
- * return immediately.
+ * return immediately. On the HAL thread, fail instead of blocking.
  * @param hHAL HAL handle
  * @param data Data message
  * @param size Message size
@@ -389,7 +551,11 @@ bool HalSendDownstreamTimer(HALHANDLE hHAL, const uint8_t* data, size_t size,
     msg.length = duration;
     msg.buffer = b;
 
-    return HalEnqueueThreadMessage(inst, &msg);
+    if (!HalEnqueueThreadMessage(inst, &msg)) {
+      HalFreeBuffer(inst, b);
+      return false;
+    }
+    return true;
 
   } else {
     STLOG_HAL_E("HalSendDownstreamTimer size to large %zu instead of %d\n",
@@ -426,6 +592,35 @@ bool HalSendDownstreamStopTimer(HALHANDLE hHAL) {
   return 1;
 }
 
+/**
+ * Drop the frames the stack posted and the CLF did not get yet, when it is
+ * reset: they would otherwise go once its CORE_RESET_NTF clears the
+ * outstanding command, in the middle of the init sequence of the wrapper.
+ * @param hHAL HAL handle
+ */
+bool HalFlushDownstream(HALHANDLE hHAL) {
+  HalInstance* inst = (HalInstance*)hHAL;
+  ThreadMessage msg;
+
+  // not dequeued yet, and so not in the TX queues either
+  pthread_mutex_lock(&inst->hMutex);
+  for (int i = inst->ringReadPos; i != inst->ringWritePos;) {
+    if (++i == HAL_QUEUE_MAX) i = 0;
+    if (inst->ring[i].command == MSG_TX_DATA ||
+        inst->ring[i].command == MSG_TX_DATA_TIMER_START) {
+      inst->ring[i].command = MSG_TX_DROPPED;
+    }
+  }
+  pthread_mutex_unlock(&inst->hMutex);
+
+  msg.command = MSG_TX_FLUSH;
+  msg.payload = 0;
+  msg.length = 0;
+  msg.buffer = NULL;
+
+  return HalEnqueueThreadMessage(inst, &msg);
+}
+
 /**
  * Send an NCI message upstream to NFC NCI layer (NFCC->DH transfer).
  * @param hHAL HAL handle
@@ -434,7 +629,12 @@ bool HalSendDownstreamStopTimer(HALHANDLE hHAL) {
  */
 bool HalSendUpstream(HALHANDLE hHAL, const uint8_t* data, size_t size) {
   HalInstance* inst = (HalInstance*)hHAL;
-  if ((size <= MAX_BUFFER_SIZE) && (size > 0)) {
+  if ((size <= MAX_BUFFER_SIZE) && (size > 0) && inst->singleLoop) {
+    // Already on the loop thread, hand the frame over directly
+    sOnHalThread = true;
+    HalOnNewUpstreamFrame(inst, data, size);
+    return true;
+  } else if ((size <= MAX_BUFFER_SIZE) && (size > 0)) {
     ThreadMessage msg;
     msg.command = MSG_RX_DATA;
     msg.payload = data;
@@ -453,6 +653,117 @@ bool HalSendUpstream(HALHANDLE hHAL, const uint8_t* data, size_t size) {
   }
 }
 
+/**
+ * HAL_FLAG_SINGLE_LOOP: file descriptor readable when messages are queued.
+ * @param hHAL HAL handle
+ * @return eventfd, -1 if the HAL has its own worker thread
+ */
+int HalGetEventFd(HALHANDLE hHAL) {
+  HalInstance* inst = (HalInstance*)hHAL;
+
+  return inst->eventFd;
+}
+
+/**
+ * HAL_FLAG_SINGLE_LOOP: time until the wrapper timer expires.
+ * @param hHAL HAL handle
+ * @return poll() timeout in milliseconds, -1 if no timer is running
+ */
+int HalGetTimeout(HALHANDLE hHAL) {
+  HalInstance* inst = (HalInstance*)hHAL;
+  struct timespec now = HalGetTimestamp();
+  uint32_t waitTime = HalCalcSemWaitingTime(inst, &now);
+
+  return (waitTime == OS_SYNC_INFINITE) ? -1 : (int)waitTime;
+}
+
+/**
+ * HAL_FLAG_SINGLE_LOOP: do what the worker thread would do, on the caller's
+ * thread: handle the queued messages, then the expired timer.
+ * @param hHAL HAL handle
+ */
+void HalProcessEvents(HALHANDLE hHAL) {
+  HalInstance* inst = (HalInstance*)hHAL;
+  ThreadMessage msg;
+  uint64_t count;
+
+  if (!inst->loopThreadSetup) {
+    // accounted apart from the I2C thread, whose settings it keeps
+    HalThreadSetup(&sHalThread, "HAL (single loop)", NULL, NULL);
+    inst->loopThreadSetup = true;
+    sOnHalThread = true;
+  }
+
+  // One eventfd count per message, handle them all
+  if (read(inst->eventFd, &count, sizeof(count)) == sizeof(count)) {
+    HalThreadRun(&sHalThread);
+    while (count-- && HalDequeueThreadMessage(inst, &msg)) {
+      HalHandleMessage(inst, &msg);
+    }
+  }
+
+  HalTxTimeout(inst);
+
+  struct timespec now = HalGetTimestamp();
+  if (HalTimerDue(inst, &now)) {
+    STLOG_HAL_W("OS_SYNC_TIMEOUT\n");
+    Hal_event_handler(inst, EVT_TIMER);
+  }
+}
+
+/**
+ * Print the HAL core stats.
+ * @param fd file descriptor to write to
+ */
+void HalDump(int fd) {
+  HalThreadDump(&sHalThread, fd);
+
+  (void)pthread_mutex_lock(&sTxStatsMutex);
+  dprintf(fd,
+          "NCI commands: sent %u, urgent %u, waited for a response %u, max "
+          "wait %llu us, response timeouts %u, unmatched responses %u, "
+          "dropped on reset %u, dropped without buffer %u\n",
+          sCmdStats.sent, sCmdStats.urgent, sCmdStats.waited,
+          (unsigned long long)sCmdStats.maxWaitUs, sCmdStats.timeouts,
+          sCmdStats.unmatched, sCmdStats.flushed, sCmdStats.noBuffer);
+  for (int i = 0; i < HAL_RTT_OPCODES && sRttStats[i].key; i++) {
+    HalRttStats* s = &sRttStats[i];
+    dprintf(fd,
+            "  cmd %02X%02X %02X%02X: responses %u, p50 %llu us, p99 %llu us, "
+            "p99.9 %llu us, max %llu us; timer waits %u, p99.9 %llu us, max "
+            "%llu us, late %u, timeouts %u\n",
+            s->key >> 24, (s->key >> 16) & 0xFF, (s->key >> 8) & 0xFF,
+            s->key & 0xFF, s->rsp.count,
+            (unsigned long long)HalRttPercentile(&s->rsp, 500),
+            (unsigned long long)HalRttPercentile(&s->rsp, 990),
+            (unsigned long long)HalRttPercentile(&s->rsp, 999),
+            (unsigned long long)s->rsp.maxUs, s->wait.count,
+            (unsigned long long)HalRttPercentile(&s->wait, 999),
+            (unsigned long long)s->wait.maxUs, s->late, s->timeouts);
+  }
+  dprintf(fd, "NCI credits: buffer overflows %u\n", sBufferOverflows);
+  for (int i = 0; i < NCI_MAX_CONN; i++) {
+    HalConnStats* s = &sConnStats[i];
+    if (!s->tracked && !s->sent) continue;
+    dprintf(fd,
+            "  conn %d: credits %d, max payload %u, sent %u, held %u (max %u "
+            "at once, max wait %llu us), dropped %u, returned %u\n",
+            i, (s->tracked && s->credits != NCI_CREDITS_UNLIMITED) ? s->credits
+                                                                 : -1,
+            s->maxPayload ? s->maxPayload : MAX_NCIFRAME_PAYLOAD_SIZE, s->sent,
+            s->held, s->maxHeld, (unsigned long long)s->maxWaitUs, s->dropped,
+            s->returned);
+  }
+  dprintf(fd,
+          "NCI segmentation: sent %u messages in %u packets, reassembled %u "
+          "messages from %u packets, dropped %u\n",
+          sSegStats.txMessages, sSegStats.txPackets, sSegStats.rxMessages,
+          sSegStats.rxPackets, sSegStats.rxDropped);
+  (void)pthread_mutex_unlock(&sTxStatsMutex);
+
+  HalConfigCacheDump(fd);
+}
+
 /**************************************************************************************************
  *
  *                                      Private API Definition
@@ -503,6 +814,17 @@ static uint32_t HalCalcSemWaitingTime(HalInstance* inst, struct timespec* now) {
     }
   }
 
+  if (inst->cmdOutstanding) {
+    // Give up the response of the last command, see HalTxTimeout()
+    int delta = HAL_CMD_RSP_TIMEOUT - HalTimeDiffInMs(inst->cmdSentAt, *now);
+
+    if (delta < 0) {
+      result = 0;
+    } else if ((uint32_t)delta < result) {
+      result = delta;
+    }
+  }
+
   if (result != OS_SYNC_INFINITE) {
     // Add one millisecond on top of that, so the waiting semaphore will time
     // out just a moment
@@ -513,6 +835,19 @@ static uint32_t HalCalcSemWaitingTime(HalInstance* inst, struct timespec* now) {
   return result;
 }
 
+/**
+ * Check if the timer expired, once the wait computed by
+ * HalCalcSemWaitingTime() is over.
+ * @param inst HAL instance
+ * @param now current time stamp
+ * @return true if EVT_TIMER is due
+ */
+static bool HalTimerDue(HalInstance* inst, struct timespec* now) {
+  return inst->timer.active &&
+         (HalTimeDiffInMs(inst->timer.startTime, *now) >=
+          (int)inst->timer.duration);
+}
+
 /**************************************************************************************************
  *
  *                                     Timer Management
@@ -520,7 +855,11 @@ static uint32_t HalCalcSemWaitingTime(HalInstance* inst, struct timespec* now) {
  **************************************************************************************************/
 
 static void HalStopTimer(HalInstance* inst) {
+  if (inst->timer.active && inst->timerCmdKey) {
+    HalRttTimerStopped(inst);
+  }
   inst->timer.active = false;
+  inst->timerCmdKey = 0;
   STLOG_HAL_D("HalStopTimer \n");
 }
 
@@ -529,6 +868,8 @@ static void HalStartTimer(HalInstance* inst, uint32_t duration) {
   inst->timer.startTime = HalGetTimestamp();
   inst->timer.active = true;
   inst->timer.duration = duration;
+  inst->timerCmdKey = 0;
+  inst->timerCeilingMs = duration;
 }
 
 /**************************************************************************************************
@@ -570,7 +911,13 @@ static bool HalEnqueueThreadMessage(HalInstance* inst, ThreadMessage* msg) {
 
   pthread_mutex_unlock(&inst->hMutex);
 
-  if (result) {
+  if (result) HalThreadPost(&sHalThread);
+  if (result && inst->singleLoop) {
+    uint64_t one = 1;
+    if (write(inst->eventFd, &one, sizeof(one)) != sizeof(one)) {
+      STLOG_HAL_E("!failed to signal eventfd\n");
+    }
+  } else if (result) {
     sem_post(&inst->semaphore);
   }
 
@@ -609,6 +956,13 @@ static bool HalDequeueThreadMessage(HalInstance* inst, ThreadMessage* msg) {
 
   pthread_mutex_unlock(&inst->hMutex);
 
+  // A data segment left the ring, see HalSendDataMessage()
+  if (result &&
+      (msg->command == MSG_TX_DATA || msg->command == MSG_TX_DROPPED) &&
+      msg->buffer->dataPacket) {
+    sem_post(&inst->dataRingSem);
+  }
+
   return result;
 }
 
@@ -631,7 +985,7 @@ static HalBuffer* HalAllocBuffer(HalInstance* inst) {
   }
 
   // Wait until we have a buffer resource
-  sem_wait_nointr(&inst->bufferResourceSem);
+  if (!HalSemTake(&inst->bufferResourceSem)) return nullptr;
 
   pthread_mutex_lock(&inst->hMutex);
 
@@ -652,6 +1006,26 @@ static HalBuffer* HalAllocBuffer(HalInstance* inst) {
   return b;
 }
 
+/**
+ * Allocate a buffer for a data packet from the stack. Data packets hold at
+ * most HAL_CREDIT_HOLD_MAX buffers, while they wait for a credit or not: the
+ * stack blocks here beyond, the other buffers are left to control messages.
+ * @param inst HAL instance
+ * @return Pointer to allocated HAL buffer
+ */
+static HalBuffer* HalAllocDataBuffer(HalInstance* inst) {
+  HalBuffer* b;
+
+  if (!HalSemTake(&inst->dataBufferSem)) return nullptr;
+  b = HalAllocBuffer(inst);
+  if (b) {
+    b->dataPacket = true;
+  } else {
+    sem_post(&inst->dataBufferSem);
+  }
+  return b;
+}
+
 /**
  * Return buffer to pool.
  * @param inst HAL instance
@@ -659,6 +1033,9 @@ static HalBuffer* HalAllocBuffer(HalInstance* inst) {
  * @return Pointer of freed HAL buffer
  */
 static HalBuffer* HalFreeBuffer(HalInstance* inst, HalBuffer* b) {
+  bool dataPacket = b->dataPacket;
+
+  b->dataPacket = false;
   pthread_mutex_lock(&inst->hMutex);
 
   b->next = inst->freeBufferList;
@@ -668,10 +1045,667 @@ static HalBuffer* HalFreeBuffer(HalInstance* inst, HalBuffer* b) {
 
   // Unblock treads waiting for a buffer
   sem_post(&inst->bufferResourceSem);
+  if (dataPacket) sem_post(&inst->dataBufferSem);
+
+  return b;
+}
+
+/**************************************************************************************************
+ *
+ *                                     TX Scheduler
+ *
+ **************************************************************************************************/
+
+/**
+ * Append a frame to a TX queue.
+ * @param q queue
+ * @param b frame
+ */
+static void HalTxQueuePush(HalTxQueue* q, HalBuffer* b) {
+  b->next = 0;
+  if (q->tail) {
+    q->tail->next = b;
+  } else {
+    q->head = b;
+  }
+  q->tail = b;
+  q->count++;
+}
+
+/**
+ * Put a frame back at the head of a TX queue.
+ * @param q queue
+ * @param b frame
+ */
+static void HalTxQueuePushFront(HalTxQueue* q, HalBuffer* b) {
+  b->next = q->head;
+  q->head = b;
+  if (!q->tail) q->tail = b;
+  q->count++;
+}
+
+/**
+ * Take the oldest frame of a TX queue.
+ * @param q queue
+ * @return frame, NULL if the queue is empty
+ */
+static HalBuffer* HalTxQueuePop(HalTxQueue* q) {
+  HalBuffer* b = q->head;
 
+  if (b) {
+    q->head = b->next;
+    if (!q->head) q->tail = 0;
+    q->count--;
+    b->next = 0;
+  }
   return b;
 }
 
+/**
+ * Time a frame spent in the TX queues.
+ * @param b frame
+ * @param now current time stamp
+ * @return wait time in microseconds
+ */
+static uint64_t HalTxWaitUs(const HalBuffer* b, const struct timespec* now) {
+  return (now->tv_sec - b->queued.tv_sec) * 1000000LL +
+         (now->tv_nsec - b->queued.tv_nsec) / 1000;
+}
+
+/**
+ * Update the stats snapshot of a connection.
+ * @param inst HAL instance
+ * @param connId connection id
+ */
+static void HalCreditStats(HalInstance* inst, uint8_t connId) {
+  sConnStats[connId].tracked = inst->conn[connId].tracked;
+  sConnStats[connId].credits = inst->conn[connId].credits;
+}
+
+/**
+ * Queue a frame from the stack. RF_DEACTIVATE_CMD and the ISO-DEP presence
+ * check go before the other control messages, data packets in the queue of
+ * their connection.
+ * @param inst HAL instance
+ * @param b frame
+ */
+static void HalTxEnqueue(HalInstance* inst, HalBuffer* b) {
+  b->queued = HalGetTimestamp();
+
+  (void)pthread_mutex_lock(&sTxStatsMutex);
+  if ((b->data[0] & 0xE0) == 0x00) {
+    uint8_t connId = b->data[0] & 0x0F;
+    HalConn* c = &inst->conn[connId];
+
+    HalTxQueuePush(&c->queue, b);
+    if (c->queue.count > 1 || (c->tracked && c->credits == 0)) {
+      // it will wait for a credit
+      sConnStats[connId].held++;
+      if (c->queue.count > sConnStats[connId].maxHeld) {
+        sConnStats[connId].maxHeld = c->queue.count;
+      }
+    }
+  } else {
+    if (b->length >= 2 && (b->data[0] & 0xEF) == 0x21 &&
+        (b->data[1] == 0x06 || b->data[1] == 0x10)) {
+      HalTxQueuePush(&inst->urgentQueue, b);
+      sCmdStats.urgent++;
+    } else {
+      HalTxQueuePush(&inst->cmdQueue, b);
+    }
+    if (inst->cmdOutstanding) sCmdStats.waited++;
+  }
+  (void)pthread_mutex_unlock(&sTxStatsMutex);
+}
+
+/**
+ * Send a frame to the CLF.
+ * @param inst HAL instance
+ * @param b frame
+ */
+static void HalTxSend(HalInstance* inst, HalBuffer* b) {
+  inst->nciBuffer = b;
+
+  STLOG_HAL_V("trigger transport of next NCI data downstream\n");
+  // Process the new nci frame
+  Hal_event_handler(inst, EVT_TX_DATA);
+}
+
+/**
+ * Stop waiting for the response of a command the CLF does not answer.
+ * @param inst HAL instance
+ */
+static void HalTxTimeout(HalInstance* inst) {
+  if (!inst->cmdOutstanding ||
+      HalTimeDiffInMs(inst->cmdSentAt, HalGetTimestamp()) <
+          HAL_CMD_RSP_TIMEOUT) {
+    return;
+  }
+
+  STLOG_HAL_W("no response to the last command, sending the next one\n");
+  inst->cmdOutstanding = false;
+  (void)pthread_mutex_lock(&sTxStatsMutex);
+  sCmdStats.timeouts++;
+  (void)pthread_mutex_unlock(&sTxStatsMutex);
+
+  HalTriggerNextDsPacket(inst);
+}
+
+/**
+ * Identify a command for its response time stats: GID and OID, and for the
+ * proprietary commands the first two payload bytes, the loader APDU CLA and
+ * INS for instance.
+ * @param data NCI command
+ * @param length Size of the command
+ * @return key, never 0
+ */
+static uint32_t HalRttKey(const uint8_t* data, size_t length) {
+  uint32_t key = (uint32_t)(0x20 | (data[0] & 0x0F)) << 24 |
+                 (uint32_t)(data[1] & 0x3F) << 16;
+
+  if ((data[0] & 0x0F) == 0x0F && length >= 5) {
+    key |= (uint32_t)data[3] << 8 | data[4];
+  }
+  return key;
+}
+
+/**
+ * Find the stats slot of a command, with sTxStatsMutex held.
+ * @param key HalRttKey() of the command
+ * @param create take a free slot if the command has none
+ * @return slot, NULL if none
+ */
+static HalRttStats* HalRttFind(uint32_t key, bool create) {
+  for (int i = 0; i < HAL_RTT_OPCODES; i++) {
+    if (sRttStats[i].key == key) return &sRttStats[i];
+    if (!sRttStats[i].key) {
+      if (!create) return NULL;
+      sRttStats[i].key = key;
+      return &sRttStats[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Histogram bucket of a response time: 4 buckets per power of 2.
+ * @param us response time in microseconds
+ * @return bucket index
+ */
+static int HalRttBucket(uint64_t us) {
+  int msb;
+
+  if (us < 4) return (int)us;
+  msb = 63 - __builtin_clzll(us);
+  if (msb >= HAL_RTT_BUCKETS / 4) return HAL_RTT_BUCKETS - 1;
+  return msb * 4 + (int)((us >> (msb - 2)) & 3);
+}
+
+/**
+ * Add a duration to a histogram, with sTxStatsMutex held.
+ * @param h histogram
+ * @param us duration in microseconds
+ */
+static void HalRttAdd(HalRttHist* h, uint64_t us) {
+  h->count++;
+  h->buckets[HalRttBucket(us)]++;
+  if (us > h->maxUs) h->maxUs = us;
+}
+
+/**
+ * Duration under which a given share of the samples fell, rounded up to the
+ * end of its bucket, with sTxStatsMutex held.
+ * @param h histogram
+ * @param permille share of the samples, 999 for p99.9
+ * @return duration in microseconds
+ */
+static uint64_t HalRttPercentile(const HalRttHist* h, uint32_t permille) {
+  uint64_t rank = ((uint64_t)h->count * permille + 999) / 1000;
+  uint64_t seen = 0;
+
+  for (int i = 0; i < HAL_RTT_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= rank && seen) {
+      if (i < 4) return i + 1;
+      return (uint64_t)(4 + (i & 3) + 1) << (i / 4 - 2);
+    }
+  }
+  return h->maxUs;
+}
+
+/**
+ * Timeout derived from the timer waits of a command, with sTxStatsMutex
+ * held.
+ * @param s command stats, may be NULL
+ * @param factor multiplier of p99.9
+ * @param ceilingMs fixed timeout of the caller
+ * @return timeout in ms
+ */
+static uint32_t HalRttDerive(const HalRttStats* s, unsigned long factor,
+                             uint32_t ceilingMs) {
+  uint64_t ms;
+
+  if (!s || s->wait.count < HAL_RTT_MIN_SAMPLES) return ceilingMs;
+
+  ms = (HalRttPercentile(&s->wait, 999) * factor + 999) / 1000;
+  if (ms < HAL_RTT_TIMEOUT_MIN) ms = HAL_RTT_TIMEOUT_MIN;
+  return (ms < ceilingMs) ? (uint32_t)ms : ceilingMs;
+}
+
+/**
+ * Wrapper timer of a command, STNFC_ADAPTIVE_TIMEOUT: learned from how long
+ * the wrapper waited before it stopped the timer for the same command,
+ * which may be for a notification after the response.
+ * @param inst HAL instance
+ * @param key HalRttKey() of the command
+ * @param ceilingMs fixed timeout of the caller
+ * @return timeout in ms
+ */
+static uint32_t HalRttTimeout(HalInstance* inst, uint32_t key,
+                              uint32_t ceilingMs) {
+  uint32_t timeoutMs;
+
+  if (!inst->rttFactor) return ceilingMs;
+
+  (void)pthread_mutex_lock(&sTxStatsMutex);
+  timeoutMs = HalRttDerive(HalRttFind(key, false), inst->rttFactor, ceilingMs);
+  (void)pthread_mutex_unlock(&sTxStatsMutex);
+
+  if (timeoutMs != ceilingMs) {
+    STLOG_HAL_D("command 0x%08x: timeout %u ms instead of %u ms\n", key,
+                timeoutMs, ceilingMs);
+  }
+  return timeoutMs;
+}
+
+/**
+ * Match a response to the outstanding command and record its response time.
+ * @param inst HAL instance
+ * @param data NCI response
+ */
+static void HalRttResponse(HalInstance* inst, const uint8_t* data) {
+  struct timespec now = HalGetTimestamp();
+  HalRttStats* s;
+  uint64_t us;
+
+  (void)pthread_mutex_lock(&sTxStatsMutex);
+  if (!inst->cmdOutstanding ||
+      (data[0] & 0x0F) != ((inst->cmdKey >> 24) & 0x0F) ||
+      (data[1] & 0x3F) != ((inst->cmdKey >> 16) & 0x3F)) {
+    sCmdStats.unmatched++;
+    (void)pthread_mutex_unlock(&sTxStatsMutex);
+    STLOG_HAL_W("response %02x %02x does not match command 0x%08x\n",
+                data[0], data[1], inst->cmdOutstanding ? inst->cmdKey : 0);
+    return;
+  }
+
+  us = (now.tv_sec - inst->cmdSentAt.tv_sec) * 1000000LL +
+       (now.tv_nsec - inst->cmdSentAt.tv_nsec) / 1000;
+  s = HalRttFind(inst->cmdKey, true);
+  if (s) HalRttAdd(&s->rsp, us);
+  (void)pthread_mutex_unlock(&sTxStatsMutex);
+}
+
+/**
+ * The wrapper stopped the timer of a command: the wait it started the timer
+ * for is over, record how long it took.
+ * @param inst HAL instance
+ */
+static void HalRttTimerStopped(HalInstance* inst) {
+  struct timespec now = HalGetTimestamp();
+  HalRttStats* s;
+  uint64_t us;
+
+  us = (now.tv_sec - inst->timer.startTime.tv_sec) * 1000000LL +
+       (now.tv_nsec - inst->timer.startTime.tv_nsec) / 1000;
+  (void)pthread_mutex_lock(&sTxStatsMutex);
+  s = HalRttFind(inst->timerCmdKey, true);
+  if (s) {
+    uint32_t derivedMs = HalRttDerive(
+        s, inst->rttFactor ? inst->rttFactor : HAL_RTT_SHADOW_FACTOR,
+        UINT32_MAX);
+    if (s->wait.count >= HAL_RTT_MIN_SAMPLES &&
+        us > (uint64_t)derivedMs * 1000) {
+      s->late++;
+    }
+    HalRttAdd(&s->wait, us);
+  }
+  (void)pthread_mutex_unlock(&sTxStatsMutex);
+}
+
+/**
+ * The wrapper timer of a command expired.
+ * @param inst HAL instance
+ */
+static void HalRttTimerExpired(HalInstance* inst) {
+  HalRttStats* s;
+
+  STLOG_HAL_E("no end of the wait for command 0x%08x after %u ms\n",
+              inst->timerCmdKey, inst->timer.duration);
+  (void)pthread_mutex_lock(&sTxStatsMutex);
+  s = HalRttFind(inst->timerCmdKey, true);
+  if (s) {
+    s->timeouts++;
+    if (inst->timer.duration < inst->timerCeilingMs) {
+      // the learned timeout was too short: back to the one of the caller
+      // until the waits are learned again
+      STLOG_HAL_W("command 0x%08x: timeout of %u ms restored\n",
+                  inst->timerCmdKey, inst->timerCeilingMs);
+      memset(&s->wait, 0, sizeof(s->wait));
+    }
+  }
+  (void)pthread_mutex_unlock(&sTxStatsMutex);
+  // counted once, the timer fires again until it is stopped
+  inst->timerCmdKey = 0;
+}
+
+/**
+ * Stop the flow control of a connection, dropping what it still queued or
+ * reassembled.
+ * @param inst HAL instance
+ * @param connId connection id
+ * @param tracked true if the NFCC gave the credits of the connection
+ * @param credits initial credits
+ * @param maxPayload max data packet payload, 0 if not negotiated
+ */
+static void HalCreditReset(HalInstance* inst, uint8_t connId, bool tracked,
+                           uint8_t credits, uint8_t maxPayload) {
+  HalConn* c = &inst->conn[connId];
+  HalBuffer* b;
+  uint32_t dropped = 0;
+
+  while ((b = HalTxQueuePop(&c->queue)) != NULL) {
+    dropped++;
+    HalFreeBuffer(inst, b);
+  }
+  if (dropped) {
+    STLOG_HAL_W("conn %d: %u queued packets dropped\n", connId, dropped);
+  }
+  c->tracked = tracked;
+  c->credits = credits;
+  HalRxDiscard(&c->rx);
+
+  (void)pthread_mutex_lock(&sTxStatsMutex);
+  sConnStats[connId].dropped += dropped;
+  // read by HalSendDataMessage() on the stack thread
+  sConnStats[connId].maxPayload = maxPayload;
+  HalCreditStats(inst, connId);
+  (void)pthread_mutex_unlock(&sTxStatsMutex);
+}
+
+/**
+ * Drop the frames of the TX queues, see HalFlushDownstream().
+ * @param inst HAL instance
+ */
+static void HalTxFlush(HalInstance* inst) {
+  HalBuffer* b;
+  uint32_t dropped = 0;
+
+  while ((b = HalTxQueuePop(&inst->urgentQueue)) != NULL ||
+         (b = HalTxQueuePop(&inst->cmdQueue)) != NULL) {
+    HalFreeBuffer(inst, b);
+    dropped++;
+  }
+  inst->cmdSegments = NULL;
+  if (dropped) {
+    STLOG_HAL_W("%u queued control messages dropped\n", dropped);
+  }
+  (void)pthread_mutex_lock(&sTxStatsMutex);
+  sCmdStats.flushed += dropped;
+  (void)pthread_mutex_unlock(&sTxStatsMutex);
+
+  for (uint8_t connId = 0; connId < NCI_MAX_CONN; connId++) {
+    HalCreditReset(inst, connId, false, 0, 0);
+  }
+}
+
+/**
+ * Learn the end of the outstanding command and the credits of the
+ * connections from a frame going upstream, before the stack sees it.
+ * @param inst HAL instance
+ * @param data NCI frame from the CLF
+ * @param length Size of the frame
+ */
+static void HalTxRx(HalInstance* inst, const uint8_t* data, size_t length) {
+  uint8_t connId;
+
+  if (length < 4) return;
+
+  if ((data[0] & 0xF0) == 0x40) {
+    // last segment of a response
+    HalRttResponse(inst, data);
+    inst->cmdOutstanding = false;
+  }
+
+  if ((data[0] == 0x60 || data[0] == 0x40) && data[1] == 0x00) {
+    // CORE_RESET_NTF / RSP: no more response to wait for, no connection
+    inst->cmdOutstanding = false;
+    inst->cmdSegments = NULL;
+    for (connId = 0; connId < NCI_MAX_CONN; connId++) {
+      HalCreditReset(inst, connId, false, 0, 0);
+    }
+  } else if (data[0] == 0x40 && data[1] == 0x01 && length >= 14 &&
+             data[3] == 0x00) {
+    // CORE_INIT_RSP: static HCI connection
+    HalCreditReset(inst, 1, true, data[13], data[12]);
+  } else if (data[0] == 0x61 && data[1] == 0x05 && length >= 9) {
+    // RF_INTF_ACTIVATED_NTF: static RF connection
+    HalCreditReset(inst, 0, true, data[8], data[7]);
+  } else if ((data[0] == 0x61 || data[0] == 0x41) && data[1] == 0x06) {
+    // RF_DEACTIVATE_NTF / RSP
+    HalCreditReset(inst, 0, false, 0, 0);
+  } else if (data[0] == 0x40 && data[1] == 0x04 && length >= 7 &&
+             data[3] == 0x00) {
+    // CORE_CONN_CREATE_RSP
+    HalCreditReset(inst, data[6] & 0x0F, true, data[5], data[4]);
+  } else if (data[0] == 0x40 && data[1] == 0x05) {
+    // CORE_CONN_CLOSE_RSP
+    if (inst->closingConn && data[3] == 0x00) {
+      HalCreditReset(inst, inst->closingConn, false, 0, 0);
+    }
+    inst->closingConn = 0;
+  } else if (data[0] == 0x60 && data[1] == 0x06) {
+    // CORE_CONN_CREDITS_NTF, the packets waiting go after the stack saw it
+    for (size_t i = 4; i + 1 < length && i < 4 + 2 * (size_t)data[3];
+         i += 2) {
+      HalConn* c;
+      connId = data[i] & 0x0F;
+      c = &inst->conn[connId];
+
+      if (c->tracked && c->credits != NCI_CREDITS_UNLIMITED) {
+        c->credits = (c->credits + data[i + 1] < NCI_CREDITS_UNLIMITED)
+                         ? c->credits + data[i + 1]
+                         : NCI_CREDITS_UNLIMITED - 1;
+      }
+
+      (void)pthread_mutex_lock(&sTxStatsMutex);
+      sConnStats[connId].returned += data[i + 1];
+      HalCreditStats(inst, connId);
+      (void)pthread_mutex_unlock(&sTxStatsMutex);
+    }
+  } else if (data[0] == 0x60 && data[1] == 0x07 && data[3] == 0xE1) {
+    // CORE_GENERIC_ERROR_NTF, buffer overflow
+    (void)pthread_mutex_lock(&sTxStatsMutex);
+    sBufferOverflows++;
+    (void)pthread_mutex_unlock(&sTxStatsMutex);
+  }
+}
+
+/**************************************************************************************************
+ *
+ *                                     Segmentation
+ *
+ **************************************************************************************************/
+
+/**
+ * Queue a data message from the stack in packets of the max payload of its
+ * connection, the PBF bit set on all but the last one.
+ * @param inst HAL instance
+ * @param data Data message, the length byte ignored above 255 bytes
+ * @param size Message size
+ * Block while HAL_QUEUE_DATA_MAX segments are in the message ring.
+ * @return false if the message is too large or could not be queued
+ */
+static bool HalSendDataMessage(HalInstance* inst, const uint8_t* data,
+                               size_t size) {
+  uint8_t connId = data[0] & 0x0F;
+  size_t maxPayload, offset = MAX_HEADER_SIZE;
+  uint32_t packets = 0;
+
+  if (size > HAL_MAX_MESSAGE_SIZE) {
+    STLOG_HAL_E("HalSendDownstream size to large %zu instead of %d\n", size,
+                HAL_MAX_MESSAGE_SIZE);
+    return false;
+  }
+
+  (void)pthread_mutex_lock(&sTxStatsMutex);
+  maxPayload = sConnStats[connId].maxPayload;
+  (void)pthread_mutex_unlock(&sTxStatsMutex);
+  if (!maxPayload) maxPayload = MAX_NCIFRAME_PAYLOAD_SIZE;
+
+  do {
+    size_t chunk = (size - offset < maxPayload) ? size - offset : maxPayload;
+    bool last = (offset + chunk == size);
+    ThreadMessage msg;
+    HalBuffer* b = HalAllocDataBuffer(inst);
+
+    if (!b) {
+      // Should never be reachable
+      return false;
+    }
+
+    // a segment from the stack keeps its PBF bit
+    b->data[0] = last ? data[0] : (data[0] | 0x10);
+    b->data[1] = data[1];
+    b->data[2] = (uint8_t)chunk;
+    memcpy(b->data + MAX_HEADER_SIZE, data + offset, chunk);
+    b->length = chunk + MAX_HEADER_SIZE;
+
+    msg.command = MSG_TX_DATA;
+    msg.payload = 0;
+    msg.length = 0;
+    msg.buffer = b;
+
+    // wait for the HAL thread rather than fail with part of the message
+    // queued, the other slots stay free for the frames from the CLF
+    if (!HalSemTake(&inst->dataRingSem)) {
+      HalFreeBuffer(inst, b);
+      return false;
+    }
+    if (!HalEnqueueThreadMessage(inst, &msg)) {
+      sem_post(&inst->dataRingSem);
+      HalFreeBuffer(inst, b);
+      return false;
+    }
+    offset += chunk;
+    packets++;
+  } while (offset < size);
+
+  if (packets > 1) {
+    (void)pthread_mutex_lock(&sTxStatsMutex);
+    sSegStats.txMessages++;
+    sSegStats.txPackets += packets;
+    (void)pthread_mutex_unlock(&sTxStatsMutex);
+  }
+  return true;
+}
+
+/**
+ * Drop a message being reassembled and its memory.
+ * @param m reassembly
+ */
+static void HalRxDiscard(HalRxMessage* m) {
+  free(m->data);
+  m->data = NULL;
+  m->length = 0;
+  m->size = 0;
+  m->packets = 0;
+  m->dropping = false;
+}
+
+/**
+ * STNFC_NCI_REASSEMBLY: add a data packet from the CLF to the message of its
+ * connection, and point usMessage to the message once complete. Control
+ * messages go as received: the wrapper and the FW log parser expect them in
+ * one frame of at most MAX_BUFFER_SIZE bytes.
+ * @param inst HAL instance
+ * @param data NCI packet
+ * @param length Size of the packet
+ * @return true if usMessage is ready for the stack
+ */
+static bool HalRxReassemble(HalInstance* inst, const uint8_t* data,
+                            size_t length) {
+  HalRxMessage* m = &inst->conn[data[0] & 0x0F].rx;
+  size_t needed;
+
+  if (length < MAX_HEADER_SIZE || (data[0] & 0xE0) != 0x00) return true;
+  if (m->dropping) {
+    m->dropping = (data[0] & 0x10) != 0;
+    return false;
+  }
+  if (!(data[0] & 0x10) && !m->length) {
+    // not segmented
+    return true;
+  }
+
+  needed = (m->length ? m->length : MAX_HEADER_SIZE) + length -
+           MAX_HEADER_SIZE;
+  if (needed > m->size && needed <= HAL_MAX_MESSAGE_SIZE) {
+    size_t size = (m->size * 2 > HAL_RX_MESSAGE_MIN) ? m->size * 2
+                                                     : HAL_RX_MESSAGE_MIN;
+    uint8_t* grown;
+
+    if (size < needed) size = needed;
+    if (size > HAL_MAX_MESSAGE_SIZE) size = HAL_MAX_MESSAGE_SIZE;
+    grown = (uint8_t*)realloc(m->data, size);
+    if (grown) {
+      m->data = grown;
+      m->size = size;
+    }
+  }
+  if (needed > m->size) {
+    STLOG_HAL_E("!segmented message %02x %02x dropped, %zu bytes\n", data[0],
+                data[1], needed);
+    HalRxDiscard(m);
+    m->dropping = (data[0] & 0x10) != 0;
+    (void)pthread_mutex_lock(&sTxStatsMutex);
+    sSegStats.rxDropped++;
+    (void)pthread_mutex_unlock(&sTxStatsMutex);
+    return false;
+  }
+
+  if (!m->length) {
+    memcpy(m->data, data, MAX_HEADER_SIZE);
+    m->length = MAX_HEADER_SIZE;
+  }
+  memcpy(m->data + m->length, data + MAX_HEADER_SIZE,
+         length - MAX_HEADER_SIZE);
+  m->length += length - MAX_HEADER_SIZE;
+  m->packets++;
+
+  if (data[0] & 0x10) {
+    // more segments to come
+    return false;
+  }
+
+  m->data[0] &= ~0x10;
+  m->data[2] = (m->length - MAX_HEADER_SIZE <= MAX_NCIFRAME_PAYLOAD_SIZE)
+                   ? (uint8_t)(m->length - MAX_HEADER_SIZE)
+                   : MAX_NCIFRAME_PAYLOAD_SIZE;
+  inst->usMessage = m->data;
+  inst->usMessageSize = m->length;
+
+  (void)pthread_mutex_lock(&sTxStatsMutex);
+  sSegStats.rxMessages++;
+  sSegStats.rxPackets += m->packets;
+  (void)pthread_mutex_unlock(&sTxStatsMutex);
+
+  // the memory stays for the next message, usMessage is used before
+  m->length = 0;
+  m->packets = 0;
+  return true;
+}
+
 /**************************************************************************************************
  *
  *                                     State Machine
@@ -691,8 +1725,8 @@ static void Hal_event_handler(HalInstance* inst, HalEvent e) {
       size_t nciLength;
 
       // Extract raw NCI data from frame
-      nciData = inst->lastUsFrame;
-      nciLength = inst->lastUsFrameSize;
+      nciData = inst->usMessage;
+      nciLength = inst->usMessageSize;
 
       // Pass received raw NCI data to stack
       inst->callback(inst->context, HAL_EVENT_DATAIND, nciData, nciLength);
@@ -711,6 +1745,9 @@ static void Hal_event_handler(HalInstance* inst, HalEvent e) {
 
     // HAL WRAPPER
     case EVT_TIMER:
+      if (inst->timerCmdKey) {
+        HalRttTimerExpired(inst);
+      }
       inst->callback(inst->context, HAL_EVENT_TIMER_TIMEOUT, NULL, 0);
       break;
   }
@@ -730,7 +1767,10 @@ static void Hal_event_handler(HalInstance* inst, HalEvent e) {
 static void* HalWorkerThread(void* arg) {
   HalInstance* inst = (HalInstance*)arg;
   inst->exitRequest = false;
+  sOnHalThread = true;
 
+  HalThreadSetup(&sHalThread, "HAL", NAME_STNFC_HAL_THREAD_PRIORITY,
+                 NAME_STNFC_HAL_THREAD_AFFINITY);
   STLOG_HAL_V("thread running\n");
 
   while (!inst->exitRequest) {
@@ -742,89 +1782,20 @@ static void* HalWorkerThread(void* arg) {
       case OS_SYNC_TIMEOUT: {
         // One or more times have expired
         STLOG_HAL_W("OS_SYNC_TIMEOUT\n");
+        HalTxTimeout(inst);
         now = HalGetTimestamp();
         // Data frame
-        Hal_event_handler(inst, EVT_TIMER);
+        if (HalTimerDue(inst, &now)) Hal_event_handler(inst, EVT_TIMER);
       } break;
 
       case OS_SYNC_RELEASED: {
         // A message arrived
         ThreadMessage msg;
 
+        HalThreadRun(&sHalThread);
+
         if (HalDequeueThreadMessage(inst, &msg)) {
-          switch (msg.command) {
-            case MSG_EXIT_REQUEST:
-
-              STLOG_HAL_V("received exit request from upper layer\n");
-              inst->exitRequest = true;
-              break;
-
-            case MSG_TX_DATA:
-              STLOG_HAL_V("received new NCI data from stack\n");
-
-              // Attack to end of list
-              if (!inst->pendingNciList) {
-                inst->pendingNciList = msg.buffer;
-                inst->pendingNciList->next = 0;
-              } else {
-                // Find last element of the list. b->next is zero for this
-                // element
-                HalBuffer* b;
-                for (b = inst->pendingNciList; b->next; b = b->next) {
-                };
-
-                // Concatenate to list
-                b->next = msg.buffer;
-                msg.buffer->next = 0;
-              }
-
-              // Start transmitting if we're in the correct state
-              HalTriggerNextDsPacket(inst);
-              break;
-
-            // HAL WRAPPER
-            case MSG_TX_DATA_TIMER_START:
-              STLOG_HAL_V(
-                  "received new NCI data from stack, need timer start\n");
-
-              // Attack to end of list
-              if (!inst->pendingNciList) {
-                inst->pendingNciList = msg.buffer;
-                inst->pendingNciList->next = 0;
-              } else {
-                // Find last element of the list. b->next is zero for this
-                // element
-                HalBuffer* b;
-                for (b = inst->pendingNciList; b->next; b = b->next) {
-                };
-
-                // Concatenate to list
-                b->next = msg.buffer;
-                msg.buffer->next = 0;
-              }
-
-              // Start timer
-              HalStartTimer(inst, msg.length);
-
-              // Start transmitting if we're in the correct state
-              HalTriggerNextDsPacket(inst);
-              break;
-
-            case MSG_RX_DATA:
-              STLOG_HAL_V("received new data from CLF\n");
-              HalOnNewUpstreamFrame(inst, (unsigned char*)msg.payload,
-                                    msg.length);
-              break;
-
-            case MSG_TIMER_START:
-              // Start timer
-              HalStartTimer(inst, msg.length);
-              STLOG_HAL_D("MSG_TIMER_START \n");
-              break;
-            default:
-              STLOG_HAL_E("!received unknown thread message?\n");
-              break;
-          }
+          HalHandleMessage(inst, &msg);
         } else {
           STLOG_HAL_E("!got wakeup in workerthread, but no message here? ?\n");
         }
@@ -840,10 +1811,73 @@ static void* HalWorkerThread(void* arg) {
     }
   }
 
+  HalThreadExit(&sHalThread);
   STLOG_HAL_D("thread about to exit\n");
   return NULL;
 }
 
+/**
+ * Handle one message dequeued from the ring, on the worker thread or, with
+ * HAL_FLAG_SINGLE_LOOP, from HalProcessEvents().
+ * @param inst HAL instance
+ * @param msg message
+ */
+static void HalHandleMessage(HalInstance* inst, ThreadMessage* msg) {
+  switch (msg->command) {
+    case MSG_EXIT_REQUEST:
+
+      STLOG_HAL_V("received exit request from upper layer\n");
+      inst->exitRequest = true;
+      break;
+
+    case MSG_TX_DATA:
+      STLOG_HAL_V("received new NCI data from stack\n");
+
+      HalTxEnqueue(inst, msg->buffer);
+
+      // Start transmitting if we're in the correct state
+      HalTriggerNextDsPacket(inst);
+      break;
+
+    // HAL WRAPPER
+    case MSG_TX_DATA_TIMER_START:
+      STLOG_HAL_V("received new NCI data from stack, need timer start\n");
+
+      // Start timer, once it is sent
+      msg->buffer->timerMs = msg->length;
+      HalTxEnqueue(inst, msg->buffer);
+
+      // Start transmitting if we're in the correct state
+      HalTriggerNextDsPacket(inst);
+      break;
+
+    case MSG_RX_DATA:
+      STLOG_HAL_V("received new data from CLF\n");
+      HalOnNewUpstreamFrame(inst, (unsigned char*)msg->payload, msg->length);
+      break;
+
+    case MSG_TIMER_START:
+      // Start timer
+      HalStartTimer(inst, msg->length);
+      STLOG_HAL_D("MSG_TIMER_START \n");
+      break;
+
+    case MSG_TX_DROPPED:
+      HalFreeBuffer(inst, msg->buffer);
+      (void)pthread_mutex_lock(&sTxStatsMutex);
+      sCmdStats.flushed++;
+      (void)pthread_mutex_unlock(&sTxStatsMutex);
+      break;
+
+    case MSG_TX_FLUSH:
+      HalTxFlush(inst);
+      break;
+    default:
+      STLOG_HAL_E("!received unknown thread message?\n");
+      break;
+  }
+}
+
 /**************************************************************************************************
  *
  *                                     Misc. Functions
@@ -864,6 +1898,24 @@ static inline int sem_wait_nointr(sem_t* sem) {
   return 0;
 }
 
+/**
+ * Take a buffer or ring slot for a frame to send. The wrapper sends from its
+ * callbacks on the HAL thread, which is the one giving them back: it does
+ * not wait there, the frame is dropped and the caller told.
+ * @param sem resource semaphore
+ * @return true if taken
+ */
+static bool HalSemTake(sem_t* sem) {
+  if (!sOnHalThread) return sem_wait_nointr(sem) == 0;
+  if (sem_trywait(sem) == 0) return true;
+
+  STLOG_HAL_E("! no buffer left for a frame of the HAL thread\n");
+  (void)pthread_mutex_lock(&sTxStatsMutex);
+  sCmdStats.noBuffer++;
+  (void)pthread_mutex_unlock(&sTxStatsMutex);
+  return false;
+}
+
 /**
  * Handle RX frames here first in HAL context.
  * @param inst HAL instance
@@ -874,34 +1926,119 @@ static void HalOnNewUpstreamFrame(HalInstance* inst, const uint8_t* data,
                                   size_t length) {
   memcpy(inst->lastUsFrame, data, length);
   inst->lastUsFrameSize = length;
+  inst->usMessage = inst->lastUsFrame;
+  inst->usMessageSize = length;
+
+  HalTxRx(inst, data, length);
 
-  // Data frame
-  Hal_event_handler(inst, EVT_RX_DATA);
+  // Data frame, once all its segments are there, unless it answers the HAL
+  if (HalConfigCacheReceived(data, length)) {
+    STLOG_HAL_V("response to a replayed routing message\n");
+  } else if (!inst->rxReassembly || HalRxReassemble(inst, data, length)) {
+    Hal_event_handler(inst, EVT_RX_DATA);
+  }
   // Allow the I2C thread to get the next message (if done early, it may
   // overwrite before handled)
-  sem_post(&inst->upstreamBlock);
+  if (!inst->singleLoop) sem_post(&inst->upstreamBlock);
+
+  // A response or credits may let queued frames go
+  HalTriggerNextDsPacket(inst);
 }
 
 /**
- * Send out the next queued up buffer for TX if any.
+ * Send out what the TX queues allow, by priority: control messages, the next
+ * one after the response of the previous one, then data packets with a
+ * credit, one per connection and round.
  * @param inst HAL instance
  */
 static void HalTriggerNextDsPacket(HalInstance* inst) {
-  // Check if we have something to transmit downstream
-  HalBuffer* b = inst->pendingNciList;
-
-  if (b) {
-    // Get the buffer from the pending list
-    inst->pendingNciList = b->next;
-    inst->nciBuffer = b;
+  struct timespec now = HalGetTimestamp();
+  HalBuffer* b;
+  bool sent;
+  uint8_t rsp[MAX_BUFFER_SIZE];
+  size_t rspLength;
+
+  while (!inst->cmdOutstanding) {
+    // the segments of a command go back to back
+    HalTxQueue* q = inst->cmdSegments;
+    if (!q) q = inst->urgentQueue.head ? &inst->urgentQueue : &inst->cmdQueue;
+    if (!(b = HalTxQueuePop(q))) break;
+
+    if (!inst->cmdSegments &&
+        HalConfigCacheLookup(b->data, b->length, rsp, &rspLength)) {
+      // known GET_CONFIG or routing, the response goes up as from the CLF
+      HalFreeBuffer(inst, b);
+      inst->usMessage = rsp;
+      inst->usMessageSize = rspLength;
+      Hal_event_handler(inst, EVT_RX_DATA);
+      continue;
+    } else if (!inst->cmdSegments && HalConfigCacheReplay(rsp, &rspLength)) {
+      // routing messages answered above go first, their response stays here
+      HalTxQueuePushFront(q, b);
+      inst->cmdOutstanding = true;
+      inst->cmdSentAt = now;
+      inst->cmdKey = HalRttKey(rsp, rspLength);
+      inst->callback(inst->context, HAL_EVENT_DSWRITE, rsp, rspLength);
+      continue;
+    } else if (b->data[0] & 0x10) {
+      inst->cmdSegments = q;
+    } else {
+      inst->cmdSegments = NULL;
+      // answered by HalCoreCallback(), not by the CLF
+      if (b->length != sizeof(NCI_ANDROID_GET_CAPS) ||
+          memcmp(b->data, NCI_ANDROID_GET_CAPS, b->length)) {
+        inst->cmdOutstanding = true;
+        inst->cmdSentAt = now;
+        inst->cmdKey = HalRttKey(b->data, b->length);
+      }
+    }
+    if (b->timerMs) {
+      // the fixed timeout of the caller is the ceiling
+      HalStartTimer(inst, HalRttTimeout(inst, HalRttKey(b->data, b->length),
+                                        b->timerMs));
+      inst->timerCmdKey = HalRttKey(b->data, b->length);
+      inst->timerCeilingMs = b->timerMs;
+      b->timerMs = 0;
+    }
+    // CORE_CONN_CLOSE_CMD, the response does not tell which one
+    if (b->length >= 4 && b->data[0] == 0x20 && b->data[1] == 0x05) {
+      inst->closingConn = b->data[3] & 0x0F;
+    }
 
-    STLOG_HAL_V("trigger transport of next NCI data downstream\n");
-    // Process the new nci frame
-    Hal_event_handler(inst, EVT_TX_DATA);
+    (void)pthread_mutex_lock(&sTxStatsMutex);
+    sCmdStats.sent++;
+    if (HalTxWaitUs(b, &now) > sCmdStats.maxWaitUs) {
+      sCmdStats.maxWaitUs = HalTxWaitUs(b, &now);
+    }
+    (void)pthread_mutex_unlock(&sTxStatsMutex);
 
-  } else {
-    STLOG_HAL_V("no new NCI data to transmit, enter wait..\n");
+    HalConfigCacheSent(b->data, b->length);
+    HalTxSend(inst, b);
   }
+
+  do {
+    sent = false;
+    for (uint8_t connId = 0; connId < NCI_MAX_CONN; connId++) {
+      HalConn* c = &inst->conn[connId];
+      bool limited = c->tracked && c->credits != NCI_CREDITS_UNLIMITED;
+
+      if (!c->queue.head || (limited && !c->credits)) continue;
+
+      b = HalTxQueuePop(&c->queue);
+      if (limited) c->credits--;
+
+      (void)pthread_mutex_lock(&sTxStatsMutex);
+      sConnStats[connId].sent++;
+      if (HalTxWaitUs(b, &now) > sConnStats[connId].maxWaitUs) {
+        sConnStats[connId].maxWaitUs = HalTxWaitUs(b, &now);
+      }
+      HalCreditStats(inst, connId);
+      (void)pthread_mutex_unlock(&sTxStatsMutex);
+
+      HalTxSend(inst, b);
+      sent = true;
+    }
+  } while (sent);
 }
 
 /*
@@ -31,6 +31,11 @@
 
 #define MAX_BUFFER_SIZE (MAX_NCIFRAME_PAYLOAD_SIZE + MAX_HEADER_SIZE)
 
+/* NCI message made of segments (PBF), bounded by the 16 bit length of the
+ * stack callbacks */
+#define HAL_MAX_MESSAGE_SIZE 0xFFFF
+#define HAL_RX_MESSAGE_MIN 1024 /* first allocation for a reassembly */
+
 // the three NCI bytes:
 // Octet1 and Octet 2: connection-id and stuff
 // Octet3: length of payload (in bytes)
@@ -43,6 +48,8 @@
 
 #define HAL_QUEUE_MAX \
   8 /* max. # of messages enqueued before going into blocking mode */
+#define HAL_QUEUE_DATA_MAX \
+  (HAL_QUEUE_MAX / 2) /* ring slots for the segments of data messages */
 
 /* thread messages  */
 #define MSG_EXIT_REQUEST 0 /* worker thread should terminate itself */
@@ -52,10 +59,25 @@
 // HAL _WRAPPER
 #define MSG_TX_DATA_TIMER_START 3
 #define MSG_TIMER_START 4
+#define MSG_TX_FLUSH 5   /* drop the frames not sent yet, NFCC reset */
+#define MSG_TX_DROPPED 6 /* MSG_TX_DATA posted before a MSG_TX_FLUSH */
 
 /* number of buffers used for incoming & outgoing data */
 #define NUM_BUFFERS 10
 
+/* NCI data flow control */
+#define NCI_MAX_CONN 16            /* connection ids 0..15 */
+#define NCI_CREDITS_UNLIMITED 0xFF /* flow control disabled by the NFCC */
+#define HAL_CREDIT_HOLD_MAX (NUM_BUFFERS / 2) /* buffers for data packets */
+#define HAL_CMD_RSP_TIMEOUT 1000 /* ms, then the next command goes anyway */
+
+/* command response times, see HalRttTimeout() */
+#define HAL_RTT_OPCODES 32        /* commands tracked */
+#define HAL_RTT_BUCKETS 96        /* 4 per power of 2 microseconds */
+#define HAL_RTT_MIN_SAMPLES 32    /* before a timeout is derived */
+#define HAL_RTT_TIMEOUT_MIN 20    /* ms */
+#define HAL_RTT_SHADOW_FACTOR 4   /* for the late count when disabled */
+
 /* constants for the return value of osWait */
 #define OS_SYNC_INFINITE 0xffffffffu
 #define OS_SYNC_RELEASED 0
@@ -69,9 +91,18 @@
 typedef struct tagHalBuffer {
   uint8_t data[MAX_BUFFER_SIZE];
   size_t length;
+  struct timespec queued; /* when it entered the TX queues */
+  uint32_t timerMs;       /* wrapper timer to start once sent, 0 if none */
+  bool dataPacket;        /* holds one of the HAL_CREDIT_HOLD_MAX */
   struct tagHalBuffer* next;
 } HalBuffer;
 
+typedef struct tagHalTxQueue {
+  HalBuffer* head;
+  HalBuffer* tail;
+  uint32_t count;
+} HalTxQueue;
+
 typedef struct tagThreadMessage {
   uint32_t command;    /* message type / command */
   const void* payload; /* ptr to message related data item */
@@ -92,6 +123,21 @@ typedef struct tagTimer {
   bool active;               /* true if timer is currently active */
 } Timer;
 
+typedef struct tagHalRxMessage {
+  uint8_t* data;    /* header and payload of the segments so far */
+  size_t length;    /* 0 if no segment was received */
+  size_t size;      /* allocated */
+  uint32_t packets; /* segments received */
+  bool dropping;    /* skip the segments left of a dropped message */
+} HalRxMessage;
+
+typedef struct tagHalConn {
+  bool tracked;     /* credits learned from the NFCC */
+  uint8_t credits;  /* credits left */
+  HalTxQueue queue; /* data packets waiting for a credit */
+  HalRxMessage rx;  /* data message being reassembled */
+} HalConn;
+
 typedef struct tagHalInstance {
   uint32_t flags;
 
@@ -103,6 +149,9 @@ typedef struct tagHalInstance {
   Timer timer;
 
   /* threading and runtime support */
+  bool singleLoop;      /* HAL_FLAG_SINGLE_LOOP: no worker thread */
+  int eventFd;          /* HAL_FLAG_SINGLE_LOOP: signaled on new messages */
+  bool loopThreadSetup; /* HAL_FLAG_SINGLE_LOOP: sHalThread is the caller */
   bool exitRequest;
   sem_t semaphore;
   pthread_t thread;
@@ -111,9 +160,10 @@ typedef struct tagHalInstance {
   /* IOBuffers for read/writes */
   HalBuffer* bufferData;
   HalBuffer* freeBufferList;
-  HalBuffer* pendingNciList; /* outgoing packages waiting to be processed */
   HalBuffer* nciBuffer;      /* current buffer in progress */
   sem_t bufferResourceSem;
+  sem_t dataBufferSem; /* data packets leave the other buffers to commands */
+  sem_t dataRingSem;   /* and ring slots to RX frames, see HAL_QUEUE_DATA_MAX */
 
   sem_t upstreamBlock;
 
@@ -126,9 +176,27 @@ typedef struct tagHalInstance {
   uint8_t lastDsFrame[MAX_BUFFER_SIZE];
   size_t lastDsFrameSize;
 
-  /* current frame from CLF */
+  /* current message from CLF, lastUsFrame or a reassembly */
   uint8_t lastUsFrame[MAX_BUFFER_SIZE];
   size_t lastUsFrameSize;
+  const uint8_t* usMessage;
+  size_t usMessageSize;
+
+  /* STNFC_NCI_REASSEMBLY */
+  unsigned long rxReassembly;
+
+  /* TX scheduler, see HalTriggerNextDsPacket() */
+  HalTxQueue urgentQueue;   /* RF_DEACTIVATE_CMD and presence check */
+  HalTxQueue cmdQueue;      /* other control messages */
+  HalTxQueue* cmdSegments;  /* queue of a command sent in part, or NULL */
+  bool cmdOutstanding;      /* waiting for the response of a command */
+  struct timespec cmdSentAt;
+  uint32_t cmdKey;          /* HalRttKey() of the outstanding command */
+  uint32_t timerCmdKey;     /* command the timer was started for, or 0 */
+  uint32_t timerCeilingMs;  /* timeout the wrapper asked for */
+  unsigned long rttFactor;  /* STNFC_ADAPTIVE_TIMEOUT */
+  HalConn conn[NCI_MAX_CONN];
+  uint8_t closingConn; /* CORE_CONN_CLOSE_CMD sent for it, 0 if none */
 
 } HalInstance;
 
@@ -21,9 +21,13 @@
 #include <errno.h>
 #include <hardware/nfc.h>
 #include <log/log.h>
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <atomic>
+
 #include "android_logmsg.h"
 #include "hal_event_logger.h"
 #include "hal_fd.h"
@@ -36,10 +40,11 @@ extern void HalCoreCallback(void* context, uint32_t event, const void* d,
 extern bool I2cOpenLayer(void* dev, HAL_CALLBACK callb, HALHANDLE* pHandle);
 extern void I2cCloseLayer();
 extern void I2cRecovery();
+extern void I2cDump(int fd);
 
 static void halWrapperDataCallback(uint16_t data_len, uint8_t* p_data);
 static void halWrapperCallback(uint8_t event, uint8_t event_status);
-static std::string hal_wrapper_state_to_str(uint16_t event);
+static const char* hal_wrapper_state_to_str(uint16_t event);
 
 nfc_stack_callback_t* mHalWrapperCallback = NULL;
 nfc_stack_data_callback_t* mHalWrapperDataCallback = NULL;
@@ -69,14 +74,30 @@ static uint8_t nciAndroidPassiveObserver[256];
 static bool isDebuggable;
 
 bool mReadFwConfigDone = false;
+// hal_wrapper_close() waits for the answer to PROP_NFC_MODE_SET_CMD, the
+// downstream timer (100 ms) normally fires before this bound.
+#define HAL_CLOSE_TIMEOUT_MS 150
+static pthread_mutex_t sCloseMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sCloseCond = PTHREAD_COND_INITIALIZER;
+static bool sCloseDone = false;
+static struct {
+  uint32_t count;
+  uint32_t timeouts;
+  uint64_t lastUs;
+  uint64_t sumUs;
+  uint64_t maxUs;
+} sCloseStats;
+static pthread_mutex_t sFdInitMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t sFdInitThread;
+static bool sFdInitPending = false;
 
-bool mHciCreditLent = false;
 bool mfactoryReset = false;
 bool ready_flag = 0;
 bool mTimerStarted = false;
 bool mFieldInfoTimerStarted = false;
 bool forceRecover = false;
-unsigned long hal_field_timer = 0;
+// also written by halWrapperConfigChanged() from the config watcher thread
+std::atomic_ulong hal_field_timer(0);
 
 static bool sEnableFwLog = false;
 uint8_t mObserverMode = 0;
@@ -85,12 +106,212 @@ bool mPerTechCmdRsp = false;
 bool storedLog = false;
 bool mObserveModeSuspended = false;
 
+// settings read while processing CLF frames, resolved at open
+static int sKeyRemoteFieldTimer = -1;
+static int sKeyFwDebugEnabled = -1;
+static int sKeyFwSwpLogSize = -1;
+static int sKeyFwRfLogSize = -1;
+static int sKeyControlClk = -1;
+
+static void halWrapperConfigChanged() {
+  unsigned long fieldTimer = 0;
+
+  if (GetNumValueByKey(sKeyRemoteFieldTimer, &fieldTimer,
+                       sizeof(fieldTimer))) {
+    hal_field_timer = fieldTimer;
+    STLOG_HAL_D("%s - hal_field_timer = %lu", __func__, fieldTimer);
+  }
+}
+
+// Boot timeline: wrapper state transitions from hal_wrapper_open() to the
+// first HAL_WRAPPER_STATE_READY, reported in the event log and the dump.
+#define HAL_TIMELINE_SIZE 48
+#define HAL_TIMELINE_FRAME_LEN 8
+
+typedef enum {
+  HAL_TIMELINE_CALL,     // state set by the NFC stack or the HAL itself
+  HAL_TIMELINE_RX,       // state set on an NCI frame from the CLF
+  HAL_TIMELINE_TIMEOUT,  // state set on a timer expiry
+  HAL_TIMELINE_WAIT,     // wait_ready() returned
+  HAL_TIMELINE_FD_INIT,  // hal_fd_init() joined
+} hal_timeline_cause_e;
+
+typedef struct {
+  uint64_t timeUs;   // since hal_wrapper_open()
+  uint64_t valueUs;  // RX: CLF response latency, WAIT/FD_INIT: time blocked
+  uint8_t cause;
+  uint8_t from;
+  uint8_t to;
+  uint8_t frameLen;
+  uint8_t frame[HAL_TIMELINE_FRAME_LEN];
+} HalTimelineEntry;
+
+static pthread_mutex_t sTimelineMutex = PTHREAD_MUTEX_INITIALIZER;
+static HalTimelineEntry sTimeline[HAL_TIMELINE_SIZE];
+static int sTimelineCount = 0;
+static bool sTimelineActive = false;
+static uint64_t sTimelineStartUs = 0;
+static uint64_t sTimelineLastTxUs = 0;  // last frame written to the CLF
+// what the calling thread is processing, set by the HAL callbacks
+static thread_local uint8_t sTimelineCause = HAL_TIMELINE_CALL;
+static thread_local const uint8_t* sTimelineFrame = NULL;
+static thread_local uint16_t sTimelineFrameLen = 0;
+static thread_local uint64_t sTimelineRxUs = 0;
+
+static uint64_t halWrapperNowUs() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static const char* halWrapperStateName(uint8_t state) {
+  const char* name = hal_wrapper_state_to_str(state);
+  const char* prefix = "HAL_WRAPPER_STATE_";
+
+  if (!strncmp(name, prefix, strlen(prefix))) name += strlen(prefix);
+  return name;
+}
+
+static void halWrapperTimelineStart() {
+  pthread_mutex_lock(&sTimelineMutex);
+  sTimelineCount = 0;
+  sTimelineActive = true;
+  sTimelineStartUs = halWrapperNowUs();
+  sTimelineLastTxUs = 0;
+  pthread_mutex_unlock(&sTimelineMutex);
+}
+
+static void halWrapperTimelineReport() {
+  uint64_t phaseStartUs = 0;
+  uint64_t waitUs = 0;
+  uint8_t phase = HAL_WRAPPER_STATE_CLOSED;
+
+  pthread_mutex_lock(&sTimelineMutex);
+  for (int i = 0; i < sTimelineCount; i++) {
+    HalTimelineEntry* e = &sTimeline[i];
+    if (e->cause == HAL_TIMELINE_WAIT) {
+      waitUs += e->valueUs;
+      continue;
+    } else if (e->cause == HAL_TIMELINE_FD_INIT) {
+      continue;
+    }
+    STLOG_HAL_D("%s - %s: %llu us", __func__, halWrapperStateName(phase),
+                (unsigned long long)(e->timeUs - phaseStartUs));
+    HAL_EVENT_LOG() << "Boot timeline " << halWrapperStateName(phase) << ": "
+                    << (e->timeUs - phaseStartUs) << " us" << std::endl;
+    phase = e->to;
+    phaseStartUs = e->timeUs;
+  }
+  STLOG_HAL_D("%s - open to READY: %llu us, wait_ready: %llu us", __func__,
+              (unsigned long long)phaseStartUs, (unsigned long long)waitUs);
+  HAL_EVENT_LOG() << "Boot timeline open to READY: " << phaseStartUs
+                  << " us, wait_ready: " << waitUs << " us" << std::endl;
+  pthread_mutex_unlock(&sTimelineMutex);
+}
+
+static void halWrapperTimelineAdd(uint8_t cause, uint8_t from, uint8_t to,
+                                  uint64_t waitUs) {
+  bool report = false;
+
+  pthread_mutex_lock(&sTimelineMutex);
+  if (sTimelineActive && (sTimelineCount < HAL_TIMELINE_SIZE)) {
+    HalTimelineEntry* e = &sTimeline[sTimelineCount++];
+    e->timeUs = halWrapperNowUs() - sTimelineStartUs;
+    e->valueUs = waitUs;
+    e->cause = cause;
+    e->from = from;
+    e->to = to;
+    e->frameLen = 0;
+    if ((cause == HAL_TIMELINE_RX) && sTimelineFrame) {
+      e->frameLen = sTimelineFrameLen < HAL_TIMELINE_FRAME_LEN
+                        ? sTimelineFrameLen
+                        : HAL_TIMELINE_FRAME_LEN;
+      memcpy(e->frame, sTimelineFrame, e->frameLen);
+      if (sTimelineLastTxUs && (sTimelineRxUs >= sTimelineLastTxUs)) {
+        e->valueUs = sTimelineRxUs - sTimelineLastTxUs;
+      }
+    }
+    if ((from != to) && (to == HAL_WRAPPER_STATE_READY)) {
+      sTimelineActive = false;
+      report = true;
+    }
+  }
+  pthread_mutex_unlock(&sTimelineMutex);
+
+  if (report) halWrapperTimelineReport();
+}
+
+static void halWrapperTimelineDump(int fd) {
+  uint64_t phaseStartUs = 0;
+  char frame[3 * HAL_TIMELINE_FRAME_LEN + 1];
+
+  pthread_mutex_lock(&sTimelineMutex);
+  dprintf(fd, "===== Nfc HAL Boot Timeline =====\n");
+  for (int i = 0; i < sTimelineCount; i++) {
+    HalTimelineEntry* e = &sTimeline[i];
+    if ((e->cause == HAL_TIMELINE_WAIT) ||
+        (e->cause == HAL_TIMELINE_FD_INIT)) {
+      dprintf(fd, "%10.3f ms  %s %s %.3f ms\n", e->timeUs / 1000.0,
+              halWrapperStateName(e->to),
+              e->cause == HAL_TIMELINE_WAIT ? "wait_ready" : "hal_fd_init join",
+              e->valueUs / 1000.0);
+      continue;
+    }
+    frame[0] = '\0';
+    for (int j = 0; j < e->frameLen; j++) {
+      snprintf(frame + 3 * j, sizeof(frame) - 3 * j, " %02x", e->frame[j]);
+    }
+    dprintf(fd, "%10.3f ms  %s -> %s after %.3f ms", e->timeUs / 1000.0,
+            halWrapperStateName(e->from), halWrapperStateName(e->to),
+            (e->timeUs - phaseStartUs) / 1000.0);
+    if (e->cause == HAL_TIMELINE_RX) {
+      dprintf(fd, ", rx%s", frame);
+      if (e->valueUs) dprintf(fd, ", rsp %.3f ms", e->valueUs / 1000.0);
+    } else if (e->cause == HAL_TIMELINE_TIMEOUT) {
+      dprintf(fd, ", timeout");
+    }
+    dprintf(fd, "\n");
+    phaseStartUs = e->timeUs;
+  }
+  if (sTimelineActive) dprintf(fd, "(READY not reached yet)\n");
+  dprintf(fd, "===== Nfc HAL Boot Timeline =====\n");
+  pthread_mutex_unlock(&sTimelineMutex);
+}
+
+/*******************************************************************************
+ **
+ ** Function         hal_wrapper_frame_sent
+ **
+ ** Description      Note that a frame was written to the CLF, to measure the
+ **                  response latency in the boot timeline.
+ **
+ ** Returns          void
+ **
+ *******************************************************************************/
+void hal_wrapper_frame_sent() {
+  pthread_mutex_lock(&sTimelineMutex);
+  if (sTimelineActive) sTimelineLastTxUs = halWrapperNowUs();
+  pthread_mutex_unlock(&sTimelineMutex);
+}
+
+static void halWrapperSetState(hal_wrapper_state_e new_wrapper_state) {
+  halWrapperTimelineAdd(sTimelineCause, mHalWrapperState, new_wrapper_state,
+                        0);
+  mHalWrapperState = new_wrapper_state;
+}
+
 void wait_ready() {
+  uint64_t start = halWrapperNowUs();
+
   pthread_mutex_lock(&mutex);
   while (!ready_flag) {
     pthread_cond_wait(&ready_cond, &mutex);
   }
   pthread_mutex_unlock(&mutex);
+
+  halWrapperTimelineAdd(HAL_TIMELINE_WAIT, mHalWrapperState, mHalWrapperState,
+                        halWrapperNowUs() - start);
 }
 
 void set_ready(bool ready) {
@@ -100,6 +321,55 @@ void set_ready(bool ready) {
   pthread_mutex_unlock(&mutex);
 }
 
+/*******************************************************************************
+ **
+ ** Function         halWrapperFdInitStart
+ **
+ ** Description      Run hal_fd_init() (FW and custom param files, UWB param
+ **                  library) on its own thread, while the CLF boots after the
+ **                  reset done by I2cOpenLayer().
+ **
+ ** Returns          void
+ **
+ *******************************************************************************/
+static void* halWrapperFdInitThread(__attribute__((unused)) void* arg) {
+  mFwUpdateResMask = hal_fd_init();
+  return NULL;
+}
+
+static void halWrapperFdInitStart() {
+  if (pthread_create(&sFdInitThread, NULL, halWrapperFdInitThread, NULL) ==
+      0) {
+    sFdInitPending = true;
+  } else {
+    STLOG_HAL_W("%s - pthread_create failed, init inline", __func__);
+    mFwUpdateResMask = hal_fd_init();
+  }
+}
+
+/*******************************************************************************
+ **
+ ** Function         halWrapperFdInitJoin
+ **
+ ** Description      Wait for hal_fd_init() to complete, before the FW info or
+ **                  mFwUpdateResMask are used.
+ **
+ ** Returns          void
+ **
+ *******************************************************************************/
+static void halWrapperFdInitJoin() {
+  uint64_t start = halWrapperNowUs();
+
+  pthread_mutex_lock(&sFdInitMutex);
+  if (sFdInitPending) {
+    pthread_join(sFdInitThread, NULL);
+    sFdInitPending = false;
+    halWrapperTimelineAdd(HAL_TIMELINE_FD_INIT, mHalWrapperState,
+                          mHalWrapperState, halWrapperNowUs() - start);
+  }
+  pthread_mutex_unlock(&sFdInitMutex);
+}
+
 bool hal_wrapper_open(st21nfc_dev_t* dev, nfc_stack_callback_t* p_cback,
                       nfc_stack_data_callback_t* p_data_cback,
                       HALHANDLE* pHandle) {
@@ -107,12 +377,27 @@ bool hal_wrapper_open(st21nfc_dev_t* dev, nfc_stack_callback_t* p_cback,
 
   STLOG_HAL_D("%s", __func__);
 
-  mFwUpdateResMask = hal_fd_init();
+  halWrapperTimelineStart();
+
+  // Setting keys of the wrapper, resolved once for the reloads to come.
+  sKeyRemoteFieldTimer = GetConfigKey(NAME_STNFC_REMOTE_FIELD_TIMER);
+  sKeyFwDebugEnabled = GetConfigKey(NAME_STNFC_FW_DEBUG_ENABLED);
+  sKeyFwSwpLogSize = GetConfigKey(NAME_STNFC_FW_SWP_LOG_SIZE);
+  sKeyFwRfLogSize = GetConfigKey(NAME_STNFC_FW_RF_LOG_SIZE);
+  sKeyControlClk = GetConfigKey(NAME_STNFC_CONTROL_CLK);
+  RegisterConfigListener(halWrapperConfigChanged);
+  StartConfigWatcher();
+
+  // Set up the event logger before the hal_fd_init() thread is created, so
+  // that the logs of any thread started from here see it configured.
+  HalEventLogger::getInstance().initialize();
+  HAL_EVENT_LOG() << __func__ << std::endl;
+
+  halWrapperFdInitStart();
   mRetryFwDwl = 5;
   mFwUpdateTaskMask = 0;
 
-  mHalWrapperState = HAL_WRAPPER_STATE_OPEN;
-  mHciCreditLent = false;
+  halWrapperSetState(HAL_WRAPPER_STATE_OPEN);
   mReadFwConfigDone = false;
   mError_count = 0;
 
@@ -129,34 +414,149 @@ bool hal_wrapper_open(st21nfc_dev_t* dev, nfc_stack_callback_t* p_cback,
   result = I2cOpenLayer(dev, HalCoreCallback, pHandle);
 
   if (!result || !(*pHandle)) {
+    halWrapperFdInitJoin();
     return -1;  // We are doomed, stop it here, NOW !
   }
 
   isDebuggable = property_get_int32("ro.debuggable", 0);
   mHalHandle = *pHandle;
 
-  HalEventLogger::getInstance().initialize();
-  HalEventLogger::getInstance().log() << __func__ << std::endl;
   HalSendDownstreamTimer(mHalHandle, 10000);
 
   return 1;
 }
 
+/*******************************************************************************
+ **
+ ** Function         halWrapperCloseDone
+ **
+ ** Description      Wake up hal_wrapper_close(), the CLF answered
+ **                  PROP_NFC_MODE_SET_CMD or its timer expired.
+ **
+ ** Returns          void
+ **
+ *******************************************************************************/
+static void halWrapperCloseDone() {
+  pthread_mutex_lock(&sCloseMutex);
+  sCloseDone = true;
+  pthread_cond_signal(&sCloseCond);
+  pthread_mutex_unlock(&sCloseMutex);
+}
+
+/*******************************************************************************
+ **
+ ** Function         halWrapperCloseWait
+ **
+ ** Description      Wait for halWrapperCloseDone(), at most
+ **                  HAL_CLOSE_TIMEOUT_MS, and account the close latency.
+ **
+ ** Returns          void
+ **
+ *******************************************************************************/
+static void halWrapperCloseWait(uint64_t start) {
+  struct timespec tm;
+  uint64_t latency;
+  long oneSecInNs = (int)1e9;
+  bool done;
+
+  clock_gettime(CLOCK_REALTIME, &tm);
+  tm.tv_sec += HAL_CLOSE_TIMEOUT_MS / 1000;
+  tm.tv_nsec += (HAL_CLOSE_TIMEOUT_MS % 1000) * 1000000;
+  if (tm.tv_nsec >= oneSecInNs) {
+    tm.tv_sec++;
+    tm.tv_nsec -= oneSecInNs;
+  }
+
+  pthread_mutex_lock(&sCloseMutex);
+  while (!sCloseDone) {
+    if (pthread_cond_timedwait(&sCloseCond, &sCloseMutex, &tm) == ETIMEDOUT) {
+      break;
+    }
+  }
+  done = sCloseDone;
+  latency = halWrapperNowUs() - start;
+  sCloseStats.count++;
+  sCloseStats.lastUs = latency;
+  sCloseStats.sumUs += latency;
+  if (latency > sCloseStats.maxUs) sCloseStats.maxUs = latency;
+  if (!done) sCloseStats.timeouts++;
+  pthread_mutex_unlock(&sCloseMutex);
+
+  if (!done) {
+    STLOG_HAL_W("%s - no answer from the CLF after %d ms, close anyway",
+                __func__, HAL_CLOSE_TIMEOUT_MS);
+  } else {
+    STLOG_HAL_D("%s - CLF answered in %llu us", __func__,
+                (unsigned long long)latency);
+  }
+}
+
+/*******************************************************************************
+ **
+ ** Function         hal_wrapper_power_cycle
+ **
+ ** Description      Warm reset of the CLF: pulse its reset and run the same
+ **                  CORE_RESET_NTF handshake as hal_wrapper_open(), which
+ **                  reports HAL_NFC_OPEN_CPLT_EVT. The I2C and HAL threads,
+ **                  the configuration and the FW files stay as they are.
+ **
+ ** Returns          true if the reset was started, false if not open.
+ **
+ *******************************************************************************/
+bool hal_wrapper_power_cycle() {
+  STLOG_HAL_D("%s", __func__);
+
+  if (mHalHandle == NULL) return false;
+
+  halWrapperFdInitJoin();
+  HalSendDownstreamStopTimer(mHalHandle);
+  halWrapperTimelineStart();
+  hal_fd_power_cycle();
+  mRetryFwDwl = 5;
+  mFwUpdateTaskMask = 0;
+
+  halWrapperSetState(HAL_WRAPPER_STATE_OPEN);
+  mReadFwConfigDone = false;
+  mError_count = 0;
+  mIsActiveRW = false;
+  mTimerStarted = false;
+  mFieldInfoTimerStarted = false;
+
+  mObserverMode = 0;
+  mObserverRsp = false;
+  mObserveModeSuspended = false;
+
+  HAL_EVENT_LOG() << __func__ << std::endl;
+  // the stack commands still queued were meant for the CLF before its reset
+  HalFlushDownstream(mHalHandle);
+  I2cResetPulse();
+  HalSendDownstreamTimer(mHalHandle, 10000);
+
+  return true;
+}
+
 int hal_wrapper_close(int call_cb, int nfc_mode) {
   STLOG_HAL_V("%s - Sending PROP_NFC_MODE_SET_CMD(%d)", __func__, nfc_mode);
   uint8_t propNfcModeSetCmdQb[] = {0x2f, 0x02, 0x02, 0x02, (uint8_t)nfc_mode};
 
-  mHalWrapperState = HAL_WRAPPER_STATE_CLOSING;
-  HalEventLogger::getInstance().log() << __func__ << std::endl;
+  uint64_t start;
+
+  halWrapperFdInitJoin();
+  pthread_mutex_lock(&sCloseMutex);
+  sCloseDone = false;
+  pthread_mutex_unlock(&sCloseMutex);
+  halWrapperSetState(HAL_WRAPPER_STATE_CLOSING);
+  HAL_EVENT_LOG() << __func__ << std::endl;
 
   // Send PROP_NFC_MODE_SET_CMD
+  start = halWrapperNowUs();
   if (!HalSendDownstreamTimer(mHalHandle, propNfcModeSetCmdQb,
                               sizeof(propNfcModeSetCmdQb), 100)) {
     STLOG_HAL_E("NFC-NCI HAL: %s  HalSendDownstreamTimer failed", __func__);
     return -1;
   }
   // Let the CLF receive and process this
-  usleep(50000);
+  halWrapperCloseWait(start);
 
   I2cCloseLayer();
   if (call_cb) mHalWrapperCallback(HAL_NFC_CLOSE_CPLT_EVT, HAL_NFC_STATUS_OK);
@@ -178,7 +578,7 @@ void hal_wrapper_send_core_config_prop() {
       STLOG_HAL_V("%s - Enter", __func__);
       set_ready(0);
 
-      HalEventLogger::getInstance().log() << __func__ << std::endl;
+      HAL_EVENT_LOG() << __func__ << std::endl;
       if (!HalSendDownstreamTimer(mHalHandle, ConfigBuffer, retlen, 1000)) {
         STLOG_HAL_E("NFC-NCI HAL: %s  SendDownstream failed", __func__);
       }
@@ -192,9 +592,9 @@ void hal_wrapper_send_core_config_prop() {
 void hal_wrapper_send_vs_config() {
   STLOG_HAL_V("%s - Enter", __func__);
   set_ready(0);
-  mHalWrapperState = HAL_WRAPPER_STATE_PROP_CONFIG;
+  halWrapperSetState(HAL_WRAPPER_STATE_PROP_CONFIG);
   mReadFwConfigDone = true;
-  HalEventLogger::getInstance().log() << __func__ << std::endl;
+  HAL_EVENT_LOG() << __func__ << std::endl;
   if (!HalSendDownstreamTimer(mHalHandle, nciPropGetFwDbgTracesConfig,
                               sizeof(nciPropGetFwDbgTracesConfig), 1000)) {
     STLOG_HAL_E("%s - SendDownstream failed", __func__);
@@ -204,7 +604,7 @@ void hal_wrapper_send_vs_config() {
 
 void hal_wrapper_send_config() {
   hal_wrapper_send_vs_config();
-  mHalWrapperState = HAL_WRAPPER_STATE_PROP_CONFIG;
+  halWrapperSetState(HAL_WRAPPER_STATE_PROP_CONFIG);
   hal_wrapper_send_core_config_prop();
 }
 
@@ -224,7 +624,7 @@ void hal_wrapper_get_observer_mode() { mObserverRsp = true; }
 void hal_wrapper_update_complete() {
   STLOG_HAL_V("%s ", __func__);
   mHalWrapperCallback(HAL_NFC_OPEN_CPLT_EVT, HAL_NFC_STATUS_OK);
-  mHalWrapperState = HAL_WRAPPER_STATE_OPEN_CPLT;
+  halWrapperSetState(HAL_WRAPPER_STATE_OPEN_CPLT);
 }
 void halWrapperDataCallback(uint16_t data_len, uint8_t* p_data) {
   uint8_t propNfcModeSetCmdOn[] = {0x2f, 0x02, 0x02, 0x02, 0x01};
@@ -236,6 +636,11 @@ void halWrapperDataCallback(uint16_t data_len, uint8_t* p_data) {
   int mObserverLength = 0;
   int nciPropEnableFwDbgTraces_size = sizeof(nciPropEnableFwDbgTraces);
 
+  sTimelineCause = HAL_TIMELINE_RX;
+  sTimelineFrame = p_data;
+  sTimelineFrameLen = data_len;
+  sTimelineRxUs = halWrapperNowUs();
+
   if (mObserverMode && (p_data[0] == 0x6f) && (p_data[1] == 0x02)) {
     // Firmware logs must not be formatted before sending to upper layer.
     if ((mObserverLength = notifyPollingLoopFrames(
@@ -258,6 +663,7 @@ void halWrapperDataCallback(uint16_t data_len, uint8_t* p_data) {
 
       if ((p_data[0] == 0x60) && (p_data[1] == 0x00)) {
         mIsActiveRW = false;
+        halWrapperFdInitJoin();
         mFwUpdateTaskMask = ft_cmd_HwReset(p_data, &mClfMode);
 
         if (mfactoryReset == true) {
@@ -285,14 +691,14 @@ void halWrapperDataCallback(uint16_t data_len, uint8_t* p_data) {
             mHalWrapperCallback(HAL_NFC_OPEN_CPLT_EVT, HAL_NFC_STATUS_FAILED);
             I2cCloseLayer();
           } else {
-            mHalWrapperState = HAL_WRAPPER_STATE_UPDATE;
+            halWrapperSetState(HAL_WRAPPER_STATE_UPDATE);
             if (((p_data[3] == 0x01) && (p_data[8] == HW_ST54L)) ||
                 ((p_data[2] == 0x41) && (p_data[3] == 0xA2))) {  // ST54L
               FwUpdateHandler(mHalHandle, data_len, p_data);
             } else {
               STLOG_HAL_V("%s - Send APDU_GET_ATR_CMD", __func__);
               mRetryFwDwl--;
-              HalEventLogger::getInstance().log()
+              HAL_EVENT_LOG()
                   << __func__ << " Send APDU_GET_ATR_CMD" << std::endl;
               if (!HalSendDownstreamTimer(mHalHandle, ApduGetAtr,
                                           sizeof(ApduGetAtr),
@@ -306,7 +712,7 @@ void halWrapperDataCallback(uint16_t data_len, uint8_t* p_data) {
           if (p_data[3] == 0x01) {
             // Normal mode, start HAL
             mHalWrapperCallback(HAL_NFC_OPEN_CPLT_EVT, HAL_NFC_STATUS_OK);
-            mHalWrapperState = HAL_WRAPPER_STATE_OPEN_CPLT;
+            halWrapperSetState(HAL_WRAPPER_STATE_OPEN_CPLT);
           } else {
             // No more retries or CLF not in correct mode
             mHalWrapperCallback(HAL_NFC_OPEN_CPLT_EVT, HAL_NFC_STATUS_FAILED);
@@ -324,21 +730,21 @@ void halWrapperDataCallback(uint16_t data_len, uint8_t* p_data) {
                                    sizeof(coreResetCmd))) {
               STLOG_HAL_E("%s - SendDownstream failed", __func__);
             }
-            mHalWrapperState = HAL_WRAPPER_STATE_EXIT_HIBERNATE_INTERNAL;
+            halWrapperSetState(HAL_WRAPPER_STATE_EXIT_HIBERNATE_INTERNAL);
           } else if ((mFwUpdateTaskMask & CONF_UPDATE_NEEDED) &&
                      (mFwUpdateResMask & FW_CUSTOM_PARAM_AVAILABLE)) {
             if (!HalSendDownstream(mHalHandle, coreResetCmd,
                                    sizeof(coreResetCmd))) {
               STLOG_HAL_E("%s - SendDownstream failed", __func__);
             }
-            mHalWrapperState = HAL_WRAPPER_STATE_APPLY_CUSTOM_PARAM;
+            halWrapperSetState(HAL_WRAPPER_STATE_APPLY_CUSTOM_PARAM);
           } else if ((mFwUpdateTaskMask & UWB_CONF_UPDATE_NEEDED) &&
                      (mFwUpdateResMask & FW_UWB_PARAM_AVAILABLE)) {
             if (!HalSendDownstream(mHalHandle, coreResetCmd,
                                    sizeof(coreResetCmd))) {
               STLOG_HAL_E("%s - SendDownstream failed", __func__);
             }
-            mHalWrapperState = HAL_WRAPPER_STATE_APPLY_UWB_PARAM;
+            halWrapperSetState(HAL_WRAPPER_STATE_APPLY_UWB_PARAM);
           }
         }
       } else {
@@ -353,8 +759,8 @@ void halWrapperDataCallback(uint16_t data_len, uint8_t* p_data) {
       } else if ((p_data[0] == 0x60) && (p_data[1] == 0x06)) {
         STLOG_HAL_V("%s - Sending PROP_NFC_MODE_SET_CMD", __func__);
         // Send PROP_NFC_MODE_SET_CMD(ON)
-        mHalWrapperState = HAL_WRAPPER_STATE_NFC_ENABLE_ON;
-        HalEventLogger::getInstance().log()
+        halWrapperSetState(HAL_WRAPPER_STATE_NFC_ENABLE_ON);
+        HAL_EVENT_LOG()
             << __func__ << " Sending PROP_NFC_MODE_SET_CMD" << std::endl;
         if (!HalSendDownstreamTimer(mHalHandle, propNfcModeSetCmdOn,
                                     sizeof(propNfcModeSetCmdOn), 500)) {
@@ -392,14 +798,7 @@ void halWrapperDataCallback(uint16_t data_len, uint8_t* p_data) {
       // CORE_INIT_RSP
       else if ((p_data[0] == 0x40) && (p_data[1] == 0x01)) {
         STLOG_HAL_D("%s - NFC mode enabled", __func__);
-        // Do we need to lend a credit ?
-        if (p_data[13] == 0x00) {
-          STLOG_HAL_D("%s - 1 credit lent", __func__);
-          p_data[13] = 0x01;
-          mHciCreditLent = true;
-        }
-
-        mHalWrapperState = HAL_WRAPPER_STATE_READY;
+        halWrapperSetState(HAL_WRAPPER_STATE_READY);
         mHalWrapperDataCallback(data_len, p_data);
       }
       break;
@@ -410,28 +809,13 @@ void halWrapperDataCallback(uint16_t data_len, uint8_t* p_data) {
       // CORE_SET_CONFIG_RSP
       if ((p_data[0] == 0x40) && (p_data[1] == 0x02)) {
         HalSendDownstreamStopTimer(mHalHandle);
-        GetNumValue(NAME_STNFC_REMOTE_FIELD_TIMER, &hal_field_timer,
-                    sizeof(hal_field_timer));
-        STLOG_HAL_D("%s - hal_field_timer = %lu", __func__, hal_field_timer);
+        halWrapperConfigChanged();
         set_ready(1);
         // Exit state, all processing done
         mHalWrapperCallback(HAL_NFC_POST_INIT_CPLT_EVT, HAL_NFC_STATUS_OK);
-        mHalWrapperState = HAL_WRAPPER_STATE_READY;
-      } else if (mHciCreditLent && (p_data[0] == 0x60) && (p_data[1] == 0x06)) {
-        // CORE_CONN_CREDITS_NTF
-        if (p_data[4] == 0x01) {  // HCI connection
-          mHciCreditLent = false;
-          STLOG_HAL_D("%s - credit returned", __func__);
-          if (p_data[5] == 0x01) {
-            // no need to send this.
-            break;
-          } else {
-            if (p_data[5] != 0x00 && p_data[5] != 0xFF) {
-              // send with 1 less
-              p_data[5]--;
-            }
-          }
-        }
+        halWrapperSetState(HAL_WRAPPER_STATE_READY);
+      } else if ((p_data[0] == 0x60) && (p_data[1] == 0x06)) {
+        // CORE_CONN_CREDITS_NTF, the stack counts the credits like halcore
         mHalWrapperDataCallback(data_len, p_data);
       } else if (p_data[0] == 0x4f) {
         // PROP_RSP
@@ -445,7 +829,7 @@ void halWrapperDataCallback(uint16_t data_len, uint8_t* p_data) {
                 "persist.vendor.nfc.firmware_debug_enabled", 0);
 
             // Check if FW DBG shall be set
-            if (GetNumValue(NAME_STNFC_FW_DEBUG_ENABLED, &num, sizeof(num)) ||
+            if (GetNumValueByKey(sKeyFwDebugEnabled, &num, sizeof(num)) ||
                 isDebuggable || sEnableFwLog) {
               if (firmware_debug_enabled || sEnableFwLog) {
                 num = 1;
@@ -458,9 +842,8 @@ void halWrapperDataCallback(uint16_t data_len, uint8_t* p_data) {
               rf_log = 15;
 
               if (num == 1) {
-                GetNumValue(NAME_STNFC_FW_SWP_LOG_SIZE, &swp_log,
-                            sizeof(swp_log));
-                GetNumValue(NAME_STNFC_FW_RF_LOG_SIZE, &rf_log, sizeof(rf_log));
+                GetNumValueByKey(sKeyFwSwpLogSize, &swp_log, sizeof(swp_log));
+                GetNumValueByKey(sKeyFwRfLogSize, &rf_log, sizeof(rf_log));
               }
               // limit swp and rf payload length between 4 and 30.
               if (swp_log > 30)
@@ -523,7 +906,7 @@ void halWrapperDataCallback(uint16_t data_len, uint8_t* p_data) {
                                        nciPropEnableFwDbgTraces_size)) {
                   STLOG_HAL_E("%s - SendDownstream failed", __func__);
                 }
-                mHalWrapperState = HAL_WRAPPER_STATE_APPLY_PROP_CONFIG;
+                halWrapperSetState(HAL_WRAPPER_STATE_APPLY_PROP_CONFIG);
                 break;
               } else {
                 set_ready(1);
@@ -631,27 +1014,13 @@ void halWrapperDataCallback(uint16_t data_len, uint8_t* p_data) {
       }
 
       if (!((p_data[0] == 0x60) && (p_data[3] == 0xa0))) {
-        if (mHciCreditLent && (p_data[0] == 0x60) && (p_data[1] == 0x06)) {
-          if (p_data[4] == 0x01) {  // HCI connection
-            mHciCreditLent = false;
-            STLOG_HAL_D("%s - credit returned", __func__);
-            if (p_data[5] == 0x01) {
-              // no need to send this.
-              break;
-            } else {
-              if (p_data[5] != 0x00 && p_data[5] != 0xFF) {
-                // send with 1 less
-                p_data[5]--;
-              }
-            }
-          }
-        } else if ((p_data[0] == 0x61) && (p_data[1] == 0x07)) {
+        if ((p_data[0] == 0x61) && (p_data[1] == 0x07)) {
           // RF_FIELD_INFO_NTF
           if (p_data[3] == 0x01) {  // field on
             // start timer
             if (hal_field_timer) {
               mFieldInfoTimerStarted = true;
-              HalEventLogger::getInstance().log()
+              HAL_EVENT_LOG()
                   << __func__ << " LINE: " << __LINE__ << std::endl;
               HalSendDownstreamTimer(mHalHandle, 20000);
             }
@@ -704,7 +1073,7 @@ void halWrapperDataCallback(uint16_t data_len, uint8_t* p_data) {
                       p_data[3]);
           p_data[3] = 0x0;  // Only reset trigger that should be received in
                             // HAL_WRAPPER_STATE_READY is unreocoverable error.
-          mHalWrapperState = HAL_WRAPPER_STATE_RECOVERY;
+          halWrapperSetState(HAL_WRAPPER_STATE_RECOVERY);
         } else if (data_len >= 4 && p_data[0] == 0x60 && p_data[1] == 0x07) {
           if (p_data[3] == 0xE1) {
             // Core Generic Error - Buffer Overflow Ntf - Restart all
@@ -716,11 +1085,11 @@ void halWrapperDataCallback(uint16_t data_len, uint8_t* p_data) {
             p_data[4] = 0x00;
             p_data[5] = 0x00;
             data_len = 0x6;
-            mHalWrapperState = HAL_WRAPPER_STATE_RECOVERY;
+            halWrapperSetState(HAL_WRAPPER_STATE_RECOVERY);
           } else if (p_data[3] == 0xE6) {
             unsigned long hal_ctrl_clk = 0;
-            GetNumValue(NAME_STNFC_CONTROL_CLK, &hal_ctrl_clk,
-                        sizeof(hal_ctrl_clk));
+            GetNumValueByKey(sKeyControlClk, &hal_ctrl_clk,
+                             sizeof(hal_ctrl_clk));
             if (hal_ctrl_clk) {
               STLOG_HAL_E("%s - Clock Error - restart", __func__);
               // Core Generic Error
@@ -731,7 +1100,7 @@ void halWrapperDataCallback(uint16_t data_len, uint8_t* p_data) {
               p_data[4] = 0x00;
               p_data[5] = 0x00;
               data_len = 0x6;
-              mHalWrapperState = HAL_WRAPPER_STATE_RECOVERY;
+              halWrapperSetState(HAL_WRAPPER_STATE_RECOVERY);
             }
           } else if (p_data[3] == 0xA1) {
             if (mFieldInfoTimerStarted) {
@@ -752,7 +1121,8 @@ void halWrapperDataCallback(uint16_t data_len, uint8_t* p_data) {
       hal_fd_close();
       if ((p_data[0] == 0x4f) && (p_data[1] == 0x02)) {
         // intercept this expected message, don t forward.
-        mHalWrapperState = HAL_WRAPPER_STATE_CLOSED;
+        halWrapperSetState(HAL_WRAPPER_STATE_CLOSED);
+        halWrapperCloseDone();
       } else {
         mHalWrapperDataCallback(data_len, p_data);
       }
@@ -789,7 +1159,7 @@ void halWrapperDataCallback(uint16_t data_len, uint8_t* p_data) {
             __func__);
         // start timer
         mTimerStarted = true;
-        HalEventLogger::getInstance().log()
+        HAL_EVENT_LOG()
             << __func__ << " HAL_WRAPPER_STATE_SET_ACTIVERW_TIMER "
             << std::endl;
         HalSendDownstreamTimer(mHalHandle, 5000);
@@ -797,7 +1167,7 @@ void halWrapperDataCallback(uint16_t data_len, uint8_t* p_data) {
         // at screen off state.
       }
       (void)pthread_mutex_unlock(&mutex_activerw);
-      mHalWrapperState = HAL_WRAPPER_STATE_READY;
+      halWrapperSetState(HAL_WRAPPER_STATE_READY);
       mHalWrapperDataCallback(data_len, p_data);
       break;
 
@@ -823,6 +1193,8 @@ void halWrapperDataCallback(uint16_t data_len, uint8_t* p_data) {
                   __func__);
       break;
   }
+
+  sTimelineFrame = NULL;
 }
 
 static void halWrapperCallback(uint8_t event,
@@ -832,13 +1204,17 @@ static void halWrapperCallback(uint8_t event,
   uint8_t p_data[6];
   uint16_t data_len;
 
+  sTimelineCause = (event == HAL_WRAPPER_TIMEOUT_EVT) ? HAL_TIMELINE_TIMEOUT
+                                                     : HAL_TIMELINE_CALL;
+
   switch (mHalWrapperState) {
     case HAL_WRAPPER_STATE_CLOSING:
       if (event == HAL_WRAPPER_TIMEOUT_EVT) {
         STLOG_HAL_D("NFC-NCI HAL: %s  Timeout. Close anyway", __func__);
         HalSendDownstreamStopTimer(mHalHandle);
         hal_fd_close();
-        mHalWrapperState = HAL_WRAPPER_STATE_CLOSED;
+        halWrapperSetState(HAL_WRAPPER_STATE_CLOSED);
+        halWrapperCloseDone();
         return;
       }
       break;
@@ -847,8 +1223,9 @@ static void halWrapperCallback(uint8_t event,
       if (event == HAL_WRAPPER_TIMEOUT_EVT) {
         STLOG_HAL_E("NFC-NCI HAL: %s  Timeout accessing the CLF.", __func__);
         HalSendDownstreamStopTimer(mHalHandle);
+        halWrapperFdInitJoin();
         I2cRecovery();
-        HalEventLogger::getInstance().log()
+        HAL_EVENT_LOG()
             << __func__ << " Timeout accessing the CLF."
             << " mHalWrapperState="
             << hal_wrapper_state_to_str(mHalWrapperState)
@@ -872,7 +1249,7 @@ static void halWrapperCallback(uint8_t event,
       if (event == HAL_WRAPPER_TIMEOUT_EVT) {
         STLOG_HAL_E("%s - Timer for FW update procedure timeout, retry",
                     __func__);
-        HalEventLogger::getInstance().log()
+        HAL_EVENT_LOG()
             << __func__ << " Timer for FW update procedure timeout, retry"
             << " mHalWrapperState="
             << hal_wrapper_state_to_str(mHalWrapperState)
@@ -883,13 +1260,15 @@ static void halWrapperCallback(uint8_t event,
         HalSendDownstreamStopTimer(mHalHandle);
         resetHandlerState();
         I2cResetPulse();
-        mHalWrapperState = HAL_WRAPPER_STATE_OPEN;
+        halWrapperSetState(HAL_WRAPPER_STATE_OPEN);
       }
       break;
 
     case HAL_WRAPPER_STATE_NFC_ENABLE_ON:
       if (event == HAL_WRAPPER_TIMEOUT_EVT) {
         // timeout
+        // Stop the timer, it would send CORE_INIT_CMD again each time
+        HalSendDownstreamStopTimer(mHalHandle);
         // Send CORE_INIT_CMD
         STLOG_HAL_V("%s - Sending CORE_INIT_CMD", __func__);
         if (!HalSendDownstream(mHalHandle, coreInitCmd, sizeof(coreInitCmd))) {
@@ -901,7 +1280,7 @@ static void halWrapperCallback(uint8_t event,
     case HAL_WRAPPER_STATE_PROP_CONFIG:
       if (event == HAL_WRAPPER_TIMEOUT_EVT) {
         STLOG_HAL_E("%s - Timer when sending conf parameters, retry", __func__);
-        HalEventLogger::getInstance().log()
+        HAL_EVENT_LOG()
             << __func__ << " Timer when sending conf parameters, retry"
             << " mHalWrapperState="
             << hal_wrapper_state_to_str(mHalWrapperState)
@@ -912,7 +1291,7 @@ static void halWrapperCallback(uint8_t event,
         HalSendDownstreamStopTimer(mHalHandle);
         resetHandlerState();
         I2cResetPulse();
-        mHalWrapperState = HAL_WRAPPER_STATE_OPEN;
+        halWrapperSetState(HAL_WRAPPER_STATE_OPEN);
       }
       break;
 
@@ -941,7 +1320,7 @@ static void halWrapperCallback(uint8_t event,
           p_data[5] = 0x00;
           data_len = 0x6;
           mHalWrapperDataCallback(data_len, p_data);
-          mHalWrapperState = HAL_WRAPPER_STATE_RECOVERY;
+          halWrapperSetState(HAL_WRAPPER_STATE_RECOVERY);
         }
         return;
       }
@@ -950,8 +1329,8 @@ static void halWrapperCallback(uint8_t event,
     case HAL_WRAPPER_STATE_EXIT_HIBERNATE_INTERNAL:
       if (event == HAL_WRAPPER_TIMEOUT_EVT) {
         STLOG_HAL_E("NFC-NCI HAL: %s  Timeout at state: %s", __func__,
-                    hal_wrapper_state_to_str(mHalWrapperState).c_str());
-        HalEventLogger::getInstance().log()
+                    hal_wrapper_state_to_str(mHalWrapperState));
+        HAL_EVENT_LOG()
             << __func__ << " Timer when sending conf parameters, retry"
             << " mHalWrapperState="
             << hal_wrapper_state_to_str(mHalWrapperState)
@@ -967,7 +1346,7 @@ static void halWrapperCallback(uint8_t event,
         p_data[5] = 0x00;
         data_len = 0x6;
         mHalWrapperDataCallback(data_len, p_data);
-        mHalWrapperState = HAL_WRAPPER_STATE_OPEN;
+        halWrapperSetState(HAL_WRAPPER_STATE_OPEN);
         return;
       }
       break;
@@ -975,9 +1354,9 @@ static void halWrapperCallback(uint8_t event,
     default:
       if (event == HAL_WRAPPER_TIMEOUT_EVT) {
         STLOG_HAL_E("NFC-NCI HAL: %s  Timeout at state: %s", __func__,
-                    hal_wrapper_state_to_str(mHalWrapperState).c_str());
+                    hal_wrapper_state_to_str(mHalWrapperState));
         if (!storedLog) {
-          HalEventLogger::getInstance().log()
+          HAL_EVENT_LOG()
               << __func__ << " Timeout at state: "
               << hal_wrapper_state_to_str(mHalWrapperState)
               << " mIsActiveRW=" << mIsActiveRW
@@ -1004,7 +1383,7 @@ static void halWrapperCallback(uint8_t event,
 void hal_wrapper_set_state(hal_wrapper_state_e new_wrapper_state) {
   ALOGD("nfc_set_state %d->%d", mHalWrapperState, new_wrapper_state);
 
-  mHalWrapperState = new_wrapper_state;
+  halWrapperSetState(new_wrapper_state);
 }
 
 /*******************************************************************************
@@ -1035,6 +1414,18 @@ void hal_wrapper_dumplog(int fd) {
   ALOGD("%s : fd= %d", __func__, fd);
 
   HalEventLogger::getInstance().dump_log(fd);
+  halWrapperTimelineDump(fd);
+  I2cDump(fd);
+  HalDump(fd);
+
+  pthread_mutex_lock(&sCloseMutex);
+  dprintf(fd,
+          "Close: %u, timeouts %u, last %.3f ms, avg %.3f ms, max %.3f ms\n",
+          sCloseStats.count, sCloseStats.timeouts, sCloseStats.lastUs / 1000.0,
+          sCloseStats.count ? sCloseStats.sumUs / 1000.0 / sCloseStats.count
+                            : 0.0,
+          sCloseStats.maxUs / 1000.0);
+  pthread_mutex_unlock(&sCloseMutex);
 }
 
 /*******************************************************************************
@@ -1043,10 +1434,10 @@ void hal_wrapper_dumplog(int fd) {
 **
 ** Description      convert wrapper state to string
 **
-** Returns          string
+** Returns          static string, no allocation
 **
 *******************************************************************************/
-static std::string hal_wrapper_state_to_str(uint16_t event) {
+static const char* hal_wrapper_state_to_str(uint16_t event) {
   switch (event) {
     case HAL_WRAPPER_STATE_CLOSED:
       return "HAL_WRAPPER_STATE_CLOSED";
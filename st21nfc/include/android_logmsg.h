@@ -39,6 +39,14 @@ extern int GetNumValue(const char* name, void* p_value, unsigned long len);
 extern int GetByteArrayValue(const char* name, char* pValue, long bufflen,
                              long* len);
 extern int GetStrValue(const char* name, char* pValue, unsigned long l);
+/* Keys resolve a setting name once, for lookups on the data path */
+extern int GetConfigKey(const char* name);
+extern int GetNumValueByKey(int key, void* p_value, unsigned long len);
+extern int GetStrValueByKey(int key, char* pValue, unsigned long l);
+/* Called on the watcher thread after the config files were read again */
+typedef void (*config_listener_t)(void);
+extern void RegisterConfigListener(config_listener_t listener);
+extern void StartConfigWatcher(void);
 
 /* #######################
  * Set the log module name in .conf file
@@ -60,6 +68,17 @@ extern int GetStrValue(const char* name, char* pValue, unsigned long l);
 #define NAME_STNFC_FW_SWP_LOG_SIZE "STNFC_FW_SWP_LOG_SIZE"
 #define NAME_STNFC_FW_RF_LOG_SIZE "STNFC_FW_RF_LOG_SIZE"
 #define NAME_STNFC_REMOTE_FIELD_TIMER "STNFC_REMOTE_FIELD_TIMER"
+#define NAME_STNFC_CONFIG_LIVE_RELOAD "STNFC_CONFIG_LIVE_RELOAD"
+#define NAME_STNFC_FW_RESUME "STNFC_FW_RESUME"
+#define NAME_STNFC_HAL_SINGLE_LOOP "STNFC_HAL_SINGLE_LOOP"
+#define NAME_STNFC_I2C_THREAD_PRIORITY "STNFC_I2C_THREAD_PRIORITY"
+#define NAME_STNFC_I2C_THREAD_AFFINITY "STNFC_I2C_THREAD_AFFINITY"
+#define NAME_STNFC_HAL_THREAD_PRIORITY "STNFC_HAL_THREAD_PRIORITY"
+#define NAME_STNFC_HAL_THREAD_AFFINITY "STNFC_HAL_THREAD_AFFINITY"
+#define NAME_STNFC_ADAPTIVE_TIMEOUT "STNFC_ADAPTIVE_TIMEOUT"
+#define NAME_STNFC_NCI_REASSEMBLY "STNFC_NCI_REASSEMBLY"
+#define NAME_STNFC_CONFIG_CACHE "STNFC_CONFIG_CACHE"
+#define NAME_STNFC_ROUTING_CACHE "STNFC_ROUTING_CACHE"
 
 /* #######################
  * Set the logging level
@@ -72,27 +91,39 @@ extern int GetStrValue(const char* name, char* pValue, unsigned long l);
 #define STNFC_TRACE_LEVEL_MASK 0x0F
 #define STNFC_TRACE_FLAG_PRIVACY 0x10
 
+/* #######################
+ * Set the build-time logging level
+ * Messages above this level are compiled out: the runtime level check and
+ * the evaluation of their arguments disappear from the binary.
+ * Overridden per build target in Android.bp.
+ * ######################## */
+#ifndef STNFC_TRACE_LEVEL_BUILD
+#define STNFC_TRACE_LEVEL_BUILD STNFC_TRACE_LEVEL_VERBOSE
+#endif
+
+#define STLOG_HAL_ENABLED(level)           \
+  ((STNFC_TRACE_LEVEL_BUILD >= (level)) && \
+   ((hal_trace_level & STNFC_TRACE_LEVEL_MASK) >= (level)))
+
 #define STLOG_HAL_V(...)                                      \
   {                                                           \
-    if ((hal_trace_level & STNFC_TRACE_LEVEL_MASK) >=         \
-        STNFC_TRACE_LEVEL_VERBOSE)                            \
+    if (STLOG_HAL_ENABLED(STNFC_TRACE_LEVEL_VERBOSE))         \
       LOG_PRI(ANDROID_LOG_VERBOSE, HAL_LOG_TAG, __VA_ARGS__); \
   }
-#define STLOG_HAL_D(...)                                                       \
-  {                                                                            \
-    if ((hal_trace_level & STNFC_TRACE_LEVEL_MASK) >= STNFC_TRACE_LEVEL_DEBUG) \
-      LOG_PRI(ANDROID_LOG_DEBUG, HAL_LOG_TAG, __VA_ARGS__);                    \
+#define STLOG_HAL_D(...)                                    \
+  {                                                         \
+    if (STLOG_HAL_ENABLED(STNFC_TRACE_LEVEL_DEBUG))         \
+      LOG_PRI(ANDROID_LOG_DEBUG, HAL_LOG_TAG, __VA_ARGS__); \
   }
 #define STLOG_HAL_W(...)                                   \
   {                                                        \
-    if ((hal_trace_level & STNFC_TRACE_LEVEL_MASK) >=      \
-        STNFC_TRACE_LEVEL_WARNING)                         \
+    if (STLOG_HAL_ENABLED(STNFC_TRACE_LEVEL_WARNING))      \
       LOG_PRI(ANDROID_LOG_WARN, HAL_LOG_TAG, __VA_ARGS__); \
   }
-#define STLOG_HAL_E(...)                                                       \
-  {                                                                            \
-    if ((hal_trace_level & STNFC_TRACE_LEVEL_MASK) >= STNFC_TRACE_LEVEL_ERROR) \
-      LOG_PRI(ANDROID_LOG_ERROR, HAL_LOG_TAG, __VA_ARGS__);                    \
+#define STLOG_HAL_E(...)                                    \
+  {                                                         \
+    if (STLOG_HAL_ENABLED(STNFC_TRACE_LEVEL_ERROR))         \
+      LOG_PRI(ANDROID_LOG_ERROR, HAL_LOG_TAG, __VA_ARGS__); \
   }
 /*******************************************************************************
 **
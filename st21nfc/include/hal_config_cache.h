@@ -0,0 +1,81 @@
+/** ----------------------------------------------------------------------
+ *
+ * Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ ----------------------------------------------------------------------*/
+#ifndef HAL_CONFIG_CACHE_H_
+#define HAL_CONFIG_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Values of the NFCC parameters, learned from the CORE_SET_CONFIG commands
+ * the NFCC accepted and from the CORE_GET_CONFIG and proprietary GET_CONFIG
+ * responses, and the last listen mode routing table the NFCC accepted.
+ * Forgotten on CORE_RESET. Called from the HAL core thread, in the order the
+ * commands go to the NFCC. */
+#define HAL_CONFIG_CACHE_VALUE_MAX 32 /* longer parameters are not cached */
+#define HAL_CONFIG_CACHE_PROP 4       /* proprietary GET_CONFIG answers */
+#define HAL_CONFIG_CACHE_ROUTING 16   /* RF_SET_LISTEN_MODE_ROUTING_CMDs */
+
+/**
+ * Forget everything and read STNFC_CONFIG_CACHE and STNFC_ROUTING_CACHE.
+ */
+void HalConfigCacheSetup();
+
+/**
+ * Answer a command going to the NFCC from the cache: a GET_CONFIG, or a
+ * message of a routing table identical to the previous one.
+ * @param cmd NCI command
+ * @param length Size of the command
+ * @param rsp buffer of MAX_BUFFER_SIZE bytes for the response
+ * @param rspLength Size of the response
+ * @return true if the response is to be given instead of sending the command
+ */
+bool HalConfigCacheLookup(const uint8_t* cmd, size_t length, uint8_t* rsp,
+                          size_t* rspLength);
+
+/**
+ * The messages of a routing table answered by HalConfigCacheLookup() when a
+ * later one differs: they go to the NFCC first, one at a time.
+ * @param cmd buffer of MAX_BUFFER_SIZE bytes for the next message
+ * @param length Size of the message
+ * @return false if there is none
+ */
+bool HalConfigCacheReplay(uint8_t* cmd, size_t* length);
+
+/**
+ * A command went to the NFCC, its response is to be learned.
+ * @param cmd NCI command or segment
+ * @param length Size of the command
+ */
+void HalConfigCacheSent(const uint8_t* cmd, size_t length);
+
+/**
+ * A packet came from the NFCC.
+ * @param data NCI packet
+ * @param length Size of the packet
+ * @return true if it answers HalConfigCacheReplay(), not for the stack
+ */
+bool HalConfigCacheReceived(const uint8_t* data, size_t length);
+
+/**
+ * Print the hits and misses.
+ * @param fd file descriptor to write to
+ */
+void HalConfigCacheDump(int fd);
+
+#endif  // HAL_CONFIG_CACHE_H_
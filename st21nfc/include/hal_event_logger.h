@@ -20,6 +20,13 @@
 #include <sstream>
 #include <string>
 
+// Entry point for event log lines. The stream arguments are only evaluated
+// when event logging is enabled in the configuration.
+#define HAL_EVENT_LOG()                              \
+  if (!HalEventLogger::getInstance().isEnabled()) { \
+  } else                                             \
+    HalEventLogger::getInstance().log()
+
 class HalEventLogger {
  public:
   static HalEventLogger& getInstance();
@@ -27,14 +34,16 @@ class HalEventLogger {
   void dump_log(int fd);
   void initialize();
   void store_log();
+  bool isEnabled() const { return logging_enabled; }
 
   template <typename T>
   HalEventLogger& operator<<(const T& value) {
-    ss << value;
+    if (logging_enabled) ss << value;
     return *this;
   }
   HalEventLogger& operator<<(std::ostream& (*manip)(std::ostream&)) {
-    if (manip == static_cast<std::ostream& (*)(std::ostream&)>(std::endl)) {
+    if (logging_enabled &&
+        manip == static_cast<std::ostream& (*)(std::ostream&)>(std::endl)) {
       ss << std::endl;
     }
     return *this;
@@ -45,6 +54,6 @@ class HalEventLogger {
   HalEventLogger(const HalEventLogger&) = delete;
   HalEventLogger& operator=(const HalEventLogger&) = delete;
   std::stringstream ss;
-  bool logging_enabled;
+  bool logging_enabled = false;
   std::string EventFilePath;
 };
\ No newline at end of file
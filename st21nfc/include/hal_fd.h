@@ -50,6 +50,14 @@ typedef struct FWCap {
   uint8_t ExitFrameSupport;
 } FWCap;
 
+/*
+ *Raw APDU of the FW patch, located in the mapped FW patch file
+ */
+typedef struct FWApdu {
+  uint32_t offset;
+  uint16_t length;
+} FWApdu;
+
 typedef enum {
   //  HAL_FD_STATE_GET_ATR,
   HAL_FD_STATE_AUTHENTICATE,
@@ -90,6 +98,7 @@ typedef enum {
 /* Function declarations */
 int hal_fd_init();
 void hal_fd_close();
+void hal_fd_power_cycle();
 uint8_t ft_cmd_HwReset(uint8_t* pdata, uint8_t* clf_mode);
 void ExitHibernateHandler(HALHANDLE mHalHandle, uint16_t data_len,
                           uint8_t* p_data);
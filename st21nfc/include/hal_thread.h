@@ -0,0 +1,85 @@
+/** ----------------------------------------------------------------------
+ *
+ * Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ ----------------------------------------------------------------------*/
+#ifndef HAL_THREAD_H_
+#define HAL_THREAD_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <atomic>
+
+/* *_THREAD_PRIORITY values, on the kernel priority scale */
+#define HAL_THREAD_PRIO_DEFAULT 0   // keep the attributes of the creator
+#define HAL_THREAD_PRIO_FIFO_MAX 99  // 1..99: SCHED_FIFO priority
+#define HAL_THREAD_PRIO_NICE_0 120   // 100..139: nice -20..19
+
+/* Scheduling settings and wakeup latency of one HAL thread. The latency is
+ * measured from the first message posted to the sleeping thread to the
+ * thread handling it. */
+typedef struct {
+  const char* name;
+  pid_t tid;               // 0 while the thread does not run
+  int priority;            // *_THREAD_PRIORITY applied
+  unsigned long affinity;  // *_THREAD_AFFINITY applied, 0 for all CPUs
+  std::atomic<uint64_t> postedUs;  // first message not handled yet, or 0
+  uint32_t wakeups;
+  uint64_t latencyTotalUs;
+  uint64_t latencyMaxUs;
+} HalThread;
+
+/**
+ * Apply the scheduling settings to the calling thread and reset its stats.
+ * Failures are logged, the thread runs with its current settings then.
+ * @param t thread
+ * @param name name in the logs and dump
+ * @param prioName setting holding the priority, see HAL_THREAD_PRIO_*, NULL
+ * to keep the current one
+ * @param affinityName setting holding the CPU mask, NULL to keep the current
+ * one
+ */
+void HalThreadSetup(HalThread* t, const char* name, const char* prioName,
+                    const char* affinityName);
+
+/**
+ * A message was posted to the thread, from any thread.
+ * @param t thread
+ */
+void HalThreadPost(HalThread* t);
+
+/**
+ * The thread woke up to handle the posted messages.
+ * @param t thread
+ */
+void HalThreadRun(HalThread* t);
+
+/**
+ * The thread exits.
+ * @param t thread
+ */
+void HalThreadExit(HalThread* t);
+
+/**
+ * Print the settings, the wakeup latency and the run queue wait time of the
+ * thread.
+ * @param t thread
+ * @param fd file descriptor to write to
+ */
+void HalThreadDump(HalThread* t, int fd);
+
+#endif  // HAL_THREAD_H_
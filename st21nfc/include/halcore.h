@@ -42,6 +42,7 @@
 
 #define HAL_FLAG_NO_DEBUG 0 /* disable debug output */
 #define HAL_FLAG_DEBUG 1    /* enable debug output */
+#define HAL_FLAG_SINGLE_LOOP 2 /* no worker thread, see HalProcessEvents() */
 
 typedef enum {
   HAL_WRAPPER_STATE_CLOSED,
@@ -72,7 +73,9 @@ HALHANDLE HalCreate(void* context, HAL_CALLBACK callback, uint32_t flags);
 
 void HalDestroy(HALHANDLE hHAL);
 
-/* send an NCI frame from the HOST to the CLF */
+/* send an NCI frame from the HOST to the CLF. A data message larger than the
+ * max payload of its connection, up to HAL_MAX_MESSAGE_SIZE, goes in
+ * segments; above 255 bytes of payload its length byte is ignored. */
 bool HalSendDownstream(HALHANDLE hHAL, const uint8_t* data, size_t size);
 
 // HAL WRAPPER
@@ -80,12 +83,25 @@ bool HalSendDownstreamTimer(HALHANDLE hHAL, const uint8_t* data, size_t size,
                             uint32_t duration);
 bool HalSendDownstreamTimer(HALHANDLE hHAL, uint32_t duration);
 bool HalSendDownstreamStopTimer(HALHANDLE hHAL);
+/* drop the frames posted and not sent yet, before the CLF is reset */
+bool HalFlushDownstream(HALHANDLE hHAL);
 
 /* send a complete HDLC frame from the CLF to the HOST */
 bool HalSendUpstream(HALHANDLE hHAL, const uint8_t* data, size_t size);
 
+/* HAL_FLAG_SINGLE_LOOP: the caller's event loop polls HalGetEventFd() for
+ * POLLIN, with HalGetTimeout() as timeout, and then calls
+ * HalProcessEvents(). */
+int HalGetEventFd(HALHANDLE hHAL);
+int HalGetTimeout(HALHANDLE hHAL);
+void HalProcessEvents(HALHANDLE hHAL);
+
+/* print the HAL core stats for dumpsys */
+void HalDump(int fd);
+
 void hal_wrapper_set_state(hal_wrapper_state_e new_wrapper_state);
 void hal_wrapper_setFwLogging(bool enable);
 void I2cResetPulse();
 void hal_wrapper_dumplog(int fd);
+void hal_wrapper_frame_sent();
 #endif
@@ -0,0 +1,49 @@
+/** ----------------------------------------------------------------------
+ *
+ * Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ ----------------------------------------------------------------------*/
+#ifndef HEX_DECODE_H_
+#define HEX_DECODE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* HexDecode() flags */
+#define HEX_DECODE_SEPARATORS 0x01  // ',', ':' and '-' end a group of digits
+#define HEX_DECODE_SKIP_SPACES 0x02  // spaces do not end a group of digits
+#define HEX_DECODE_PAD_ODD 0x04      // odd group read with a leading '0'
+
+/* HexDecode() errors */
+#define HEX_DECODE_INVALID (-1)  // character not allowed
+#define HEX_DECODE_ODD (-2)      // odd number of digits in a group
+
+/**
+ * Decode ASCII hex digits into bytes. Digits come in groups, separated by
+ * spaces (' ', '\t', '\r', '\n') and, with HEX_DECODE_SEPARATORS, by ',',
+ * ':' or '-'. Each group is read as a big endian number of (digits + 1) / 2
+ * bytes.
+ * @param in text to decode
+ * @param len length of in
+ * @param out decoded bytes, at most (len + 1) / 2
+ * @param flags HEX_DECODE_* flags
+ *
+ * @return number of bytes decoded, or HEX_DECODE_INVALID / HEX_DECODE_ODD
+ */
+ssize_t HexDecode(const char* in, size_t len, uint8_t* out, uint32_t flags);
+
+#endif  // HEX_DECODE_H_
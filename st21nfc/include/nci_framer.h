@@ -0,0 +1,70 @@
+/** ----------------------------------------------------------------------
+ *
+ * Copyright (C) 2018 ST Microelectronics S.A.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ ----------------------------------------------------------------------*/
+#ifndef NCI_FRAMER_H_
+#define NCI_FRAMER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define NCI_FRAMER_HEADER_SIZE 3
+#define NCI_FRAMER_MAX_FRAME (NCI_FRAMER_HEADER_SIZE + 255)
+#define NCI_FRAMER_IDLE 0x7E  // sent by the CLF when it has nothing to send
+
+/* Incremental NCI framer: bytes read from the CLF go in, in chunks of any
+ * size, complete frames come out. Idle bytes between frames are skipped and
+ * bytes that cannot start a frame are dropped (resynchronisation). */
+typedef struct {
+  uint8_t frame[NCI_FRAMER_MAX_FRAME];
+  size_t len;         // bytes of the current frame received so far
+  uint32_t frames;    // complete frames
+  uint32_t idle;      // idle bytes skipped
+  uint32_t junk;      // other bytes dropped
+  uint32_t resyncs;   // HAL_EVENT_JUNKRECEIVED-like events
+} NciFramer;
+
+/**
+ * Start a new frame, counters are kept.
+ * @param f framer
+ * @param junk true if the partial frame is dropped on a read error
+ */
+void NciFramerReset(NciFramer* f, bool junk);
+
+/**
+ * Number of bytes to read to complete the current frame: the header first,
+ * then the payload.
+ * @param f framer
+ *
+ * @return bytes missing, never 0
+ */
+size_t NciFramerNeeded(const NciFramer* f);
+
+/**
+ * Consume bytes read from the CLF, stopping after a complete frame.
+ * @param f framer
+ * @param data bytes read
+ * @param len number of bytes read
+ * @param complete set to true when f->frame holds a complete frame of
+ *                 f->len bytes; call NciFramerReset() once it is handled.
+ *
+ * @return number of bytes consumed
+ */
+size_t NciFramerPush(NciFramer* f, const uint8_t* data, size_t len,
+                     bool* complete);
+
+#endif  // NCI_FRAMER_H_